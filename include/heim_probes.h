@@ -0,0 +1,83 @@
+/*
+ * Copyright (c) 2026 Kungliga Tekniska Högskolan
+ * (Royal Institute of Technology, Stockholm, Sweden).
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the Institute nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE INSTITUTE AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE INSTITUTE OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Static probes (USDT) for SystemTap, bpftrace and DTrace.
+ *
+ * With --enable-usdt the probes are placed with <sys/sdt.h>; they are
+ * a single nop each until a tracer attaches, e.g.
+ *
+ *   bpftrace -e 'usdt:/usr/lib/libkdc.so:kdc:request__done
+ *                { @[str(arg0), arg1] = count(); }'
+ *
+ * Without it they expand to nothing and their arguments are not
+ * evaluated, so an argument may do work that is only wanted when
+ * tracing.
+ *
+ * Principals are given as three string arguments, realm and the
+ * first two name components, as tracers cannot walk a krb5_principal.
+ */
+
+#ifndef HEIM_PROBES_H
+#define HEIM_PROBES_H
+
+#ifdef HAVE_USDT
+
+#include <sys/sdt.h>
+
+#define HEIM_PROBE(p, n)		DTRACE_PROBE(p, n)
+#define HEIM_PROBE1(p, n, a)		DTRACE_PROBE1(p, n, a)
+#define HEIM_PROBE2(p, n, a, b)		DTRACE_PROBE2(p, n, a, b)
+#define HEIM_PROBE3(p, n, a, b, c)	DTRACE_PROBE3(p, n, a, b, c)
+#define HEIM_PROBE4(p, n, a, b, c, d)	DTRACE_PROBE4(p, n, a, b, c, d)
+#define HEIM_PROBE5(p, n, a, b, c, d, e) \
+    DTRACE_PROBE5(p, n, a, b, c, d, e)
+
+#else
+
+#define HEIM_PROBE(p, n)		do { } while (0)
+#define HEIM_PROBE1(p, n, a)		do { } while (0)
+#define HEIM_PROBE2(p, n, a, b)		do { } while (0)
+#define HEIM_PROBE3(p, n, a, b, c)	do { } while (0)
+#define HEIM_PROBE4(p, n, a, b, c, d)	do { } while (0)
+#define HEIM_PROBE5(p, n, a, b, c, d, e) do { } while (0)
+
+#endif
+
+#define HEIM_PROBE_REALM(p) \
+    ((p) != NULL && (p)->realm != NULL ? (const char *)(p)->realm : "")
+#define HEIM_PROBE_COMP(p, i) \
+    ((p) != NULL && (p)->name.name_string.len > (i) ? \
+     (const char *)(p)->name.name_string.val[(i)] : "")
+
+#endif /* HEIM_PROBES_H */
@@ -182,7 +182,7 @@ parse_keys(hdb_entry *ent, char *str)
 	    return 1;
 	key->key.keytype = tmp;
 	p = strsep(&str, ":");
-	ret = krb5_data_alloc(&key->key.keyvalue, (strlen(p) - 1) / 2 + 1);
+	ret = krb5_data_alloc(&key->key.keyvalue, (strlen(p) + 1) / 2);
 	if (ret)
 	    krb5_err (context, 1, ret, "krb5_data_alloc");
 	for(i = 0; i < strlen(p); i += 2) {
@@ -70,6 +70,9 @@ krb5_addresses explicit_addresses;
 size_t max_request_udp;
 size_t max_request_tcp;
 
+/* Maximum number of UDP datagrams to handle per wakeup */
+size_t udp_batch_size;
+
 
 static struct getarg_strings addresses_str;	/* addresses to listen on */
 
@@ -156,6 +159,7 @@ configure(krb5_context context, int argc, char **argv, int *optidx)
 {
     krb5_kdc_configuration *config;
     krb5_error_code ret;
+    int i;
     
     const char *p;
 
@@ -221,6 +225,14 @@ configure(krb5_context context, int argc, char **argv, int *optidx)
     if (ret)
 	krb5_err(context, 1, ret, "krb5_kdc_set_dbinfo");
 
+    /* Each request thread opens its own handle of every database */
+    for (i = 0; config->num_threads > 0 && i < config->num_db; i++) {
+	if (config->db[i]->hdb_capability_flags & HDB_CAP_F_ONE_HANDLE)
+	    krb5_errx(context, 1, "num-threads cannot be used with database "
+		      "%s, which may only be opened once per process",
+		      config->db[i]->hdb_name);
+    }
+
     if(max_request_str)
 	max_request_tcp = max_request_udp = parse_bytes(max_request_str, NULL);
 
@@ -282,6 +294,16 @@ configure(krb5_context context, int argc, char **argv, int *optidx)
     if(max_request_udp == 0)
 	max_request_udp = 64 * 1024;
 
+    {
+	int n = krb5_config_get_int_default(context, NULL, 1,
+					    "kdc", "udp-batch-size", NULL);
+	if (n < 1)
+	    n = 1;
+	else if (n > 1024)
+	    n = 1024;
+	udp_batch_size = n;
+    }
+
     if (port_str == NULL)
 	port_str = "+";
 
@@ -49,6 +49,15 @@ static struct port_desc *ports;
 static size_t num_ports;
 static pid_t bonjour_pid = -1;
 
+/* listener for [kdc]metrics-socket, shared by all workers */
+static krb5_socket_t metrics_fd = rk_INVALID_SOCKET;
+
+#if defined(HAVE_SYS_EPOLL_H) && defined(HAVE_EPOLL_CREATE1)
+#define KDC_USE_EPOLL 1
+/* the worker's epoll instance, -1 when using select() */
+static int epoll_fd = -1;
+#endif
+
 /*
  * add `family, port, protocol' to the list with duplicate suppresion.
  */
@@ -233,7 +242,8 @@ reinit_descrs (struct descr *d, int n)
 static void
 init_socket(krb5_context context,
 	    krb5_kdc_configuration *config,
-	    struct descr *d, krb5_address *a, int family, int type, int port)
+	    struct descr *d, krb5_address *a, int family, int type, int port,
+	    int reuseport)
 {
     krb5_error_code ret;
     struct sockaddr_storage __ss;
@@ -266,6 +276,23 @@ init_socket(krb5_context context,
 	setsockopt(d->s, SOL_SOCKET, SO_REUSEADDR, (void *)&one, sizeof(one));
     }
 #endif
+    if (reuseport) {
+#if defined(HAVE_SETSOCKOPT) && defined(SOL_SOCKET) && defined(SO_REUSEPORT)
+	int one = 1;
+
+	if (setsockopt(d->s, SOL_SOCKET, SO_REUSEPORT,
+		       (void *)&one, sizeof(one)) < 0) {
+	    krb5_warn(context, errno, "setsockopt(SO_REUSEPORT)");
+	    rk_closesocket(d->s);
+	    d->s = rk_INVALID_SOCKET;
+	    return;
+	}
+#else
+	rk_closesocket(d->s);
+	d->s = rk_INVALID_SOCKET;
+	return;
+#endif
+    }
     d->type = type;
     d->port = port;
 
@@ -295,13 +322,14 @@ init_socket(krb5_context context,
 
 /*
  * Allocate descriptors for all the sockets that we should listen on
- * and return the number of them.
+ * and return the number of them.  With `reuseport' the sockets are
+ * bound with SO_REUSEPORT so that several sets can share the ports.
  */
 
 static int
 init_sockets(krb5_context context,
 	     krb5_kdc_configuration *config,
-	     struct descr **desc)
+	     struct descr **desc, int reuseport)
 {
     krb5_error_code ret;
     size_t i, j;
@@ -316,7 +344,8 @@ init_sockets(krb5_context context,
 	if (ret)
 	    krb5_err (context, 1, ret, "krb5_get_all_server_addrs");
     }
-    parse_ports(context, config, port_str);
+    if (ports == NULL)
+	parse_ports(context, config, port_str);
     d = malloc(addresses.len * num_ports * sizeof(*d));
     if (d == NULL)
 	krb5_errx(context, 1, "malloc(%lu) failed",
@@ -325,7 +354,8 @@ init_sockets(krb5_context context,
     for (i = 0; i < num_ports; i++){
 	for (j = 0; j < addresses.len; ++j) {
 	    init_socket(context, config, &d[num], &addresses.val[j],
-			ports[i].family, ports[i].type, ports[i].port);
+			ports[i].family, ports[i].type, ports[i].port,
+			reuseport);
 	    if(d[num].s != rk_INVALID_SOCKET){
 		char a_str[80];
 		size_t len;
@@ -342,7 +372,8 @@ init_sockets(krb5_context context,
 	    }
 	}
     }
-    krb5_free_addresses (context, &addresses);
+    if (!explicit_addresses.len)
+	krb5_free_addresses (context, &addresses);
     d = realloc(d, num * sizeof(*d));
     if (d == NULL && num != 0)
 	krb5_errx(context, 1, "realloc(%lu) failed",
@@ -352,6 +383,186 @@ init_sockets(krb5_context context,
     return num;
 }
 
+/*
+ * descr type of the metrics listener, which is handled by
+ * handle_metrics() rather than as a UDP or TCP socket.
+ */
+#define DESCR_METRICS	(-1)
+
+/*
+ * Create the Unix socket the metrics are served on.
+ */
+
+static void
+init_metrics_socket(krb5_context context, krb5_kdc_configuration *config)
+{
+#ifdef HAVE_SYS_UN_H
+    struct sockaddr_un un;
+    krb5_socket_t s;
+    mode_t mask;
+    int ret;
+
+    if (config->metrics == NULL)
+	return;
+
+    memset(&un, 0, sizeof(un));
+    un.sun_family = AF_UNIX;
+    if (strlcpy(un.sun_path, config->metrics_socket,
+		sizeof(un.sun_path)) >= sizeof(un.sun_path)) {
+	krb5_warnx(context, "metrics-socket path too long: %s",
+		   config->metrics_socket);
+	return;
+    }
+
+    s = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (rk_IS_BAD_SOCKET(s)) {
+	krb5_warn(context, errno, "socket(AF_UNIX)");
+	return;
+    }
+    rk_cloexec(s);
+    unlink(un.sun_path);
+    /*
+     * Only the KDC's own user may read the metrics: create the socket
+     * that way rather than restrict it after the fact, the chmod() is
+     * for systems where bind() ignores the umask.
+     */
+    mask = umask(077);
+    ret = bind(s, (struct sockaddr *)&un, sizeof(un));
+    umask(mask);
+    if (ret < 0 ||
+	chmod(un.sun_path, 0600) < 0 ||
+	listen(s, SOMAXCONN) < 0) {
+	krb5_warn(context, errno, "metrics socket %s", un.sun_path);
+	rk_closesocket(s);
+	return;
+    }
+    socket_set_nonblocking(s, 1);
+    metrics_fd = s;
+    kdc_log(context, config, 5, "serving metrics on %s", un.sun_path);
+#else
+    if (config->metrics != NULL)
+	krb5_warnx(context, "metrics-socket is not supported on this platform");
+#endif
+}
+
+static void
+close_metrics_socket(krb5_kdc_configuration *config)
+{
+    if (rk_IS_BAD_SOCKET(metrics_fd))
+	return;
+    rk_closesocket(metrics_fd);
+    metrics_fd = rk_INVALID_SOCKET;
+    unlink(config->metrics_socket);
+}
+
+struct metrics_reply {
+    krb5_socket_t s;
+    char *text;
+};
+
+#ifdef ENABLE_PTHREAD_SUPPORT
+
+/*
+ * Write a metrics reply and close the connection.  The reply is small
+ * enough for the socket buffer, so this only blocks on a reader that
+ * isn't reading, and then for at most a second.
+ */
+
+static void *
+metrics_write(void *arg)
+{
+    struct metrics_reply *m = arg;
+
+    socket_set_nonblocking(m->s, 0);
+#if defined(HAVE_SETSOCKOPT) && defined(SOL_SOCKET) && defined(SO_SNDTIMEO)
+    {
+	struct timeval tv;
+
+	tv.tv_sec = 1;
+	tv.tv_usec = 0;
+	setsockopt(m->s, SOL_SOCKET, SO_SNDTIMEO, (void *)&tv, sizeof(tv));
+    }
+#endif
+    (void) net_write(m->s, m->text, strlen(m->text));
+    rk_closesocket(m->s);
+    free(m->text);
+    free(m);
+    return NULL;
+}
+
+#endif
+
+/*
+ * Accept a connection on the metrics socket and answer it with the
+ * current metrics.  The writing is done by a thread of its own so
+ * that a slow reader never holds up the requests on this thread;
+ * without threads the reply is written without blocking and a reader
+ * that isn't ready for it gets what fits.
+ */
+
+static void
+handle_metrics(krb5_context context, krb5_kdc_configuration *config,
+	       struct descr *d)
+{
+    struct metrics_reply *m;
+    krb5_error_code ret;
+    krb5_socket_t s;
+    char *text;
+
+    s = accept(d->s, NULL, NULL);
+    if (rk_IS_BAD_SOCKET(s)) {
+	if (rk_SOCK_ERRNO != EAGAIN && rk_SOCK_ERRNO != EINTR)
+	    krb5_warn(context, rk_SOCK_ERRNO, "accept");
+	return;
+    }
+
+    ret = krb5_kdc_metrics_format(context, config, &text);
+    if (ret) {
+	rk_closesocket(s);
+	return;
+    }
+    m = malloc(sizeof(*m));
+    if (m == NULL) {
+	free(text);
+	rk_closesocket(s);
+	return;
+    }
+    m->s = s;
+    m->text = text;
+
+#ifdef ENABLE_PTHREAD_SUPPORT
+    {
+	pthread_attr_t attr;
+	pthread_t thread;
+	sigset_t all, old;
+
+	/* Asynchronous signals are for the thread running loop() */
+	sigfillset(&all);
+	sigdelset(&all, SIGSEGV);
+	sigdelset(&all, SIGBUS);
+	sigdelset(&all, SIGFPE);
+	sigdelset(&all, SIGILL);
+	pthread_sigmask(SIG_BLOCK, &all, &old);
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	ret = pthread_create(&thread, &attr, metrics_write, m);
+	pthread_attr_destroy(&attr);
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+	if (ret == 0)
+	    return;
+	kdc_log(context, config, 4, "Failed to start metrics writer: %s",
+		strerror(ret));
+    }
+#endif
+    socket_set_nonblocking(m->s, 1);
+    if (send(m->s, m->text, strlen(m->text), 0) < 0)
+	kdc_log(context, config, 4, "Failed to write metrics: %s",
+		strerror(rk_SOCK_ERRNO));
+    rk_closesocket(m->s);
+    free(m->text);
+    free(m);
+}
+
 /*
  *
  */
@@ -415,6 +626,36 @@ send_reply(krb5_context context,
     }
 }
 
+/*
+ * Process the request in `buf, len' from `addr_string, sa', leaving
+ * any reply in `reply'.
+ */
+
+static krb5_error_code
+process_request(krb5_context context,
+		krb5_kdc_configuration *config,
+		void *buf, size_t len, krb5_boolean *prependlength,
+		const char *addr_string, struct sockaddr *sa,
+		int datagram_reply, krb5_data *reply)
+{
+    krb5_error_code ret;
+
+    krb5_kdc_update_time(NULL);
+
+    krb5_data_zero(reply);
+    ret = krb5_kdc_process_request(context, config,
+				   buf, len, reply, prependlength,
+				   addr_string, sa,
+				   datagram_reply);
+    if(request_log)
+	krb5_kdc_save_request(context, request_log, buf, len, reply, sa);
+    if(ret)
+	kdc_log(context, config, 0,
+		"Failed processing %lu byte request from %s",
+		(unsigned long)len, addr_string);
+    return ret;
+}
+
 /*
  * Handle the request in `buf, len' to socket `d'
  */
@@ -425,28 +666,543 @@ do_request(krb5_context context,
 	   void *buf, size_t len, krb5_boolean prependlength,
 	   struct descr *d)
 {
-    krb5_error_code ret;
     krb5_data reply;
     int datagram_reply = (d->type == SOCK_DGRAM);
 
-    krb5_kdc_update_time(NULL);
-
-    krb5_data_zero(&reply);
-    ret = krb5_kdc_process_request(context, config,
-				   buf, len, &reply, &prependlength,
-				   d->addr_string, d->sa,
-				   datagram_reply);
-    if(request_log)
-	krb5_kdc_save_request(context, request_log, buf, len, &reply, d->sa);
+    process_request(context, config, buf, len, &prependlength,
+		    d->addr_string, d->sa, datagram_reply, &reply);
     if(reply.length){
 	send_reply(context, config, prependlength, d, &reply);
 	krb5_data_free(&reply);
     }
-    if(ret)
+}
+
+#ifdef ENABLE_PTHREAD_SUPPORT
+#define KDC_USE_THREADS 1
+
+/*
+ * Request threads.  The thread running loop() reads requests and
+ * queues them; each request thread has its own krb5_context and
+ * configuration (and therefore its own database handles), processes
+ * requests with krb5_kdc_process_request() and sends the replies.
+ *
+ * Admission control: AS-REQs without pre-authentication, the first
+ * leg of a login and most of what clients send during login and retry
+ * storms, go on a separate queue that is only served when there is
+ * nothing else to do.  A request that has waited longer than its
+ * queue's delay budget is shed, with a KDC_ERR_SVC_UNAVAILABLE reply
+ * so that the client tries another KDC right away, or silently.
+ */
+
+#define JOB_NORMAL	0
+#define JOB_LOW		1
+
+struct kdc_job {
+    struct kdc_job *next;
+    struct descr d;		/* where to send the reply */
+    unsigned char *buf;
+    size_t len;
+    krb5_boolean prependlength;
+    struct timeval queued;
+    int prio;
+};
+
+struct request_thread {
+    pthread_t thread;
+    krb5_context context;
+    krb5_kdc_configuration config;
+    unsigned int reopen_gen;
+};
+
+static struct {
+    HEIMDAL_MUTEX mutex;
+    pthread_cond_t cond;
+    struct kdc_job *head[2];	/* JOB_NORMAL and JOB_LOW queues */
+    struct kdc_job **tail[2];
+    size_t queued;
+    size_t max_queued;
+    long max_delay[2];		/* ms, 0 for no limit */
+    unsigned long shed;
+    krb5_context context;	/* of the thread running loop() */
+    krb5_kdc_configuration *config;
+    unsigned int reopen_gen;
+    int shutdown;
+    int nthreads;
+    struct request_thread *threads;
+} pool = { HEIMDAL_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER };
+
+/*
+ * Returns non-zero if `buf, len' is an AS-REQ without any padata that
+ * authenticates the client.  Only the padata is decoded.
+ */
+
+static int
+unauthenticated_as_req_p(const unsigned char *p, size_t len)
+{
+    Der_class cl;
+    Der_type ty;
+    unsigned int tag;
+    size_t l, sz, lsz, i;
+    METHOD_DATA md;
+    int ret = 1;
+
+    /* AS-REQ ::= [APPLICATION 10] SEQUENCE { [1], [2], padata [3], ... } */
+    if (der_match_tag_and_length(p, len, ASN1_C_APPL, &ty, 10, &l, &sz) ||
+	ty != CONS)
+	return 0;
+    p += sz;
+    len -= sz;
+    if (der_match_tag_and_length(p, len, ASN1_C_UNIV, &ty, UT_Sequence,
+				 &l, &sz) || l > len - sz)
+	return 0;
+    p += sz;
+    len = l;
+
+    while (len > 0) {
+	if (der_get_tag(p, len, &cl, &ty, &tag, &sz) ||
+	    cl != ASN1_C_CONTEXT ||
+	    der_get_length(p + sz, len - sz, &l, &lsz) ||
+	    l > len - sz - lsz)
+	    return 0;
+	if (tag > 3)
+	    break;
+	if (tag == 3) {
+	    if (decode_METHOD_DATA(p + sz + lsz, l, &md, NULL))
+		return 0;
+	    for (i = 0; i < md.len; i++) {
+		switch (md.val[i].padata_type) {
+		case KRB5_PADATA_ENC_TIMESTAMP:
+		case KRB5_PADATA_PK_AS_REQ:
+		case KRB5_PADATA_PK_AS_REQ_WIN:
+		case KRB5_PADATA_FX_FAST:
+		case KRB5_PADATA_ENCRYPTED_CHALLENGE:
+		    ret = 0;
+		    break;
+		default:
+		    break;
+		}
+	    }
+	    free_METHOD_DATA(&md);
+	    break;
+	}
+	p += sz + lsz + l;
+	len -= sz + lsz + l;
+    }
+    return ret;
+}
+
+static void
+free_job(struct kdc_job *job)
+{
+    /* TCP connections are handed over to us, UDP sockets are not */
+    if (job->d.type == SOCK_STREAM)
+	rk_closesocket(job->d.s);
+    free(job->buf);
+    free(job);
+}
+
+static void
+shed_request(krb5_context context, krb5_kdc_configuration *config,
+	     struct kdc_job *job, long waited)
+{
+    krb5_data reply;
+
+    HEIMDAL_MUTEX_lock(&pool.mutex);
+    pool.shed++;
+    HEIMDAL_MUTEX_unlock(&pool.mutex);
+
+    kdc_log(context, config, 4, "Shedding %s request from %s after %ld ms",
+	    job->prio == JOB_LOW ? "unauthenticated" : "authenticated",
+	    job->d.addr_string, waited);
+
+    if (!config->admission_fail_fast)
+	return;
+    if (krb5_mk_error(context,
+		      KRB5KDC_ERR_SVC_UNAVAILABLE,
+		      NULL,
+		      NULL,
+		      NULL,
+		      NULL,
+		      NULL,
+		      NULL,
+		      &reply) == 0) {
+	send_reply(context, config, job->prependlength, &job->d, &reply);
+	krb5_data_free(&reply);
+    }
+}
+
+static void *
+request_thread_main(void *arg)
+{
+    struct request_thread *t = arg;
+    struct kdc_job *job;
+    struct timeval now;
+    unsigned int gen;
+    long waited;
+    int q;
+
+    for (;;) {
+	HEIMDAL_MUTEX_lock(&pool.mutex);
+	while (pool.head[JOB_NORMAL] == NULL && pool.head[JOB_LOW] == NULL &&
+	       !pool.shutdown)
+	    pthread_cond_wait(&pool.cond, &pool.mutex);
+	q = pool.head[JOB_NORMAL] != NULL ? JOB_NORMAL : JOB_LOW;
+	job = pool.head[q];
+	if (job != NULL) {
+	    pool.head[q] = job->next;
+	    if (pool.head[q] == NULL)
+		pool.tail[q] = &pool.head[q];
+	    pool.queued--;
+	}
+	gen = pool.reopen_gen;
+	HEIMDAL_MUTEX_unlock(&pool.mutex);
+
+	if (job == NULL)
+	    break;
+
+	if (gen != t->reopen_gen) {
+	    t->reopen_gen = gen;
+	    krb5_kdc_close_databases(t->context, &t->config);
+	}
+
+	if (pool.max_delay[job->prio]) {
+	    gettimeofday(&now, NULL);
+	    waited = (now.tv_sec - job->queued.tv_sec) * 1000 +
+		(now.tv_usec - job->queued.tv_usec) / 1000;
+	    if (waited > pool.max_delay[job->prio]) {
+		shed_request(t->context, &t->config, job, waited);
+		free_job(job);
+		continue;
+	    }
+	}
+
+	do_request(t->context, &t->config, job->buf, job->len,
+		   job->prependlength, &job->d);
+	free_job(job);
+    }
+    return NULL;
+}
+
+/*
+ * Queue the request in `buf, len' from `d' for a request thread.  On
+ * success the job owns `buf' and, for TCP, the connection in `d'.
+ * Returns non-zero if the caller should process the request itself.
+ */
+
+static int
+queue_request(struct descr *d, unsigned char *buf, size_t len,
+	      krb5_boolean prependlength)
+{
+    struct kdc_job *job;
+
+    if (pool.nthreads == 0)
+	return 1;
+
+    job = malloc(sizeof(*job));
+    if (job == NULL)
+	return 1;
+    job->next = NULL;
+    job->d = *d;
+    job->d.sa = (struct sockaddr *)&job->d.__ss;
+    job->d.buf = NULL;
+    job->buf = buf;
+    job->len = len;
+    job->prependlength = prependlength;
+    job->prio = JOB_NORMAL;
+    if (pool.max_delay[JOB_LOW] && unauthenticated_as_req_p(buf, len))
+	job->prio = JOB_LOW;
+    gettimeofday(&job->queued, NULL);
+
+    HEIMDAL_MUTEX_lock(&pool.mutex);
+    if (pool.queued >= pool.max_queued) {
+	HEIMDAL_MUTEX_unlock(&pool.mutex);
+	if (job->prio == JOB_LOW) {
+	    /* Full, the cheapest requests to turn away are these */
+	    shed_request(pool.context, pool.config, job, 0);
+	    free_job(job);
+	    return 0;
+	}
+	/* Busy, push back on the clients by doing it ourselves */
+	free(job);
+	return 1;
+    }
+    *pool.tail[job->prio] = job;
+    pool.tail[job->prio] = &job->next;
+    pool.queued++;
+    pthread_cond_signal(&pool.cond);
+    HEIMDAL_MUTEX_unlock(&pool.mutex);
+    return 0;
+}
+
+static void
+start_request_threads(krb5_context context, krb5_kdc_configuration *config)
+{
+    struct request_thread *t;
+    sigset_t all, old;
+    krb5_error_code ret;
+    int i, n = config->num_threads;
+
+    if (n <= 0)
+	return;
+
+    pool.threads = calloc(n, sizeof(pool.threads[0]));
+    if (pool.threads == NULL) {
+	kdc_log(context, config, 0, "Failed to allocate request threads");
+	return;
+    }
+    pool.head[JOB_NORMAL] = pool.head[JOB_LOW] = NULL;
+    pool.tail[JOB_NORMAL] = &pool.head[JOB_NORMAL];
+    pool.tail[JOB_LOW] = &pool.head[JOB_LOW];
+    pool.max_queued = n * 64;
+    pool.max_delay[JOB_NORMAL] = config->admission_max_delay;
+    pool.max_delay[JOB_LOW] = config->admission_low_max_delay;
+    pool.context = context;
+    pool.config = config;
+
+    /* Asynchronous signals are for the thread running loop() */
+    sigfillset(&all);
+    sigdelset(&all, SIGSEGV);
+    sigdelset(&all, SIGBUS);
+    sigdelset(&all, SIGFPE);
+    sigdelset(&all, SIGILL);
+    pthread_sigmask(SIG_BLOCK, &all, &old);
+
+    for (i = 0; i < n; i++) {
+	t = &pool.threads[pool.nthreads];
+
+	ret = krb5_copy_context(context, &t->context);
+	if (ret) {
+	    krb5_warn(context, ret, "krb5_copy_context");
+	    break;
+	}
+	t->config = *config;
+	t->config.db = NULL;
+	t->config.num_db = 0;
+	t->config.crypto_cache = NULL;
+	t->config.etype_cache = NULL;
+	ret = krb5_kdc_set_dbinfo(t->context, &t->config);
+	if (ret) {
+	    krb5_warn(context, ret, "krb5_kdc_set_dbinfo");
+	    krb5_free_context(t->context);
+	    break;
+	}
+	ret = pthread_create(&t->thread, NULL, request_thread_main, t);
+	if (ret) {
+	    krb5_warn(context, ret, "pthread_create");
+	    krb5_free_context(t->context);
+	    break;
+	}
+	pool.nthreads++;
+    }
+
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+    kdc_log(context, config, 0, "KDC started %d request threads",
+	    pool.nthreads);
+}
+
+static void
+stop_request_threads(void)
+{
+    struct request_thread *t;
+    int i, j;
+
+    if (pool.threads == NULL)
+	return;
+
+    HEIMDAL_MUTEX_lock(&pool.mutex);
+    pool.shutdown = 1;
+    pthread_cond_broadcast(&pool.cond);
+    HEIMDAL_MUTEX_unlock(&pool.mutex);
+
+    for (i = 0; i < pool.nthreads; i++) {
+	t = &pool.threads[i];
+	pthread_join(t->thread, NULL);
+	krb5_kdc_close_databases(t->context, &t->config);
+	for (j = 0; j < t->config.num_db; j++)
+	    (*t->config.db[j]->hdb_destroy)(t->context, t->config.db[j]);
+	free(t->config.db);
+	_kdc_crypto_cache_free(t->context, t->config.crypto_cache);
+	_kdc_etype_cache_free(t->config.etype_cache);
+	krb5_free_context(t->context);
+    }
+    free(pool.threads);
+    pool.threads = NULL;
+    pool.nthreads = 0;
+}
+#endif
+
+#if defined(HAVE_RECVMMSG) && defined(HAVE_SENDMMSG)
+#define KDC_UDP_BATCH 1
+
+/*
+ * Scratch space for receiving and answering up to `udp_batch_size'
+ * datagrams per wakeup, allocated once per worker.
+ */
+
+static struct {
+    size_t count;
+    unsigned char *bufs;
+    struct mmsghdr *msgs;
+    struct iovec *iov;
+    struct sockaddr_storage *addrs;
+    krb5_data *replies;
+} udp_batch;
+
+static int
+init_udp_batch(krb5_context context, krb5_kdc_configuration *config)
+{
+    size_t n = udp_batch_size;
+
+    if (udp_batch.count)
+	return 0;
+
+    udp_batch.bufs = malloc(n * max_request_udp);
+    udp_batch.msgs = calloc(n, sizeof(udp_batch.msgs[0]));
+    udp_batch.iov = calloc(n, sizeof(udp_batch.iov[0]));
+    udp_batch.addrs = calloc(n, sizeof(udp_batch.addrs[0]));
+    udp_batch.replies = calloc(n, sizeof(udp_batch.replies[0]));
+    if (udp_batch.bufs == NULL || udp_batch.msgs == NULL ||
+	udp_batch.iov == NULL || udp_batch.addrs == NULL ||
+	udp_batch.replies == NULL) {
 	kdc_log(context, config, 0,
-		"Failed processing %lu byte request from %s",
-		(unsigned long)len, d->addr_string);
+		"Failed to allocate UDP batch of %lu, "
+		"falling back to single datagrams", (unsigned long)n);
+	free(udp_batch.bufs);
+	free(udp_batch.msgs);
+	free(udp_batch.iov);
+	free(udp_batch.addrs);
+	free(udp_batch.replies);
+	memset(&udp_batch, 0, sizeof(udp_batch));
+	udp_batch_size = 1;
+	return ENOMEM;
+    }
+    udp_batch.count = n;
+    return 0;
+}
+
+/*
+ * Drain up to `udp_batch_size' datagrams from `d' with one
+ * recvmmsg(), process them and send all the replies with sendmmsg().
+ */
+
+static void
+handle_udp_batch(krb5_context context,
+		 krb5_kdc_configuration *config,
+		 struct descr *d)
+{
+    struct mmsghdr *msgs = udp_batch.msgs;
+    char addr_string[128];
+    krb5_boolean prependlength;
+    socklen_t namelen;
+    int i, n, nreplies, sent, r;
+
+    for (i = 0; i < (int)udp_batch.count; i++) {
+	udp_batch.iov[i].iov_base = udp_batch.bufs + i * max_request_udp;
+	udp_batch.iov[i].iov_len = max_request_udp;
+	memset(&msgs[i], 0, sizeof(msgs[i]));
+	msgs[i].msg_hdr.msg_name = &udp_batch.addrs[i];
+	msgs[i].msg_hdr.msg_namelen = sizeof(udp_batch.addrs[i]);
+	msgs[i].msg_hdr.msg_iov = &udp_batch.iov[i];
+	msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+
+    n = recvmmsg(d->s, msgs, udp_batch.count, MSG_DONTWAIT, NULL);
+    if (n < 0) {
+	if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+	    krb5_warn(context, errno, "recvmmsg");
+	return;
+    }
+
+    for (nreplies = 0, i = 0; i < n; i++) {
+	struct sockaddr *sa = (struct sockaddr *)&udp_batch.addrs[i];
+	krb5_data *reply = &udp_batch.replies[i];
+
+	namelen = msgs[i].msg_hdr.msg_namelen;
+	addr_to_string(context, sa, namelen,
+		       addr_string, sizeof(addr_string));
+
+	if (msgs[i].msg_len == max_request_udp) {
+	    krb5_warn(context, EMSGSIZE,
+		      "recvmmsg: truncated packet from %s, asking for TCP",
+		      addr_string);
+	    krb5_mk_error(context,
+			  KRB5KRB_ERR_RESPONSE_TOO_BIG,
+			  NULL,
+			  NULL,
+			  NULL,
+			  NULL,
+			  NULL,
+			  NULL,
+			  reply);
+	} else {
+#ifdef KDC_USE_THREADS
+	    if (pool.nthreads) {
+		struct descr req;
+		unsigned char *copy;
+
+		init_descr(&req);
+		req.s = d->s;
+		req.type = d->type;
+		memcpy(&req.__ss, sa, namelen);
+		req.sock_len = namelen;
+		strlcpy(req.addr_string, addr_string,
+			sizeof(req.addr_string));
+		copy = malloc(msgs[i].msg_len);
+		if (copy != NULL) {
+		    memcpy(copy, udp_batch.iov[i].iov_base, msgs[i].msg_len);
+		    if (queue_request(&req, copy, msgs[i].msg_len,
+				      FALSE) == 0)
+			continue;
+		    free(copy);
+		}
+	    }
+#endif
+	    prependlength = FALSE;
+	    process_request(context, config,
+			    udp_batch.iov[i].iov_base, msgs[i].msg_len,
+			    &prependlength, addr_string, sa, TRUE, reply);
+	}
+	if (reply->length == 0)
+	    continue;
+
+	kdc_log(context, config, 5,
+		"sending %lu bytes to %s", (unsigned long)reply->length,
+		addr_string);
+
+	/* pack the replies at the front of msgs[], nreplies <= i */
+	udp_batch.iov[i].iov_base = reply->data;
+	udp_batch.iov[i].iov_len = reply->length;
+	msgs[nreplies].msg_hdr.msg_name = sa;
+	msgs[nreplies].msg_hdr.msg_namelen = namelen;
+	msgs[nreplies].msg_hdr.msg_iov = &udp_batch.iov[i];
+	msgs[nreplies].msg_hdr.msg_iovlen = 1;
+	msgs[nreplies].msg_hdr.msg_control = NULL;
+	msgs[nreplies].msg_hdr.msg_controllen = 0;
+	msgs[nreplies].msg_hdr.msg_flags = 0;
+	nreplies++;
+    }
+
+    for (sent = 0; sent < nreplies; ) {
+	r = sendmmsg(d->s, msgs + sent, nreplies - sent, 0);
+	if (r < 0) {
+	    if (errno == EINTR)
+		continue;
+	    /* skip the datagram that failed and try the rest */
+	    addr_to_string(context, msgs[sent].msg_hdr.msg_name,
+			   msgs[sent].msg_hdr.msg_namelen,
+			   addr_string, sizeof(addr_string));
+	    kdc_log(context, config, 0, "sendmmsg(%s): %s", addr_string,
+		    strerror(errno));
+	    r = 1;
+	}
+	sent += r;
+    }
+
+    for (i = 0; i < n; i++)
+	krb5_data_free(&udp_batch.replies[i]);
 }
+#endif
 
 /*
  * Handle incoming data to the UDP socket in `d'
@@ -460,6 +1216,13 @@ handle_udp(krb5_context context,
     unsigned char *buf;
     ssize_t n;
 
+#ifdef KDC_UDP_BATCH
+    if (udp_batch_size > 1 && init_udp_batch(context, config) == 0) {
+	handle_udp_batch(context, config, d);
+	return;
+    }
+#endif
+
     buf = malloc(max_request_udp);
     if (buf == NULL){
 	kdc_log(context, config, 0, "Failed to allocate %lu bytes",
@@ -492,6 +1255,10 @@ handle_udp(krb5_context context,
 	    send_reply(context, config, FALSE, d, &data);
 	    krb5_data_free(&data);
 	} else {
+#ifdef KDC_USE_THREADS
+	    if (queue_request(d, buf, n, FALSE) == 0)
+		return;
+#endif
 	    do_request(context, config, buf, n, FALSE, d);
 	}
     }
@@ -509,6 +1276,14 @@ clear_descr(struct descr *d)
     d->s = rk_INVALID_SOCKET;
 }
 
+static void
+close_descrs(struct descr *d, unsigned int n)
+{
+    unsigned int i;
+
+    for (i = 0; i < n; i++)
+	clear_descr(&d[i]);
+}
 
 /* remove HTTP %-quoting from buf */
 static int
@@ -537,6 +1312,39 @@ de_http(char *buf)
 
 #define TCP_TIMEOUT 4
 
+#ifdef KDC_USE_EPOLL
+/*
+ * Events carry the descriptor index and the socket, so that events for
+ * a slot that was closed and re-used earlier in the same batch can be
+ * told apart.
+ */
+#define EPOLL_ISLIVE_IDX 0xffffffffU
+#define EPOLL_DATA(idx, s) (((uint64_t)(idx) << 32) | (uint32_t)(s))
+#define EPOLL_DATA_IDX(u) ((uint32_t)((u) >> 32))
+#define EPOLL_DATA_FD(u) ((int)(uint32_t)(u))
+
+static int
+epoll_add_fd(krb5_context context, int fd, uint32_t idx)
+{
+    struct epoll_event ev;
+
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.u64 = EPOLL_DATA(idx, fd);
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev) == -1) {
+	krb5_warn(context, errno, "epoll_ctl");
+	return -1;
+    }
+    return 0;
+}
+
+static int
+epoll_add_descr(krb5_context context, struct descr *d, int idx)
+{
+    return epoll_add_fd(context, d[idx].s, idx);
+}
+#endif
+
 /*
  * accept a new TCP connection on `d[parent]' and store it in `d[child]'
  */
@@ -560,6 +1368,9 @@ add_new_tcp (krb5_context context,
     }
 
 #ifdef FD_SETSIZE
+#ifdef KDC_USE_EPOLL
+    if (epoll_fd == -1)
+#endif
     if (s >= FD_SETSIZE) {
 	krb5_warnx(context, "socket FD too large");
 	rk_closesocket (s);
@@ -570,6 +1381,12 @@ add_new_tcp (krb5_context context,
     d[child].s = s;
     d[child].timeout = time(NULL) + TCP_TIMEOUT;
     d[child].type = SOCK_STREAM;
+#ifdef KDC_USE_EPOLL
+    if (epoll_fd != -1 && epoll_add_descr(context, d, child) != 0) {
+	clear_descr(&d[child]);
+	return;
+    }
+#endif
     addr_to_string (context,
 		    d[child].sa, d[child].sock_len,
 		    d[child].addr_string, sizeof(d[child].addr_string));
@@ -831,6 +1648,19 @@ handle_tcp(krb5_context context,
     if (ret < 0)
 	return;
     else if (ret == 1) {
+#ifdef KDC_USE_THREADS
+	if (pool.nthreads) {
+#ifdef KDC_USE_EPOLL
+	    if (epoll_fd != -1)
+		epoll_ctl(epoll_fd, EPOLL_CTL_DEL, d[idx].s, NULL);
+#endif
+	    if (queue_request(&d[idx], d[idx].buf, d[idx].len, TRUE) == 0) {
+		/* the connection and its buffer now belong to the job */
+		init_descr(&d[idx]);
+		return;
+	    }
+	}
+#endif
 	do_request(context, config,
 		   d[idx].buf, d[idx].len, TRUE, &d[idx]);
 	clear_descr(d + idx);
@@ -893,41 +1723,164 @@ next_min_free(krb5_context context, struct descr **d, unsigned int *ndescr)
 }
 
 static void
-loop(krb5_context context, krb5_kdc_configuration *config,
-     struct descr *d, unsigned int ndescr, int islive)
+check_reopen_db(krb5_context context, krb5_kdc_configuration *config)
 {
+    if (reopen_db_flag) {
+	reopen_db_flag = 0;
+	kdc_log(context, config, 3, "Closing open databases on SIGHUP");
+	krb5_kdc_close_databases(context, config);
+#ifdef KDC_USE_THREADS
+	HEIMDAL_MUTEX_lock(&pool.mutex);
+	pool.reopen_gen++;
+	HEIMDAL_MUTEX_unlock(&pool.mutex);
+#endif
+    }
+}
+
+/*
+ * Close TCP connections that have been idle for longer than
+ * TCP_TIMEOUT.
+ */
+
+static void
+expire_tcp(krb5_context context, krb5_kdc_configuration *config,
+	   struct descr *d, unsigned int ndescr, time_t now)
+{
+    size_t i;
+
+    for (i = 0; i < ndescr; i++) {
+	if (!rk_IS_BAD_SOCKET(d[i].s) && d[i].type == SOCK_STREAM &&
+	    d[i].timeout && d[i].timeout < now) {
+	    kdc_log(context, config, 1,
+		    "TCP-connection from %s expired after %lu bytes",
+		    d[i].addr_string, (unsigned long)d[i].len);
+	    clear_descr(&d[i]);
+	}
+    }
+}
+
+static void
+handle_descr(krb5_context context, krb5_kdc_configuration *config,
+	     struct descr **d, unsigned int *ndescr, size_t i)
+{
+    int min_free;
+
+    min_free = next_min_free(context, d, ndescr);
+
+    if ((*d)[i].type == SOCK_DGRAM)
+	handle_udp(context, config, &(*d)[i]);
+    else if ((*d)[i].type == SOCK_STREAM)
+	handle_tcp(context, config, *d, i, min_free);
+    else if ((*d)[i].type == DESCR_METRICS)
+	handle_metrics(context, config, &(*d)[i]);
+}
+
+#ifdef KDC_USE_EPOLL
+
+#define EPOLL_MAX_EVENTS 64
+
+/*
+ * Service the sockets in `d' with epoll(7), so that the cost of a
+ * wakeup is proportional to the number of ready descriptors rather
+ * than to the number of open connections.  Returns -1 without having
+ * done anything if epoll is not available at run-time.
+ */
+
+static int
+loop_epoll(krb5_context context, krb5_kdc_configuration *config,
+	   struct descr **d, unsigned int *ndescr, int islive)
+{
+    struct epoll_event events[EPOLL_MAX_EVENTS];
+    time_t next_expire = 0;
+    size_t i;
+    int n, j;
+
+    epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (epoll_fd == -1) {
+	krb5_warn(context, errno, "epoll_create1, falling back to select");
+	return -1;
+    }
+
+    if (islive > -1 && epoll_add_fd(context, islive, EPOLL_ISLIVE_IDX) != 0)
+	goto fail;
+    for (i = 0; i < *ndescr; i++) {
+	if (!rk_IS_BAD_SOCKET((*d)[i].s) &&
+	    epoll_add_descr(context, *d, i) != 0)
+	    goto fail;
+    }
+
+    while (exit_flag == 0) {
+	time_t now;
+
+	check_reopen_db(context, config);
+
+	n = epoll_wait(epoll_fd, events, EPOLL_MAX_EVENTS, TCP_TIMEOUT * 1000);
+	if (n == -1 && errno != EINTR)
+	    krb5_warn(context, errno, "epoll_wait");
+
+	for (j = 0; j < n; j++) {
+	    uint32_t idx = EPOLL_DATA_IDX(events[j].data.u64);
+
+#ifdef HAVE_FORK
+	    if (idx == EPOLL_ISLIVE_IDX) {
+		handle_islive(islive);
+		continue;
+	    }
+#endif
+	    if (idx >= *ndescr ||
+		(*d)[idx].s != EPOLL_DATA_FD(events[j].data.u64))
+		continue;
+	    handle_descr(context, config, d, ndescr, idx);
+	}
+
+	now = time(NULL);
+	if (now >= next_expire) {
+	    expire_tcp(context, config, *d, *ndescr, now);
+	    next_expire = now + 1;
+	}
+    }
+
+    close(epoll_fd);
+    epoll_fd = -1;
+    return 0;
 
+fail:
+    close(epoll_fd);
+    epoll_fd = -1;
+    return -1;
+}
+#endif
+
+static void
+loop_select(krb5_context context, krb5_kdc_configuration *config,
+	    struct descr **d, unsigned int *ndescr, int islive)
+{
     while (exit_flag == 0) {
 	struct timeval tmout;
 	fd_set fds;
-	int min_free = -1;
 	int max_fd = 0;
 	size_t i;
 
+	check_reopen_db(context, config);
+
+	expire_tcp(context, config, *d, *ndescr, time(NULL));
+
 	FD_ZERO(&fds);
         if (islive > -1) {
             FD_SET(islive, &fds);
             max_fd = islive;
         }
-	for (i = 0; i < ndescr; i++) {
-	    if (!rk_IS_BAD_SOCKET(d[i].s)) {
-		if (d[i].type == SOCK_STREAM &&
-		   d[i].timeout && d[i].timeout < time(NULL)) {
-		    kdc_log(context, config, 1,
-			    "TCP-connection from %s expired after %lu bytes",
-			    d[i].addr_string, (unsigned long)d[i].len);
-		    clear_descr(&d[i]);
-		    continue;
-		}
+	for (i = 0; i < *ndescr; i++) {
+	    if (!rk_IS_BAD_SOCKET((*d)[i].s)) {
 #ifndef NO_LIMIT_FD_SETSIZE
-		if (max_fd < d[i].s)
-		    max_fd = d[i].s;
+		if (max_fd < (*d)[i].s)
+		    max_fd = (*d)[i].s;
 #ifdef FD_SETSIZE
 		if (max_fd >= FD_SETSIZE)
 		    krb5_errx(context, 1, "fd too large");
 #endif
 #endif
-		FD_SET(d[i].s, &fds);
+		FD_SET((*d)[i].s, &fds);
 	    }
 	}
 
@@ -945,17 +1898,38 @@ loop(krb5_context context, krb5_kdc_configuration *config,
 	    if (islive > -1 && FD_ISSET(islive, &fds))
 		handle_islive(islive);
 #endif
-	    for (i = 0; i < ndescr; i++)
-		if (!rk_IS_BAD_SOCKET(d[i].s) && FD_ISSET(d[i].s, &fds)) {
-		    min_free = next_min_free(context, &d, &ndescr);
-
-		    if (d[i].type == SOCK_DGRAM)
-			handle_udp(context, config, &d[i]);
-		    else if (d[i].type == SOCK_STREAM)
-			handle_tcp(context, config, d, i, min_free);
-		}
+	    for (i = 0; i < *ndescr; i++)
+		if (!rk_IS_BAD_SOCKET((*d)[i].s) && FD_ISSET((*d)[i].s, &fds))
+		    handle_descr(context, config, d, ndescr, i);
 	}
     }
+}
+
+static void
+loop(krb5_context context, krb5_kdc_configuration *config,
+     struct descr **d, unsigned int *ndescr, int islive)
+{
+#ifdef KDC_USE_THREADS
+    start_request_threads(context, config);
+#endif
+
+    if (!rk_IS_BAD_SOCKET(metrics_fd)) {
+	int i = next_min_free(context, d, ndescr);
+
+	if (i >= 0) {
+	    (*d)[i].s = metrics_fd;
+	    (*d)[i].type = DESCR_METRICS;
+	}
+    }
+
+#ifdef KDC_USE_EPOLL
+    if (loop_epoll(context, config, d, ndescr, islive) != 0)
+#endif
+	loop_select(context, config, d, ndescr, islive);
+
+#ifdef KDC_USE_THREADS
+    stop_request_threads();
+#endif
 
     switch (exit_flag) {
     case -1:
@@ -1012,9 +1986,9 @@ kill_kids(pid_t *pids, int max_kids, int sig)
 
     for (i=0; i < max_kids; i++)
 	if (pids[i] > 0)
-	    kill(sig, pids[i]);
+	    kill(pids[i], sig);
     if (bonjour_pid > 0)
-        kill(sig, bonjour_pid);
+        kill(bonjour_pid, sig);
 }
 
 static int
@@ -1109,8 +2083,10 @@ start_kdc(krb5_context context,
     pid_t *pids;
     int max_kdcs = config->num_kdc_processes;
     int num_kdcs = 0;
-    int i;
+    int i, j, slot;
     int islive[2];
+    struct descr **wd = NULL;
+    unsigned int *wndescr = NULL;
 #endif
 
 #ifdef __APPLE__
@@ -1142,10 +2118,50 @@ start_kdc(krb5_context context,
     socket_set_nonblocking(islive[1], 1);
 #endif
 
-    ndescr = init_sockets(context, config, &d);
+#ifdef HAVE_FORK
+    /*
+     * With per-worker sockets every worker slot gets its own set of
+     * SO_REUSEPORT listeners so the kernel spreads the load over the
+     * workers instead of waking all of them for each packet.  The
+     * master holds on to the sets, so a restarted worker takes over
+     * the sockets (and any queued requests) of the one it replaces.
+     */
+    if (config->per_worker_sockets && !testing_flag && max_kdcs > 1) {
+	wd = calloc(max_kdcs, sizeof(*wd));
+	wndescr = calloc(max_kdcs, sizeof(*wndescr));
+	if (wd == NULL || wndescr == NULL)
+	    krb5_err(context, 1, errno, "malloc");
+	for (i = 0; i < max_kdcs; i++) {
+	    wndescr[i] = init_sockets(context, config, &wd[i], 1);
+	    if (wndescr[i] <= 0)
+		break;
+	}
+	if (i < max_kdcs) {
+	    kdc_log(context, config, 0,
+		    "Could not create per-worker sockets, "
+		    "using shared sockets");
+	    for (j = 0; j <= i; j++) {
+		close_descrs(wd[j], wndescr[j]);
+		free(wd[j]);
+	    }
+	    free(wd);
+	    free(wndescr);
+	    wd = NULL;
+	    wndescr = NULL;
+	}
+    }
+
+    if (wd != NULL) {
+	d = wd[0];
+	ndescr = wndescr[0];
+    } else
+#endif
+	ndescr = init_sockets(context, config, &d, 0);
     if(ndescr <= 0)
 	krb5_errx(context, 1, "No sockets!");
 
+    init_metrics_socket(context, config);
+
 #ifdef HAVE_FORK
 
 # ifdef __APPLE__
@@ -1165,6 +2181,16 @@ start_kdc(krb5_context context,
         /* Note that we might never execute the body of this loop */
         while (exit_flag == 0) {
 
+#ifdef SIGHUP
+            /* Pass SIGHUP on so workers re-open their databases */
+            if (reopen_db_flag) {
+                reopen_db_flag = 0;
+                for (i = 0; i < max_kdcs; i++)
+                    if (pids[i] > 0)
+                        kill(pids[i], SIGHUP);
+            }
+#endif
+
             if (num_kdcs >= max_kdcs) {
                 num_kdcs -= reap_kid(context, config, pids, max_kdcs, 0);
                 continue;
@@ -1173,11 +2199,24 @@ start_kdc(krb5_context context,
             if (num_kdcs > 0)
                 num_kdcs -= reap_kids(context, config, pids, max_kdcs);
 
+            for (slot = 0; slot < max_kdcs; slot++)
+                if (pids[slot] <= 0)
+                    break;
+
             pid = fork();
             switch (pid) {
             case 0:
                 close(islive[0]);
-                loop(context, config, d, ndescr, islive[1]);
+                if (wd != NULL) {
+                    /* Keep only this worker's sockets */
+                    for (i = 0; i < max_kdcs; i++)
+                        if (i != slot)
+                            close_descrs(wd[i], wndescr[i]);
+                    d = wd[slot];
+                    ndescr = wndescr[slot];
+                }
+                krb5_kdc_metrics_set_worker(slot);
+                loop(context, config, &d, &ndescr, islive[1]);
                 exit(0);
             case -1:
                 /* XXXrcd: hmmm, do something useful?? */
@@ -1186,13 +2225,9 @@ start_kdc(krb5_context context,
                 sleep(10);
                 break;
             default:
-		for (i = 0; i < max_kdcs; i++) {
-		    if (pids[i] <= 0) {
-			pids[i] = pid;
-			break;
-		    }
-		}
-                if (i >= max_kdcs) {
+                if (slot < max_kdcs) {
+                    pids[slot] = pid;
+                } else {
                     /* This should not happen */
                     kdc_log(context, config, 1,
                             "warning: forked untracked child process: %d",
@@ -1213,8 +2248,17 @@ start_kdc(krb5_context context,
         close(islive[1]);
 
         /* Close our listener sockets before terminating workers */
-        for (i = 0; i < ndescr; ++i)
-            clear_descr(&d[i]);
+        if (wd != NULL) {
+            /* wd[0] is `d' and is freed below */
+            for (i = 0; i < max_kdcs; i++) {
+                close_descrs(wd[i], wndescr[i]);
+                if (i > 0)
+                    free(wd[i]);
+            }
+            free(wd);
+            free(wndescr);
+        } else
+            close_descrs(d, ndescr);
 
         gettimeofday(&tv1, NULL);
         tv2 = tv1;
@@ -1258,13 +2302,15 @@ start_kdc(krb5_context context,
         kdc_log(context, config, 0, "KDC master process exiting", pid);
         free(pids);
     } else {
-        loop(context, config, d, ndescr, -1);
+        loop(context, config, &d, &ndescr, -1);
         kdc_log(context, config, 0, "KDC exiting", pid);
     }
 #else
-    loop(context, config, d, ndescr, -1);
+    loop(context, config, &d, &ndescr, -1);
     kdc_log(context, config, 0, "KDC exiting", pid);
 #endif
 
+    close_metrics_socket(config);
+
     free(d);
 }
@@ -0,0 +1,286 @@
+/*
+ * Copyright (c) 2026 Kungliga Tekniska Högskolan
+ * (Royal Institute of Technology, Stockholm, Sweden).
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the Institute nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE INSTITUTE AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE INSTITUTE OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+
+/*
+ * Cache of krb5_crypto objects for long-term keys.
+ *
+ * Setting up a krb5_crypto runs the key schedule and, on first use of
+ * each key usage, derives the usage keys.  The KDC uses the same few
+ * krbtgt and service keys for most requests, so keep the crypto
+ * objects around instead.  They are found by enctype and key material,
+ * so a changed key simply misses the cache and the old object ages out.
+ *
+ * A krb5_crypto is not safe to use from several threads at once, so
+ * the cache belongs to a configuration and each request thread has its
+ * own.  An object handed out by _kdc_get_crypto() is marked in use until
+ * it is given back with _kdc_release_crypto().
+ */
+
+#include "kdc_locl.h"
+
+#define CRYPTO_CACHE_BUCKETS 127
+
+struct crypto_node {
+    struct crypto_node *hnext;		/* hash chain */
+    struct crypto_node *prev;		/* LRU list, most recent first */
+    struct crypto_node *next;
+    unsigned long hash;
+    int in_use;
+    krb5_enctype etype;
+    krb5_keyblock key;
+    krb5_crypto crypto;
+};
+
+struct kdc_crypto_cache {
+    size_t count;
+    struct crypto_node *table[CRYPTO_CACHE_BUCKETS];
+    struct crypto_node *head;
+    struct crypto_node *tail;
+};
+
+static unsigned long
+key_hash(krb5_enctype etype, const krb5_keyblock *key)
+{
+    const unsigned char *p = key->keyvalue.data;
+    unsigned long h = 2166136261UL;
+    size_t i;
+
+    h = (h ^ (unsigned long)etype) * 16777619UL;
+    for (i = 0; i < key->keyvalue.length; i++)
+	h = (h ^ p[i]) * 16777619UL;
+    return h;
+}
+
+static void
+unlink_node(struct kdc_crypto_cache *c, struct crypto_node *n)
+{
+    struct crypto_node **pp;
+
+    for (pp = &c->table[n->hash % CRYPTO_CACHE_BUCKETS]; *pp; pp = &(*pp)->hnext) {
+	if (*pp == n) {
+	    *pp = n->hnext;
+	    break;
+	}
+    }
+    if (n->prev)
+	n->prev->next = n->next;
+    else
+	c->head = n->next;
+    if (n->next)
+	n->next->prev = n->prev;
+    else
+	c->tail = n->prev;
+    c->count--;
+}
+
+static void
+free_node(krb5_context context, struct crypto_node *n)
+{
+    if (n->crypto)
+	krb5_crypto_destroy(context, n->crypto);
+    krb5_free_keyblock_contents(context, &n->key);
+    free(n);
+}
+
+void
+_kdc_crypto_cache_free(krb5_context context, struct kdc_crypto_cache *c)
+{
+    struct crypto_node *n;
+
+    if (c == NULL)
+	return;
+    while ((n = c->head) != NULL) {
+	c->head = n->next;
+	free_node(context, n);
+    }
+    free(c);
+}
+
+/*
+ * Return a krb5_crypto for `key' used with `etype' (0 meaning the
+ * key's own enctype) in `crypto'.  It must be given back with
+ * _kdc_release_crypto() and not destroyed by the caller.
+ */
+
+krb5_error_code
+_kdc_get_crypto(krb5_context context,
+		krb5_kdc_configuration *config,
+		const krb5_keyblock *key,
+		krb5_enctype etype,
+		krb5_crypto *crypto)
+{
+    struct kdc_crypto_cache *c = config->crypto_cache;
+    struct crypto_node *n, *prev;
+    krb5_error_code ret;
+    unsigned long hash;
+
+    *crypto = NULL;
+
+    if (config->crypto_cache_size == 0)
+	return krb5_crypto_init(context, key, etype, crypto);
+
+    if (c == NULL) {
+	c = calloc(1, sizeof(*c));
+	if (c == NULL)
+	    return krb5_enomem(context);
+	config->crypto_cache = c;
+    }
+
+    if (etype == (krb5_enctype)ETYPE_NULL)
+	etype = key->keytype;
+    hash = key_hash(etype, key);
+
+    for (n = c->table[hash % CRYPTO_CACHE_BUCKETS]; n; n = n->hnext) {
+	if (n->hash == hash && n->etype == etype &&
+	    n->key.keytype == key->keytype &&
+	    n->key.keyvalue.length == key->keyvalue.length &&
+	    ct_memcmp(n->key.keyvalue.data, key->keyvalue.data,
+		      key->keyvalue.length) == 0)
+	    break;
+    }
+
+    if (n != NULL) {
+	/* the same key is already in use further up the call chain */
+	if (n->in_use)
+	    return krb5_crypto_init(context, key, etype, crypto);
+
+	if (n != c->head) {
+	    n->prev->next = n->next;
+	    if (n->next)
+		n->next->prev = n->prev;
+	    else
+		c->tail = n->prev;
+	    n->prev = NULL;
+	    n->next = c->head;
+	    c->head->prev = n;
+	    c->head = n;
+	}
+	n->in_use = 1;
+	*crypto = n->crypto;
+	return 0;
+    }
+
+    /* make room by dropping the least recently used idle objects */
+    for (n = c->tail; n != NULL && c->count >= config->crypto_cache_size; n = prev) {
+	prev = n->prev;
+	if (!n->in_use) {
+	    unlink_node(c, n);
+	    free_node(context, n);
+	}
+    }
+    if (c->count >= config->crypto_cache_size)
+	return krb5_crypto_init(context, key, etype, crypto);
+
+    n = calloc(1, sizeof(*n));
+    if (n == NULL)
+	return krb5_enomem(context);
+    ret = krb5_copy_keyblock_contents(context, key, &n->key);
+    if (ret) {
+	free(n);
+	return ret;
+    }
+    ret = krb5_crypto_init(context, key, etype, &n->crypto);
+    if (ret) {
+	free_node(context, n);
+	return ret;
+    }
+    n->hash = hash;
+    n->etype = etype;
+    n->in_use = 1;
+
+    n->hnext = c->table[hash % CRYPTO_CACHE_BUCKETS];
+    c->table[hash % CRYPTO_CACHE_BUCKETS] = n;
+    n->next = c->head;
+    if (c->head)
+	c->head->prev = n;
+    else
+	c->tail = n;
+    c->head = n;
+    c->count++;
+
+    *crypto = n->crypto;
+    return 0;
+}
+
+/*
+ * Give back a krb5_crypto from _kdc_get_crypto(), destroying it if it
+ * is not owned by the cache.
+ */
+
+void
+_kdc_release_crypto(krb5_context context,
+		    krb5_kdc_configuration *config,
+		    krb5_crypto crypto)
+{
+    struct kdc_crypto_cache *c = config->crypto_cache;
+    struct crypto_node *n;
+
+    if (crypto == NULL)
+	return;
+
+    /* objects in use were used recently, so they are near the head */
+    for (n = c ? c->head : NULL; n != NULL; n = n->next) {
+	if (n->crypto == crypto) {
+	    n->in_use = 0;
+	    return;
+	}
+    }
+    krb5_crypto_destroy(context, crypto);
+}
+
+/*
+ * Drop all cached objects that are not in use, and the cache itself
+ * once it is empty; it is set up again on next use.
+ */
+
+void
+_kdc_crypto_cache_flush(krb5_context context, krb5_kdc_configuration *config)
+{
+    struct kdc_crypto_cache *c = config->crypto_cache;
+    struct crypto_node *n, *next;
+
+    if (c == NULL)
+	return;
+    for (n = c->head; n != NULL; n = next) {
+	next = n->next;
+	if (!n->in_use) {
+	    unlink_node(c, n);
+	    free_node(context, n);
+	}
+    }
+    if (c->head == NULL) {
+	free(c);
+	config->crypto_cache = NULL;
+    }
+}
@@ -0,0 +1,230 @@
+/*
+ * Copyright (c) 2026 Kungliga Tekniska Högskolan
+ * (Royal Institute of Technology, Stockholm, Sweden).
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the Institute nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE INSTITUTE AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE INSTITUTE OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Routing of principals to databases.
+ *
+ * With several databases configured a lookup normally tries each of
+ * them in turn until one has the principal.  With "database-routing"
+ * enabled a table is built from the realm of each database and the
+ * principal patterns given as "route" in its [kdc] database stanza,
+ * and lookups that match a route only go to the databases it names.
+ * Principals that match no route are looked up in all databases as
+ * before.
+ */
+
+#include "kdc_locl.h"
+#include <fnmatch.h>
+
+enum route_type {
+    ROUTE_REALM,			/* realm equals s */
+    ROUTE_PREFIX,			/* unparsed name starts with s */
+    ROUTE_PATTERN			/* unparsed name matches glob s */
+};
+
+struct db_route {
+    enum route_type type;
+    int db_index;
+    char *s;
+    size_t len;
+};
+
+struct kdc_db_routes {
+    int num_db;
+    size_t num_routes;
+    struct db_route *routes;
+    int need_name;			/* some route needs the unparsed name */
+};
+
+static krb5_error_code
+add_route(krb5_context context, struct kdc_db_routes *r,
+	  int db_index, enum route_type type, const char *s)
+{
+    struct db_route *rt;
+    size_t len = strlen(s);
+
+    rt = realloc(r->routes, (r->num_routes + 1) * sizeof(r->routes[0]));
+    if (rt == NULL)
+	return krb5_enomem(context);
+    r->routes = rt;
+    rt = &r->routes[r->num_routes];
+
+    /* a trailing "*" and nothing else is a plain prefix */
+    if (type == ROUTE_PATTERN && len > 0 && s[len - 1] == '*' &&
+	strcspn(s, "*?[\\") == len - 1) {
+	type = ROUTE_PREFIX;
+	len--;
+    }
+
+    rt->type = type;
+    rt->db_index = db_index;
+    rt->len = len;
+    rt->s = strndup(s, len);
+    if (rt->s == NULL)
+	return krb5_enomem(context);
+    r->num_routes++;
+    if (type != ROUTE_REALM)
+	r->need_name = 1;
+    return 0;
+}
+
+krb5_error_code
+_kdc_db_routes_init(krb5_context context, krb5_kdc_configuration *config)
+{
+    struct hdb_dbinfo *info, *d;
+    struct kdc_db_routes *r;
+    krb5_error_code ret;
+    char **routes, **p;
+    const char *realm;
+    int i;
+
+    config->db_routes = NULL;
+
+    if (!krb5_config_get_bool_default(context, NULL, FALSE, "kdc",
+				      "database-routing", NULL))
+	return 0;
+
+    ret = hdb_get_dbinfo(context, &info);
+    if (ret)
+	return ret;
+
+    r = calloc(1, sizeof(*r));
+    if (r == NULL) {
+	hdb_free_dbinfo(context, &info);
+	return krb5_enomem(context);
+    }
+
+    d = NULL;
+    for (i = 0; ret == 0 && (d = hdb_dbinfo_get_next(info, d)) != NULL; i++) {
+	realm = hdb_dbinfo_get_realm(context, d);
+	if (realm != NULL) {
+	    ret = add_route(context, r, i, ROUTE_REALM, realm);
+	    if (ret)
+		break;
+	    kdc_log(context, config, 3, "Routing realm %s to database %s",
+		    realm, hdb_dbinfo_get_label(context, d));
+	}
+
+	routes = krb5_config_get_strings(context,
+					 hdb_dbinfo_get_binding(context, d),
+					 "route", NULL);
+	for (p = routes; ret == 0 && p && *p; p++) {
+	    ret = add_route(context, r, i, ROUTE_PATTERN, *p);
+	    if (ret == 0)
+		kdc_log(context, config, 3, "Routing %s to database %s",
+			*p, hdb_dbinfo_get_label(context, d));
+	}
+	krb5_config_free_strings(routes);
+    }
+    r->num_db = i;
+    hdb_free_dbinfo(context, &info);
+
+    if (ret) {
+	_kdc_db_routes_free(r);
+	return ret;
+    }
+    config->db_routes = r;
+    return 0;
+}
+
+void
+_kdc_db_routes_free(struct kdc_db_routes *r)
+{
+    size_t i;
+
+    if (r == NULL)
+	return;
+    for (i = 0; i < r->num_routes; i++)
+	free(r->routes[i].s);
+    free(r->routes);
+    free(r);
+}
+
+/*
+ * Find the databases that `principal' is routed to.  On return
+ * `use'[i], for each of the config->num_db databases, is set if
+ * database i should be searched.  Returns zero if some route matched,
+ * HDB_ERR_NOENTRY if none did, in which case all databases are
+ * selected.
+ */
+
+krb5_error_code
+_kdc_db_route(krb5_context context, krb5_kdc_configuration *config,
+	      krb5_const_principal principal, unsigned char *use)
+{
+    struct kdc_db_routes *r = config->db_routes;
+    const char *realm = krb5_principal_get_realm(context, principal);
+    char *name = NULL;
+    int found = 0, match;
+    size_t i;
+
+    memset(use, r == NULL, config->num_db);
+    if (r == NULL)
+	return HDB_ERR_NOENTRY;
+
+    if (r->need_name &&
+	krb5_unparse_name_flags(context, principal,
+				KRB5_PRINCIPAL_UNPARSE_DISPLAY, &name) != 0)
+	name = NULL;
+
+    for (i = 0; i < r->num_routes; i++) {
+	struct db_route *rt = &r->routes[i];
+
+	if (rt->db_index >= config->num_db)
+	    continue;
+
+	switch (rt->type) {
+	case ROUTE_REALM:
+	    match = realm != NULL && strcmp(realm, rt->s) == 0;
+	    break;
+	case ROUTE_PREFIX:
+	    match = name != NULL && strncmp(name, rt->s, rt->len) == 0;
+	    break;
+	case ROUTE_PATTERN:
+	default:
+	    match = name != NULL && fnmatch(rt->s, name, 0) == 0;
+	    break;
+	}
+	if (match) {
+	    use[rt->db_index] = 1;
+	    found = 1;
+	}
+    }
+    free(name);
+
+    if (!found) {
+	memset(use, 1, config->num_db);
+	return HDB_ERR_NOENTRY;
+    }
+    return 0;
+}
@@ -41,6 +41,7 @@ krb5_error_code
 krb5_kdc_get_config(krb5_context context, krb5_kdc_configuration **config)
 {
     krb5_kdc_configuration *c;
+    krb5_error_code ret;
 
     c = calloc(1, sizeof(*c));
     if (c == NULL) {
@@ -49,6 +50,8 @@ krb5_kdc_get_config(krb5_context context, krb5_kdc_configuration **config)
     }
 
     c->num_kdc_processes = -1;
+    c->per_worker_sockets = FALSE;
+    c->num_threads = 0;
     c->require_preauth = TRUE;
     c->kdc_warn_pwexpire = 0;
     c->encode_as_rep_as_tgs_rep = FALSE;
@@ -66,16 +69,95 @@ krb5_kdc_get_config(krb5_context context, krb5_kdc_configuration **config)
     c->pkinit_require_binding = TRUE;
     c->db = NULL;
     c->num_db = 0;
+    c->keep_databases_open = FALSE;
     c->logf = NULL;
 
     c->num_kdc_processes =
         krb5_config_get_int_default(context, NULL, c->num_kdc_processes,
 				    "kdc", "num-kdc-processes", NULL);
 
+    c->per_worker_sockets =
+	krb5_config_get_bool_default(context, NULL,
+				     c->per_worker_sockets,
+				     "kdc", "per-worker-sockets", NULL);
+
+    c->num_threads =
+	krb5_config_get_int_default(context, NULL, c->num_threads,
+				    "kdc", "num-threads", NULL);
+
+    c->admission_max_delay =
+	krb5_config_get_int_default(context, NULL, 0,
+				    "kdc", "admission-max-queue-delay", NULL);
+    if (c->admission_max_delay < 0)
+	c->admission_max_delay = 0;
+    c->admission_low_max_delay =
+	krb5_config_get_int_default(context, NULL,
+				    c->admission_max_delay / 2, "kdc",
+				    "admission-unauthenticated-max-queue-delay",
+				    NULL);
+    if (c->admission_low_max_delay < 0)
+	c->admission_low_max_delay = 0;
+    c->admission_fail_fast =
+	krb5_config_get_bool_default(context, NULL, TRUE,
+				     "kdc", "admission-fail-fast", NULL);
+
+    c->slow_request_threshold =
+	krb5_config_get_int_default(context, NULL, 0,
+				    "kdc", "slow-request-threshold", NULL);
+    if (c->slow_request_threshold < 0)
+	c->slow_request_threshold = 0;
+
     c->require_preauth =
 	krb5_config_get_bool_default(context, NULL,
 				     c->require_preauth,
 				     "kdc", "require-preauth", NULL);
+
+    c->keep_databases_open =
+	krb5_config_get_bool_default(context, NULL,
+				     c->keep_databases_open,
+				     "kdc", "keep-databases-open", NULL);
+
+    {
+	int n = krb5_config_get_int_default(context, NULL, 0,
+					    "kdc", "crypto-cache-size", NULL);
+	c->crypto_cache_size = n > 0 ? n : 0;
+    }
+
+    {
+	int n = krb5_config_get_int_default(context, NULL, 0,
+					    "kdc", "etype-cache-size", NULL);
+	c->etype_cache_size = n > 0 ? n : 0;
+    }
+
+    ret = _kdc_entry_cache_init(context, c);
+    if (ret) {
+	free(c);
+	return ret;
+    }
+
+    ret = _kdc_lookup_filter_init(context, c);
+    if (ret) {
+	krb5_kdc_free_config(context, c);
+	return ret;
+    }
+
+    ret = _kdc_db_routes_init(context, c);
+    if (ret) {
+	krb5_kdc_free_config(context, c);
+	return ret;
+    }
+
+    ret = _kdc_preauth_cache_init(context, c);
+    if (ret) {
+	krb5_kdc_free_config(context, c);
+	return ret;
+    }
+
+    ret = _kdc_metrics_init(context, c);
+    if (ret) {
+	krb5_kdc_free_config(context, c);
+	return ret;
+    }
 #ifdef DIGEST
     c->enable_digest =
 	krb5_config_get_bool_default(context, NULL,
@@ -261,6 +343,34 @@ krb5_kdc_get_config(krb5_context context, krb5_kdc_configuration **config)
     return 0;
 }
 
+/**
+ * Free a configuration returned by krb5_kdc_get_config(), closing its
+ * databases and freeing the caches built for them.  The log facility
+ * belongs to the context and is released with it.
+ */
+
+void
+krb5_kdc_free_config(krb5_context context, krb5_kdc_configuration *config)
+{
+    int i;
+
+    if (config == NULL)
+	return;
+
+    krb5_kdc_close_databases(context, config);
+    for (i = 0; i < config->num_db; i++)
+	(*config->db[i]->hdb_destroy)(context, config->db[i]);
+    free(config->db);
+
+    _kdc_entry_cache_free(context, config->entry_cache);
+    _kdc_lookup_filter_free(config->lookup_filter);
+    _kdc_db_routes_free(config->db_routes);
+    _kdc_preauth_cache_free(config->preauth_cache);
+    _kdc_crypto_cache_free(context, config->crypto_cache);
+    _kdc_etype_cache_free(config->etype_cache);
+    free(config);
+}
+
 krb5_error_code
 krb5_kdc_pkinit_config(krb5_context context, krb5_kdc_configuration *config)
 {
@@ -120,6 +120,8 @@ ntlm_service(void *ctx, const heim_idata *req,
 
 	ret = hdb_enctype2key(context, &user->entry, NULL,
 			      ETYPE_ARCFOUR_HMAC_MD5, &key);
+	if (ret == 0)
+	    ret = hdb_entry_unseal_key(context, user, key);
 	if (ret) {
 	    krb5_set_error_message(context, ret, "NTLM missing arcfour key");
 	    goto failed;
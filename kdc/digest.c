@@ -888,6 +888,8 @@ _kdc_do_digest(krb5_context context,
 
 	    ret = hdb_enctype2key(context, &user->entry, NULL,
 				  ETYPE_ARCFOUR_HMAC_MD5, &key);
+	    if (ret == 0)
+		ret = hdb_entry_unseal_key(context, user, key);
 	    if (ret) {
 		krb5_set_error_message(context, ret,
 				       "MS-CHAP-V2 missing arcfour key %s",
@@ -1216,6 +1218,8 @@ _kdc_do_digest(krb5_context context,
 
 	ret = hdb_enctype2key(context, &user->entry, NULL,
 			      ETYPE_ARCFOUR_HMAC_MD5, &key);
+	if (ret == 0)
+	    ret = hdb_entry_unseal_key(context, user, key);
 	if (ret) {
 	    krb5_set_error_message(context, ret, "NTLM missing arcfour key");
 	    goto out;
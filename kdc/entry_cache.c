@@ -0,0 +1,396 @@
+/*
+ * Copyright (c) 2026 Kungliga Tekniska Högskolan
+ * (Royal Institute of Technology, Stockholm, Sweden).
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the Institute nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE INSTITUTE AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE INSTITUTE OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Cache of fetched database entries.
+ *
+ * Entries are kept in LRU order up to a configured number of bytes
+ * and for at most a configured time.  The whole cache is flushed when
+ * any of the database files or the iprop log changes, which is checked
+ * with stat() at most once a second, outside the cache lock; that is
+ * still much cheaper than opening the database.  A flush bumps a
+ * generation number so that an entry fetched before the flush, by a
+ * lookup that missed before it, is not added afterwards.  Keys are cached as fetched, that is usually still
+ * sealed, and only the key a request uses gets decrypted (see
+ * hdb_entry_unseal_key()).  Lookups return a copy of the
+ * cached entry so callers own and free the result as they would a
+ * database fetch.
+ */
+
+#include "kdc_locl.h"
+#include <parse_bytes.h>
+
+#define ENTRY_CACHE_BUCKETS 1021
+
+struct cache_node {
+    struct cache_node *hnext;		/* hash chain */
+    struct cache_node *prev;		/* LRU list, most recent first */
+    struct cache_node *next;
+    char *key;
+    unsigned long hash;
+    int db_index;
+    time_t created;
+    size_t size;
+    hdb_entry_ex ent;
+};
+
+struct kdc_entry_cache {
+    HEIMDAL_MUTEX mutex;
+    size_t max_bytes;
+    size_t bytes;
+    time_t max_age;
+    struct cache_node *table[ENTRY_CACHE_BUCKETS];
+    struct cache_node *head;
+    struct cache_node *tail;
+    struct kdc_watch *watch;
+    unsigned long gen;			/* bumped by every flush */
+    time_t checked;			/* last time the watch was checked */
+    int checking;			/* a thread is checking the watch */
+};
+
+static unsigned long
+key_hash(const char *s)
+{
+    unsigned long h = 2166136261UL;
+
+    while (*s) {
+	h ^= (unsigned char)*s++;
+	h *= 16777619UL;
+    }
+    return h;
+}
+
+/*
+ * Watch the files that change when the databases are modified: the
+ * database itself (under the names the file based backends use) and
+ * the iprop log.
+ */
+
+static krb5_error_code
+add_db_watches(krb5_context context, struct kdc_entry_cache *c)
+{
+    struct hdb_dbinfo *info, *d;
+    krb5_error_code ret;
+    const char *name, *p;
+
+    ret = _kdc_watch_create(context, &c->watch);
+    if (ret)
+	return ret;
+
+    ret = hdb_get_dbinfo(context, &info);
+    if (ret)
+	return ret;
+
+    d = NULL;
+    while (ret == 0 && (d = hdb_dbinfo_get_next(info, d)) != NULL) {
+	name = hdb_dbinfo_get_dbname(context, d);
+	if (name == NULL)
+	    name = hdb_default_db(context);
+	ret = _kdc_watch_add_db(context, c->watch, name);
+
+	p = hdb_dbinfo_get_log_file(context, d);
+	if (ret == 0 && p != NULL)
+	    ret = _kdc_watch_add(context, c->watch, "%s", p);
+    }
+    if (ret == 0)
+	ret = _kdc_watch_add(context, c->watch, "%s/log", hdb_db_dir(context));
+
+    hdb_free_dbinfo(context, &info);
+    return ret;
+}
+
+static void
+unlink_node(struct kdc_entry_cache *c, struct cache_node *n)
+{
+    struct cache_node **pp;
+
+    for (pp = &c->table[n->hash % ENTRY_CACHE_BUCKETS]; *pp; pp = &(*pp)->hnext) {
+	if (*pp == n) {
+	    *pp = n->hnext;
+	    break;
+	}
+    }
+    if (n->prev)
+	n->prev->next = n->next;
+    else
+	c->head = n->next;
+    if (n->next)
+	n->next->prev = n->prev;
+    else
+	c->tail = n->prev;
+    c->bytes -= n->size;
+}
+
+static void
+free_node(krb5_context context, struct cache_node *n)
+{
+    hdb_free_entry(context, &n->ent);
+    free(n->key);
+    free(n);
+}
+
+static void
+flush_locked(krb5_context context, struct kdc_entry_cache *c)
+{
+    struct cache_node *n;
+
+    while ((n = c->head) != NULL) {
+	unlink_node(c, n);
+	free_node(context, n);
+    }
+    c->gen++;
+}
+
+/*
+ * Flush the cache if a database changed.  One thread at a time, and
+ * at most once a second, stats the watched files with the cache
+ * unlocked; called and returns with the cache locked.
+ */
+
+static void
+check_watch_locked(krb5_context context, krb5_kdc_configuration *config,
+		   struct kdc_entry_cache *c, time_t now)
+{
+    int changed;
+
+    if (c->checking || c->checked == now)
+	return;
+    c->checked = now;
+    c->checking = 1;
+    HEIMDAL_MUTEX_unlock(&c->mutex);
+    changed = _kdc_watch_changed(c->watch);
+    HEIMDAL_MUTEX_lock(&c->mutex);
+    c->checking = 0;
+    if (!changed)
+	return;
+    if (c->head != NULL)
+	kdc_log(context, config, 5, "Database changed, flushing entry cache");
+    /* Even when empty, so that lookups in flight don't add old entries */
+    flush_locked(context, c);
+}
+
+krb5_error_code
+_kdc_entry_cache_init(krb5_context context, krb5_kdc_configuration *config)
+{
+    struct kdc_entry_cache *c;
+    krb5_error_code ret;
+    const char *p;
+    ssize_t size;
+
+    config->entry_cache = NULL;
+
+    p = krb5_config_get_string(context, NULL, "kdc", "entry-cache-size",
+			       NULL);
+    if (p == NULL)
+	return 0;
+    size = parse_bytes(p, NULL);
+    if (size <= 0)
+	return 0;
+
+    c = calloc(1, sizeof(*c));
+    if (c == NULL)
+	return krb5_enomem(context);
+
+    HEIMDAL_MUTEX_init(&c->mutex);
+    c->max_bytes = size;
+    c->max_age = krb5_config_get_time_default(context, NULL, 300, "kdc",
+					      "entry-cache-max-age", NULL);
+
+    ret = add_db_watches(context, c);
+    if (ret) {
+	_kdc_entry_cache_free(context, c);
+	return ret;
+    }
+    config->entry_cache = c;
+    return 0;
+}
+
+void
+_kdc_entry_cache_free(krb5_context context, struct kdc_entry_cache *c)
+{
+    if (c == NULL)
+	return;
+    flush_locked(context, c);
+    _kdc_watch_free(c->watch);
+    HEIMDAL_MUTEX_destroy(&c->mutex);
+    free(c);
+}
+
+/*
+ * Drop all cached entries, for example when the databases are
+ * re-opened.
+ */
+
+void
+_kdc_entry_cache_flush(krb5_context context, krb5_kdc_configuration *config)
+{
+    struct kdc_entry_cache *c = config->entry_cache;
+
+    if (c == NULL)
+	return;
+    HEIMDAL_MUTEX_lock(&c->mutex);
+    flush_locked(context, c);
+    HEIMDAL_MUTEX_unlock(&c->mutex);
+}
+
+/*
+ * Look up `key' and, if found, return a copy of the entry in `ent'
+ * and the index of the database it came from in `db_index'.  On a miss
+ * `gen' is to be passed to _kdc_entry_cache_put() with the entry
+ * fetched from the database.
+ */
+
+krb5_error_code
+_kdc_entry_cache_get(krb5_context context, krb5_kdc_configuration *config,
+		     const char *key, int *db_index, hdb_entry_ex *ent,
+		     unsigned long *gen)
+{
+    struct kdc_entry_cache *c = config->entry_cache;
+    unsigned long hash = key_hash(key);
+    struct cache_node *n;
+    krb5_error_code ret = HDB_ERR_NOENTRY;
+    time_t now = kdc_time;
+
+    HEIMDAL_MUTEX_lock(&c->mutex);
+
+    check_watch_locked(context, config, c, now);
+    *gen = c->gen;
+
+    for (n = c->table[hash % ENTRY_CACHE_BUCKETS]; n; n = n->hnext) {
+	if (n->hash == hash && strcmp(n->key, key) == 0)
+	    break;
+    }
+    if (n == NULL)
+	goto out;
+
+    if (n->created + c->max_age < now) {
+	unlink_node(c, n);
+	free_node(context, n);
+	goto out;
+    }
+
+    memset(ent, 0, sizeof(*ent));
+    ret = copy_hdb_entry(&n->ent.entry, &ent->entry);
+    if (ret)
+	goto out;
+    *db_index = n->db_index;
+
+    /* move to the front of the LRU list */
+    if (n != c->head) {
+	n->prev->next = n->next;
+	if (n->next)
+	    n->next->prev = n->prev;
+	else
+	    c->tail = n->prev;
+	n->prev = NULL;
+	n->next = c->head;
+	c->head->prev = n;
+	c->head = n;
+    }
+
+ out:
+    HEIMDAL_MUTEX_unlock(&c->mutex);
+    return ret;
+}
+
+/*
+ * Add a copy of `ent', fetched from database `db_index', under `key'.
+ * Entries carrying backend private state are not cached, nor are
+ * entries fetched before a flush (the cache generation is no longer
+ * the `gen' _kdc_entry_cache_get() returned).
+ */
+
+void
+_kdc_entry_cache_put(krb5_context context, krb5_kdc_configuration *config,
+		     const char *key, int db_index, const hdb_entry_ex *ent,
+		     unsigned long gen)
+{
+    struct kdc_entry_cache *c = config->entry_cache;
+    struct cache_node *n, *old;
+    size_t size;
+
+    if (ent->ctx != NULL || ent->free_entry != NULL)
+	return;
+
+    size = sizeof(*n) + strlen(key) + 1 + length_hdb_entry(&ent->entry);
+    if (size > c->max_bytes)
+	return;
+
+    n = calloc(1, sizeof(*n));
+    if (n == NULL)
+	return;
+    n->key = strdup(key);
+    if (n->key == NULL || copy_hdb_entry(&ent->entry, &n->ent.entry) != 0) {
+	free(n->key);
+	free(n);
+	return;
+    }
+    n->hash = key_hash(key);
+    n->db_index = db_index;
+    n->created = kdc_time;
+    n->size = size;
+
+    HEIMDAL_MUTEX_lock(&c->mutex);
+
+    if (c->gen != gen) {
+	HEIMDAL_MUTEX_unlock(&c->mutex);
+	free_node(context, n);
+	return;
+    }
+
+    for (old = c->table[n->hash % ENTRY_CACHE_BUCKETS]; old; old = old->hnext) {
+	if (old->hash == n->hash && strcmp(old->key, key) == 0) {
+	    unlink_node(c, old);
+	    free_node(context, old);
+	    break;
+	}
+    }
+
+    while (c->bytes + size > c->max_bytes && c->tail != NULL) {
+	old = c->tail;
+	unlink_node(c, old);
+	free_node(context, old);
+    }
+
+    n->hnext = c->table[n->hash % ENTRY_CACHE_BUCKETS];
+    c->table[n->hash % ENTRY_CACHE_BUCKETS] = n;
+    n->next = c->head;
+    if (c->head)
+	c->head->prev = n;
+    else
+	c->tail = n;
+    c->head = n;
+    c->bytes += size;
+
+    HEIMDAL_MUTEX_unlock(&c->mutex);
+}
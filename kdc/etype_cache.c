@@ -0,0 +1,157 @@
+/*
+ * Copyright (c) 2026 Kungliga Tekniska Högskolan
+ * (Royal Institute of Technology, Stockholm, Sweden).
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the Institute nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE INSTITUTE AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE INSTITUTE OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Cache of enctype negotiation results.
+ *
+ * _kdc_find_etype() matches the enctypes a client asks for against the
+ * keys of a principal, which gives the same answer for every request
+ * from the same client software for the same version of an entry.
+ * The caller describes the question in a byte string (principal, kvno,
+ * modification time, policy flags and the requested enctypes) and the
+ * answer, the enctype and the index of the key in the entry, is kept
+ * in a direct mapped table under it.  Like the crypto cache it belongs
+ * to a configuration, so each request thread has its own and no
+ * locking is needed.
+ */
+
+#include "kdc_locl.h"
+
+struct etype_slot {
+    unsigned long hash;
+    size_t len;
+    unsigned char *key;
+    krb5_error_code ret;
+    krb5_enctype enctype;
+    int key_index;
+};
+
+struct kdc_etype_cache {
+    size_t size;
+    struct etype_slot slots[1];
+};
+
+void
+_kdc_etype_cache_free(struct kdc_etype_cache *c)
+{
+    size_t i;
+
+    if (c == NULL)
+	return;
+    for (i = 0; i < c->size; i++)
+	free(c->slots[i].key);
+    free(c);
+}
+
+static unsigned long
+key_hash(const unsigned char *p, size_t len)
+{
+    unsigned long h = 2166136261UL;
+    size_t i;
+
+    for (i = 0; i < len; i++)
+	h = (h ^ p[i]) * 16777619UL;
+    return h;
+}
+
+/*
+ * Look up the negotiation described by `key'.  On a hit the result of
+ * the original negotiation is returned in `ret', the enctype in
+ * `enctype' and the index of the key (-1 for none) in `key_index'.
+ */
+
+krb5_error_code
+_kdc_etype_cache_get(krb5_context context,
+		     krb5_kdc_configuration *config,
+		     const unsigned char *key, size_t len,
+		     krb5_error_code *ret,
+		     krb5_enctype *enctype, int *key_index)
+{
+    struct kdc_etype_cache *c = config->etype_cache;
+    unsigned long hash;
+    struct etype_slot *s;
+
+    if (c == NULL)
+	return HDB_ERR_NOENTRY;
+
+    hash = key_hash(key, len);
+    s = &c->slots[hash % c->size];
+    if (s->key == NULL || s->hash != hash || s->len != len ||
+	memcmp(s->key, key, len) != 0)
+	return HDB_ERR_NOENTRY;
+
+    *ret = s->ret;
+    *enctype = s->enctype;
+    *key_index = s->key_index;
+    return 0;
+}
+
+void
+_kdc_etype_cache_put(krb5_context context,
+		     krb5_kdc_configuration *config,
+		     const unsigned char *key, size_t len,
+		     krb5_error_code ret,
+		     krb5_enctype enctype, int key_index)
+{
+    struct kdc_etype_cache *c = config->etype_cache;
+    struct etype_slot *s;
+    unsigned long hash;
+    unsigned char *k;
+
+    if (config->etype_cache_size == 0)
+	return;
+
+    if (c == NULL) {
+	c = calloc(1, sizeof(*c) +
+		   (config->etype_cache_size - 1) * sizeof(c->slots[0]));
+	if (c == NULL)
+	    return;
+	c->size = config->etype_cache_size;
+	config->etype_cache = c;
+    }
+
+    k = malloc(len);
+    if (k == NULL)
+	return;
+    memcpy(k, key, len);
+
+    hash = key_hash(key, len);
+    s = &c->slots[hash % c->size];
+    free(s->key);
+    s->hash = hash;
+    s->len = len;
+    s->key = k;
+    s->ret = ret;
+    s->enctype = enctype;
+    s->key_index = key_index;
+}
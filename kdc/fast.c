@@ -63,6 +63,8 @@ get_fastuser_crypto(kdc_request_t r, krb5_enctype enctype, krb5_crypto *crypto)
     else
 	ret = hdb_enctype2key(r->context, &fast_user->entry, NULL,
 			      enctype, &cookie_key);
+    if (ret == 0)
+	ret = hdb_entry_unseal_key(r->context, fast_user, cookie_key);
     if (ret)
 	goto out;
 
@@ -443,6 +445,8 @@ _kdc_fast_unwrap_request(kdc_request_t r)
     ret = hdb_enctype2key(r->context, &armor_user->entry, NULL,
 			  ap_req.ticket.enc_part.etype,
 			  &armor_key);
+    if (ret == 0)
+	ret = hdb_entry_unseal_key(r->context, armor_user, armor_key);
     if (ret) {
 	free_AP_REQ(&ap_req);
 	goto out;
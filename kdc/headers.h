@@ -59,9 +59,15 @@
 #ifdef HAVE_SYS_SELECT_H
 #include <sys/select.h>
 #endif
+#ifdef HAVE_SYS_EPOLL_H
+#include <sys/epoll.h>
+#endif
 #ifdef HAVE_SYS_SOCKET_H
 #include <sys/socket.h>
 #endif
+#ifdef HAVE_SYS_UN_H
+#include <sys/un.h>
+#endif
 #ifdef HAVE_NETINET_IN_H
 #include <netinet/in.h>
 #endif
@@ -110,6 +116,7 @@
 #include <windc_plugin.h>
 
 #include <heimbase.h>
+#include <heim_probes.h>
 
 #undef ALLOC
 #define ALLOC(X) ((X) = calloc(1, sizeof(*(X))))
@@ -204,6 +204,7 @@ main(int argc, char **argv)
     }
 
     krb5_storage_free(sp);
+    krb5_kdc_free_config(context, config);
     krb5_free_context(context);
 
     printf("done\n");
@@ -503,6 +503,7 @@ main(int argc, char **argv)
 	heim_release(o);
     }
 
+    krb5_kdc_free_config(kdc_context, kdc_config);
     krb5_free_context(kdc_context);
     return 0;
 }
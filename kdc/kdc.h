@@ -50,14 +50,39 @@ enum krb5_kdc_trpolicy {
     TRPOLICY_ALWAYS_HONOUR_REQUEST
 };
 
+struct kdc_entry_cache;
+struct kdc_crypto_cache;
+struct kdc_lookup_filter;
+struct kdc_db_routes;
+struct kdc_preauth_cache;
+struct kdc_etype_cache;
+struct kdc_metrics;
+
 typedef struct krb5_kdc_configuration {
     krb5_boolean require_preauth; /* require preauth for all principals */
     time_t kdc_warn_pwexpire; /* time before expiration to print a warning */
 
     struct HDB **db;
     int num_db;
+    krb5_boolean keep_databases_open; /* reuse HDB handles across requests */
+    struct kdc_entry_cache *entry_cache; /* unsealed entries, may be NULL */
+    size_t crypto_cache_size; /* max cached krb5_crypto objects */
+    struct kdc_crypto_cache *crypto_cache; /* per thread, may be NULL */
+    size_t etype_cache_size; /* cached enctype negotiations */
+    struct kdc_etype_cache *etype_cache; /* per thread, may be NULL */
+    struct kdc_lookup_filter *lookup_filter; /* may be NULL */
+    struct kdc_db_routes *db_routes; /* may be NULL */
+    struct kdc_preauth_cache *preauth_cache; /* may be NULL */
+    const char *metrics_socket; /* where to serve metrics, may be NULL */
+    struct kdc_metrics *metrics; /* shared by the workers, may be NULL */
+    int slow_request_threshold; /* ms before a request is logged, 0 off */
 
     int num_kdc_processes;
+    krb5_boolean per_worker_sockets; /* SO_REUSEPORT listeners per worker */
+    int num_threads; /* request processing threads per worker */
+    int admission_max_delay; /* ms a queued request may wait, 0 no limit */
+    int admission_low_max_delay; /* same for unauthenticated AS-REQs */
+    krb5_boolean admission_fail_fast; /* answer shed requests */
 
     krb5_boolean encode_as_rep_as_tgs_rep; /* bug compatibility */
 
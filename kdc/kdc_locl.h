@@ -43,8 +43,40 @@
 typedef struct pk_client_params pk_client_params;
 struct DigestREQ;
 struct Kx509Request;
+struct kdc_watch;
+struct kdc_fetch;
 typedef struct kdc_request_desc *kdc_request_t;
 
+/* see metrics.c */
+enum kdc_metric_req {
+    KDC_METRIC_REQ_AS,
+    KDC_METRIC_REQ_TGS,
+    KDC_METRIC_REQ_DIGEST,
+    KDC_METRIC_REQ_KX509,
+    KDC_METRIC_REQ_UNKNOWN,
+    KDC_METRIC_REQ_MAX
+};
+
+enum kdc_metric_stage {
+    KDC_METRIC_STAGE_DB_FETCH,
+    KDC_METRIC_STAGE_CRYPTO,
+    KDC_METRIC_STAGE_ENCODE,
+    KDC_METRIC_STAGE_MAX
+};
+
+/* Per-request stage timings, see trace.c */
+#define KDC_TRACE_MAX 16
+
+struct kdc_trace {
+    uint64_t start;
+    unsigned int n;
+    unsigned int dropped;
+    struct {
+	const char *stage;
+	uint64_t usec;
+    } ev[KDC_TRACE_MAX];
+};
+
 #include <kdc-private.h>
 
 #define FAST_EXPIRATION_TIME (3 * 60)
@@ -87,12 +119,30 @@ struct kdc_request_desc {
     krb5_crypto armor_crypto;
 
     KDCFastState fast;
+
+    /* NULL unless slow-request-threshold is set */
+    struct kdc_trace *trace;
+};
+
+/* One of the lookups done by _kdc_db_fetch_many() */
+struct kdc_fetch {
+    /* in */
+    krb5_const_principal principal;
+    unsigned flags;
+    krb5uint32 *kvno_ptr;
+
+    /* out */
+    krb5_error_code ret;
+    HDB *db;
+    hdb_entry_ex *h;
 };
 
 
 extern sig_atomic_t exit_flag;
+extern sig_atomic_t reopen_db_flag;
 extern size_t max_request_udp;
 extern size_t max_request_tcp;
+extern size_t udp_batch_size;
 extern const char *request_log;
 extern const char *port_str;
 extern krb5_addresses explicit_addresses;
@@ -109,9 +159,25 @@ extern const struct units _kdc_digestunits[];
 
 #define KDC_LOG_FILE		"kdc.log"
 
-extern struct timeval _kdc_now;
+/*
+ * True if a kdc_log()/_kdc_r_log() message at `level' would be logged.
+ * Wrap unparsing and formatting that only feeds a log message in
+ * these so that it is skipped when the level is filtered out.
+ */
+#define kdc_log_enabled(context, config, level) \
+    krb5_log_have_level((context), (config)->logf, (level))
+#define _kdc_r_log_enabled(r, level) \
+    kdc_log_enabled((r)->context, (r)->config, (level))
+
+extern HEIMDAL_THREAD_LOCAL struct timeval _kdc_now;
 #define kdc_time (_kdc_now.tv_sec)
 
+/*
+ * The trace of the request this thread is working on, for the code
+ * that has no kdc_request_t to hand (TGS, database lookups, windc).
+ */
+extern HEIMDAL_THREAD_LOCAL struct kdc_trace *_kdc_trace;
+
 extern char *runas_string;
 extern char *chroot_string;
 
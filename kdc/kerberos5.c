@@ -116,6 +116,71 @@ is_default_salt_p(const krb5_salt *default_salt, const Key *key)
     return TRUE;
 }
 
+static int
+key_append(unsigned char *buf, size_t size, size_t *n,
+	   const void *data, size_t len)
+{
+    if (*n + len > size)
+	return 1;
+    memcpy(buf + *n, data, len);
+    *n += len;
+    return 0;
+}
+
+/*
+ * Describe a _kdc_find_etype() question in `buf' for the enctype
+ * cache.  Returns the length used, or zero if it does not fit.
+ */
+
+static size_t
+find_etype_cache_key(unsigned char *buf, size_t size, int flags,
+		     const hdb_entry *e,
+		     const krb5_enctype *etypes, unsigned len)
+{
+    struct {
+	int flags;
+	krb5_kvno kvno;
+	time_t modified;
+	unsigned len;
+    } h;
+    const char *s;
+    size_t n = 0;
+    unsigned i;
+
+    memset(&h, 0, sizeof(h));
+    h.flags = flags;
+    h.kvno = e->kvno;
+    h.modified = e->modified_by ? e->modified_by->time : e->created_by.time;
+    h.len = len;
+
+    if (key_append(buf, size, &n, &h, sizeof(h)) ||
+	key_append(buf, size, &n, etypes, len * sizeof(etypes[0])))
+	return 0;
+    s = e->principal->realm;
+    if (key_append(buf, size, &n, s, strlen(s) + 1))
+	return 0;
+    for (i = 0; i < e->principal->name.name_string.len; i++) {
+	s = e->principal->name.name_string.val[i];
+	if (key_append(buf, size, &n, s, strlen(s) + 1))
+	    return 0;
+    }
+    return n;
+}
+
+/*
+ * Keys are usually still sealed here (see HDB_F_LAZY_UNSEAL), and a
+ * sealed null key is not empty: unseal a key before asking whether it
+ * is null.
+ */
+
+static int
+is_null_key(krb5_context context, hdb_entry_ex *princ, Key *key)
+{
+    if (hdb_entry_unseal_key(context, princ, key) != 0)
+	return 0;	/* left to fail when the key is used */
+    return key->key.keyvalue.length == 0;
+}
+
 /*
  * return the first appropriate key of `princ' in `ret_key'.  Look for
  * all the etypes in (`etypes', `len'), stopping as soon as we find
@@ -123,7 +188,8 @@ is_default_salt_p(const krb5_salt *default_salt, const Key *key)
  */
 
 krb5_error_code
-_kdc_find_etype(krb5_context context, krb5_boolean use_strongest_session_key,
+_kdc_find_etype(krb5_context context, krb5_kdc_configuration *config,
+		krb5_boolean use_strongest_session_key,
 		krb5_boolean is_preauth, hdb_entry_ex *princ,
 		krb5_enctype *etypes, unsigned len,
 		krb5_enctype *ret_enctype, Key **ret_key)
@@ -134,6 +200,27 @@ _kdc_find_etype(krb5_context context, krb5_boolean use_strongest_session_key,
     const krb5_enctype *p;
     Key *key = NULL;
     int i, k;
+    unsigned char cache_key[256];
+    size_t cache_key_len = 0;
+
+    /* The same question for the same entry gets the same answer */
+    if (config->etype_cache_size) {
+	int flags = (use_strongest_session_key ? 1 : 0) |
+	    (is_preauth ? 2 : 0) | (ret_key != NULL ? 4 : 0);
+
+	cache_key_len = find_etype_cache_key(cache_key, sizeof(cache_key),
+					     flags, &princ->entry,
+					     etypes, len);
+	if (cache_key_len &&
+	    _kdc_etype_cache_get(context, config, cache_key, cache_key_len,
+				 &ret, &enctype, &i) == 0 &&
+	    i >= -1 && i < (int)princ->entry.keys.len &&
+	    (i == -1 || princ->entry.keys.val[i].key.keytype == enctype)) {
+	    key = i == -1 ? NULL : &princ->entry.keys.val[i];
+	    goto found;
+	}
+	enctype = (krb5_enctype)ETYPE_NULL;
+    }
 
     /* We'll want to avoid keys with v4 salted keys in the pre-auth case... */
     ret = krb5_get_pw_salt(context, princ->entry.principal, &def_salt);
@@ -174,7 +261,7 @@ _kdc_find_etype(krb5_context context, krb5_boolean use_strongest_session_key,
 		key = NULL;
 		while (hdb_next_enctype2key(context, &princ->entry, NULL,
 					     p[i], &key) == 0) {
-		    if (key->key.keyvalue.length == 0) {
+		    if (is_null_key(context, princ, key)) {
 			ret = KRB5KDC_ERR_NULL_KEY;
 			continue;
 		    }
@@ -206,7 +293,7 @@ _kdc_find_etype(krb5_context context, krb5_boolean use_strongest_session_key,
 	    while (ret != 0 &&
                    hdb_next_enctype2key(context, &princ->entry, NULL,
 					etypes[i], &key) == 0) {
-		if (key->key.keyvalue.length == 0) {
+		if (is_null_key(context, princ, key)) {
 		    ret = KRB5KDC_ERR_NULL_KEY;
 		    continue;
 		}
@@ -234,6 +321,17 @@ _kdc_find_etype(krb5_context context, krb5_boolean use_strongest_session_key,
         }
     }
 
+    krb5_free_salt (context, def_salt);
+
+    if (cache_key_len)
+	_kdc_etype_cache_put(context, config, cache_key, cache_key_len,
+			     ret, enctype,
+			     key ? (int)(key - princ->entry.keys.val) : -1);
+
+ found:
+    if (ret == 0 && ret_key != NULL && key != NULL)
+	ret = hdb_entry_unseal_key(context, princ, key);
+
     if (ret == 0) {
 	if (ret_enctype != NULL)
 	    *ret_enctype = enctype;
@@ -241,7 +339,6 @@ _kdc_find_etype(krb5_context context, krb5_boolean use_strongest_session_key,
 	    *ret_key = key;
     }
 
-    krb5_free_salt (context, def_salt);
     return ret;
 }
 
@@ -290,6 +387,9 @@ _kdc_log_timestamp(krb5_context context,
     char authtime_str[100], starttime_str[100],
 	endtime_str[100], renewtime_str[100];
 
+    if (!kdc_log_enabled(context, config, 5))
+	return;
+
     krb5_format_time(context, authtime,
 		     authtime_str, sizeof(authtime_str), TRUE);
     if (starttime)
@@ -316,6 +416,13 @@ _kdc_log_timestamp(krb5_context context,
 
 #ifdef PKINIT
 
+/*
+ * The PKINIT identity, anchors and mappings are shared by the whole
+ * process, so PKINIT requests are serialised when the KDC runs
+ * request threads.
+ */
+static HEIMDAL_MUTEX pkinit_mutex = HEIMDAL_MUTEX_INITIALIZER;
+
 static krb5_error_code
 pa_pkinit_validate(kdc_request_t r, const PA_DATA *pa)
 {
@@ -323,6 +430,8 @@ pa_pkinit_validate(kdc_request_t r, const PA_DATA *pa)
     char *client_cert = NULL;
     krb5_error_code ret;
 
+    HEIMDAL_MUTEX_lock(&pkinit_mutex);
+
     ret = _kdc_pk_rd_padata(r->context, r->config, &r->req, pa, r->client, &pkp);
     if (ret || pkp == NULL) {
 	ret = KRB5KRB_AP_ERR_BAD_INTEGRITY;
@@ -362,6 +471,8 @@ pa_pkinit_validate(kdc_request_t r, const PA_DATA *pa)
     if (pkp)
 	_kdc_pk_free_client_param(r->context, pkp);
 
+    HEIMDAL_MUTEX_unlock(&pkinit_mutex);
+
     return ret;
 }
 
@@ -464,6 +575,10 @@ pa_enc_chal_validate(kdc_request_t r, const PA_DATA *pa)
 
 	k = &r->client->entry.keys.val[i];
 	
+	ret = hdb_entry_unseal_key(r->context, r->client, k);
+	if (ret)
+	    continue;
+
 	ret = krb5_crypto_init(r->context, &k->key, 0, &longtermcrypto);
 	if (ret)
 	    continue;			
@@ -621,7 +736,9 @@ pa_enc_ts_validate(kdc_request_t r, const PA_DATA *pa)
     }
 
  try_next_key:
-    ret = krb5_crypto_init(r->context, &pa_key->key, 0, &crypto);
+    ret = hdb_entry_unseal_key(r->context, r->client, pa_key);
+    if (ret == 0)
+	ret = _kdc_get_crypto(r->context, r->config, &pa_key->key, 0, &crypto);
     if (ret) {
 	const char *msg = krb5_get_error_message(r->context, ret);
 	_kdc_r_log(r, 0, "krb5_crypto_init failed: %s", msg);
@@ -635,7 +752,7 @@ pa_enc_ts_validate(kdc_request_t r, const PA_DATA *pa)
 				      KRB5_KU_PA_ENC_TIMESTAMP,
 				      &enc_data,
 				      &ts_data);
-    krb5_crypto_destroy(r->context, crypto);
+    _kdc_release_crypto(r->context, r->config, crypto);
     /*
      * Since the user might have several keys with the same
      * enctype but with diffrent salting, we need to try all
@@ -711,12 +828,14 @@ pa_enc_ts_validate(kdc_request_t r, const PA_DATA *pa)
     if (ret)
 	return ret;
 
-    ret = krb5_enctype_to_string(r->context, pa_key->key.keytype, &str);
-    if (ret)
-	str = NULL;
-    _kdc_r_log(r, 2, "ENC-TS Pre-authentication succeeded -- %s using %s",
-	       r->client_name, str ? str : "unknown enctype");
-    free(str);
+    if (_kdc_r_log_enabled(r, 2)) {
+	ret = krb5_enctype_to_string(r->context, pa_key->key.keytype, &str);
+	if (ret)
+	    str = NULL;
+	_kdc_r_log(r, 2, "ENC-TS Pre-authentication succeeded -- %s using %s",
+		   r->client_name, str ? str : "unknown enctype");
+	free(str);
+    }
 
     ret = 0;
 
@@ -824,6 +943,9 @@ _kdc_encode_reply(krb5_context context,
     size_t len = 0;
     krb5_error_code ret;
     krb5_crypto crypto;
+    uint64_t t, encode_us = 0, crypto_us = 0;
+
+    t = _kdc_metrics_clock(config);
 
     ASN1_MALLOC_ENCODE(EncTicketPart, buf, buf_size, et, &len, ret);
     if(ret) {
@@ -834,8 +956,9 @@ _kdc_encode_reply(krb5_context context,
     }
     if(buf_size != len)
 	krb5_abortx(context, "Internal error in ASN.1 encoder");
+    t = _kdc_metrics_lap(config, t, &encode_us);
 
-    ret = krb5_crypto_init(context, skey, etype, &crypto);
+    ret = _kdc_get_crypto(context, config, skey, etype, &crypto);
     if (ret) {
         const char *msg = krb5_get_error_message(context, ret);
 	kdc_log(context, config, 0, "krb5_crypto_init failed: %s", msg);
@@ -852,13 +975,14 @@ _kdc_encode_reply(krb5_context context,
 				     skvno,
 				     &rep->ticket.enc_part);
     free(buf);
-    krb5_crypto_destroy(context, crypto);
+    _kdc_release_crypto(context, config, crypto);
     if(ret) {
 	const char *msg = krb5_get_error_message(context, ret);
 	kdc_log(context, config, 0, "Failed to encrypt data: %s", msg);
 	krb5_free_error_message(context, msg);
 	return ret;
     }
+    t = _kdc_metrics_lap(config, t, &crypto_us);
 
     if (armor_crypto) {
 	krb5_data data;
@@ -921,6 +1045,7 @@ _kdc_encode_reply(krb5_context context,
 	    free_PrincipalName(&rep->cname);
 	    rep->cname.name_type = 0;
 	}
+	t = _kdc_metrics_lap(config, t, &crypto_us);
     }
 
     if(rep->msg_type == krb_as_rep && !config->encode_as_rep_as_tgs_rep)
@@ -939,6 +1064,8 @@ _kdc_encode_reply(krb5_context context,
 	*e_text = "KDC internal error";
 	return KRB5KRB_ERR_GENERIC;
     }
+    t = _kdc_metrics_lap(config, t, &encode_us);
+
     ret = krb5_crypto_init(context, reply_key, 0, &crypto);
     if (ret) {
 	const char *msg = krb5_get_error_message(context, ret);
@@ -956,6 +1083,7 @@ _kdc_encode_reply(krb5_context context,
 				   ckvno,
 				   &rep->enc_part);
 	free(buf);
+	t = _kdc_metrics_lap(config, t, &crypto_us);
 	ASN1_MALLOC_ENCODE(AS_REP, buf, buf_size, rep, &len, ret);
     } else {
 	krb5_encrypt_EncryptedData(context,
@@ -966,6 +1094,7 @@ _kdc_encode_reply(krb5_context context,
 				   ckvno,
 				   &rep->enc_part);
 	free(buf);
+	t = _kdc_metrics_lap(config, t, &crypto_us);
 	ASN1_MALLOC_ENCODE(TGS_REP, buf, buf_size, rep, &len, ret);
     }
     krb5_crypto_destroy(context, crypto);
@@ -983,6 +1112,13 @@ _kdc_encode_reply(krb5_context context,
     }
     reply->data = buf;
     reply->length = buf_size;
+
+    _kdc_metrics_lap(config, t, &encode_us);
+    _kdc_metrics_stage(config, KDC_METRIC_STAGE_ENCODE, encode_us);
+    _kdc_metrics_stage(config, KDC_METRIC_STAGE_CRYPTO, crypto_us);
+    _kdc_trace_add(_kdc_trace, "crypto", crypto_us);
+    _kdc_trace_add(_kdc_trace, "encode", encode_us);
+    _kdc_metrics_enctype(config, ek->key.keytype);
     return 0;
 }
 
@@ -1237,6 +1373,9 @@ log_as_req(krb5_context context,
     char *str;
     size_t i;
 
+    if (!kdc_log_enabled(context, config, 0))
+	return;
+
     p = rk_strpoolprintf(NULL, "%s", "Client supported enctypes: ");
 
     for (i = 0; i < b->etype.len; i++) {
@@ -1609,6 +1748,27 @@ add_enc_pa_rep(kdc_request_t r)
 			   KRB5_PADATA_FX_FAST, NULL, 0);
 }
 
+/*
+ * Key for the cached KDC_ERR_PREAUTH_REQUIRED METHOD-DATA of the client
+ * in `r' when asked for the enctypes in `b'.
+ */
+
+static char *
+preauth_cache_key(kdc_request_t r, const KDC_REQ_BODY *b)
+{
+    const hdb_entry *e = &r->client->entry;
+    struct rk_strpool *p;
+    time_t t;
+    size_t i;
+
+    t = e->modified_by ? e->modified_by->time : e->created_by.time;
+    p = rk_strpoolprintf(NULL, "%s:%u:%ld:", r->client_name,
+			 (unsigned)e->kvno, (long)t);
+    for (i = 0; p != NULL && i < b->etype.len; i++)
+	p = rk_strpoolprintf(p, "%d,", (int)b->etype.val[i]);
+    return rk_strpoolcollect(p);
+}
+
 /*
  *
  */
@@ -1633,10 +1793,13 @@ _kdc_as_rep(kdc_request_t r,
     int i, flags = HDB_F_FOR_AS_REQ;
     METHOD_DATA error_method;
     const PA_DATA *pa;
+    char *preauth_key = NULL;
+    krb5_data preauth_e_data;
 
     memset(&rep, 0, sizeof(rep));
     error_method.len = 0;
     error_method.val = NULL;
+    krb5_data_zero(&preauth_e_data);
 
     /*
      * Look for FAST armor and unwrap
@@ -1778,7 +1941,7 @@ _kdc_as_rep(kdc_request_t r,
      * decrypt.
      */
 
-    ret = _kdc_find_etype(context,
+    ret = _kdc_find_etype(context, config,
 			  krb5_principal_is_krbtgt(context, r->server_princ) ?
 			  config->tgt_use_strongest_session_key :
 			  config->svc_use_strongest_session_key, FALSE,
@@ -1814,13 +1977,17 @@ _kdc_as_rep(kdc_request_t r,
 	    i = 0;
 	    pa = _kdc_find_padata(req, &i, pat[n].type);
 	    if (pa) {
+		uint64_t t = _kdc_trace_clock(r->trace);
+
 		ret = pat[n].validate(r, pa);
+		_kdc_trace_stage(r->trace, "preauth", t);
 		if (ret != 0) {
 		    goto out;
 		}
 		kdc_log(context, config, 0,
 			"%s pre-authentication succeeded -- %s",
 			pat[n].name, r->client_name);
+		_kdc_metrics_preauth(config, pat[n].type);
 		found_pa = 1;
 		r->et.flags.pre_authent = 1;
 	    }
@@ -1831,6 +1998,25 @@ _kdc_as_rep(kdc_request_t r,
 	Key *ckey = NULL;
 	size_t n;
 
+	/*
+	 * Unless FAST is used the METHOD-DATA sent back only depends on
+	 * the client and the enctypes asked for, so it can be reused.
+	 */
+	if (config->preauth_cache && r->armor_crypto == NULL &&
+	    require_preauth_p(r) && !_kdc_is_anon_request(b)) {
+	    preauth_key = preauth_cache_key(r, b);
+	    if (preauth_key != NULL &&
+		_kdc_preauth_cache_get(context, config, preauth_key,
+				       &preauth_e_data) == 0) {
+		kdc_log(context, config, 5,
+			"Pre-authentication required, cached reply -- %s",
+			r->client_name);
+		ret = KRB5KDC_ERR_PREAUTH_REQUIRED;
+		_kdc_set_e_text(r, "Need to use PA-ENC-TIMESTAMP/PA-PK-AS-REQ");
+		goto out;
+	    }
+	}
+
 	for (n = 0; n < sizeof(pat) / sizeof(pat[0]); n++) {
 	    if ((pat[n].flags & PA_ANNOUNCE) == 0)
 		continue;
@@ -1843,7 +2029,7 @@ _kdc_as_rep(kdc_request_t r,
 	/*
 	 * If there is a client key, send ETYPE_INFO{,2}
 	 */
-	ret = _kdc_find_etype(context,
+	ret = _kdc_find_etype(context, config,
 			      config->preauth_use_strongest_session_key, TRUE,
 			      r->client, b->etype.val, b->etype.len, NULL, &ckey);
 	if (ret == 0) {
@@ -1877,6 +2063,17 @@ _kdc_as_rep(kdc_request_t r,
 	 * anon is today only allowed via preauth mechanisms.
 	 */
 	if (require_preauth_p(r) || _kdc_is_anon_request(b)) {
+	    if (preauth_key != NULL && error_method.len) {
+		ASN1_MALLOC_ENCODE(METHOD_DATA, preauth_e_data.data,
+				   preauth_e_data.length, &error_method,
+				   &n, ret);
+		if (ret)
+		    goto out;
+		if (preauth_e_data.length != n)
+		    krb5_abortx(context, "internal asn.1 error");
+		_kdc_preauth_cache_put(context, config, preauth_key,
+				       &preauth_e_data);
+	    }
 	    ret = KRB5KDC_ERR_PREAUTH_REQUIRED;
 	    _kdc_set_e_text(r, "Need to use PA-ENC-TIMESTAMP/PA-PK-AS-REQ");
 	    goto out;
@@ -2162,7 +2359,10 @@ _kdc_as_rep(kdc_request_t r,
 
     /* Add the PAC */
     if (send_pac_p(context, req)) {
+	uint64_t t = _kdc_trace_clock(r->trace);
+
 	generate_pac(r, skey);
+	_kdc_trace_stage(r->trace, "pac", t);
     }
 
     _kdc_log_timestamp(context, config, "AS-REQ", r->et.authtime, r->et.starttime,
@@ -2232,7 +2432,14 @@ out:
     /*
      * In case of a non proxy error, build an error message.
      */
-    if (ret != 0 && ret != HDB_ERR_NOT_FOUND_HERE && reply->length == 0) {
+    if (ret != 0 && ret != HDB_ERR_NOT_FOUND_HERE && reply->length == 0 &&
+	preauth_e_data.length) {
+	ret = krb5_mk_error_ext(context, ret, r->e_text, &preauth_e_data,
+				r->server_princ, &r->client_princ->name,
+				&r->client_princ->realm, NULL, NULL, reply);
+	if (ret)
+	    goto out2;
+    } else if (ret != 0 && ret != HDB_ERR_NOT_FOUND_HERE && reply->length == 0) {
 	ret = _kdc_fast_mk_error(context, r,
 				 &error_method,
 				 r->armor_crypto,
@@ -2255,6 +2462,8 @@ out2:
 
     if (error_method.len)
 	free_METHOD_DATA(&error_method);
+    krb5_data_free(&preauth_e_data);
+    free(preauth_key);
     if (r->outpadata.len)
 	free_METHOD_DATA(&r->outpadata);
     if (r->client_princ) {
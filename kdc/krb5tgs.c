@@ -141,7 +141,9 @@ _kdc_add_KRB5SignedPath(krb5_context context,
 	Key *key;
 	ret = hdb_enctype2key(context, &krbtgt->entry, NULL, enctype, &key);
 	if (ret == 0)
-	    ret = krb5_crypto_init(context, &key->key, 0, &crypto);
+	    ret = hdb_entry_unseal_key(context, krbtgt, key);
+	if (ret == 0)
+	    ret = _kdc_get_crypto(context, config, &key->key, 0, &crypto);
 	if (ret) {
 	    free(data.data);
 	    return ret;
@@ -158,7 +160,7 @@ _kdc_add_KRB5SignedPath(krb5_context context,
 
     ret = krb5_create_checksum(context, crypto, KRB5_KU_KRB5SIGNEDPATH, 0,
 			       data.data, data.length, &sp.cksum);
-    krb5_crypto_destroy(context, crypto);
+    _kdc_release_crypto(context, config, crypto);
     free(data.data);
     if (ret)
 	return ret;
@@ -229,7 +231,9 @@ check_KRB5SignedPath(krb5_context context,
 	    ret = hdb_enctype2key(context, &krbtgt->entry, NULL, /* XXX use correct kvno! */
 				  sp.etype, &key);
 	    if (ret == 0)
-		ret = krb5_crypto_init(context, &key->key, 0, &crypto);
+		ret = hdb_entry_unseal_key(context, krbtgt, key);
+	    if (ret == 0)
+		ret = _kdc_get_crypto(context, config, &key->key, 0, &crypto);
 	    if (ret) {
 		free(data.data);
 		free_KRB5SignedPath(&sp);
@@ -239,7 +243,7 @@ check_KRB5SignedPath(krb5_context context,
 	ret = krb5_verify_checksum(context, crypto, KRB5_KU_KRB5SIGNEDPATH,
 				   data.data, data.length,
 				   &sp.cksum);
-	krb5_crypto_destroy(context, crypto);
+	_kdc_release_crypto(context, config, crypto);
 	free(data.data);
 	if (ret) {
 	    free_KRB5SignedPath(&sp);
@@ -1169,6 +1173,7 @@ tgs_parse_request(krb5_context context,
     int kvno_search_tries = 4;  /* number of kvnos to try when tkt_vno == 0 */
     const Keys *krbtgt_keys;/* keyset for TGT tkt_vno */
     Key *tkey;
+    krb5_crypto tcrypto;
     krb5_keyblock *subkey = NULL;
     unsigned usage;
 
@@ -1204,56 +1209,56 @@ tgs_parse_request(krb5_context context,
 
     if (ret == HDB_ERR_NOT_FOUND_HERE) {
 	/* XXX Factor out this unparsing of the same princ all over */
-	char *p;
-	ret = krb5_unparse_name(context, princ, &p);
-	if (ret != 0)
-	    p = failed;
+	if (kdc_log_enabled(context, config, 5)) {
+	    char *p;
+	    ret = krb5_unparse_name(context, princ, &p);
+	    if (ret != 0)
+		p = failed;
+	    kdc_log(context, config, 5,
+		    "Ticket-granting ticket account %s does not have secrets at "
+		    "this KDC, need to proxy", p);
+	    if (ret == 0)
+		free(p);
+	}
 	krb5_free_principal(context, princ);
-	kdc_log(context, config, 5,
-		"Ticket-granting ticket account %s does not have secrets at "
-		"this KDC, need to proxy", p);
-	if (ret == 0)
-	    free(p);
 	ret = HDB_ERR_NOT_FOUND_HERE;
 	goto out;
     } else if (ret == HDB_ERR_KVNO_NOT_FOUND) {
-	char *p;
-	ret = krb5_unparse_name(context, princ, &p);
-	if (ret != 0)
-	    p = failed;
+	if (kdc_log_enabled(context, config, 5)) {
+	    char *p;
+	    ret = krb5_unparse_name(context, princ, &p);
+	    if (ret != 0)
+		p = failed;
+	    kdc_log(context, config, 5,
+		    "Ticket-granting ticket account %s does not have keys for "
+		    "kvno %d at this KDC", p, krbtgt_kvno);
+	    if (ret == 0)
+		free(p);
+	}
 	krb5_free_principal(context, princ);
-	kdc_log(context, config, 5,
-		"Ticket-granting ticket account %s does not have keys for "
-		"kvno %d at this KDC", p, krbtgt_kvno);
-	if (ret == 0)
-	    free(p);
 	ret = HDB_ERR_KVNO_NOT_FOUND;
 	goto out;
     } else if (ret == HDB_ERR_NO_MKEY) {
-	char *p;
-	ret = krb5_unparse_name(context, princ, &p);
-	if (ret != 0)
-	    p = failed;
+	if (kdc_log_enabled(context, config, 5)) {
+	    char *p;
+	    ret = krb5_unparse_name(context, princ, &p);
+	    if (ret != 0)
+		p = failed;
+	    kdc_log(context, config, 5,
+		    "Missing master key for decrypting keys for ticket-granting "
+		    "ticket account %s with kvno %d at this KDC", p, krbtgt_kvno);
+	    if (ret == 0)
+		free(p);
+	}
 	krb5_free_principal(context, princ);
-	kdc_log(context, config, 5,
-		"Missing master key for decrypting keys for ticket-granting "
-		"ticket account %s with kvno %d at this KDC", p, krbtgt_kvno);
-	if (ret == 0)
-	    free(p);
 	ret = HDB_ERR_KVNO_NOT_FOUND;
 	goto out;
     } else if (ret) {
 	const char *msg = krb5_get_error_message(context, ret);
-	char *p;
-	ret = krb5_unparse_name(context, princ, &p);
-	if (ret != 0)
-	    p = failed;
 	krb5_free_principal(context, princ);
 	kdc_log(context, config, 0,
 		"Ticket-granting ticket not found in database: %s", msg);
 	krb5_free_error_message(context, msg);
-	if (ret == 0)
-	    free(p);
 	ret = KRB5KRB_AP_ERR_NOT_US;
 	goto out;
     }
@@ -1289,15 +1294,23 @@ next_kvno:
     else
 	verify_ap_req_flags = 0;
 
-    ret = krb5_verify_ap_req2(context,
-			      &ac,
-			      &ap_req,
-			      princ,
-			      &tkey->key,
-			      verify_ap_req_flags,
-			      &ap_req_options,
-			      ticket,
-			      KRB5_KU_TGS_REQ_AUTH);
+    ret = hdb_entry_unseal_key(context, *krbtgt, tkey);
+    if (ret == 0)
+	ret = _kdc_get_crypto(context, config, &tkey->key, 0, &tcrypto);
+    if (ret) {
+	krb5_free_principal(context, princ);
+	goto out;
+    }
+    ret = _krb5_verify_ap_req_crypto(context,
+				     &ac,
+				     &ap_req,
+				     princ,
+				     tcrypto,
+				     verify_ap_req_flags,
+				     &ap_req_options,
+				     ticket,
+				     KRB5_KU_TGS_REQ_AUTH);
+    _kdc_release_crypto(context, config, tcrypto);
     if (ret == KRB5KRB_AP_ERR_BAD_INTEGRITY && kvno_search_tries > 0) {
 	kvno_search_tries--;
 	krbtgt_kvno_try--;
@@ -1538,6 +1551,7 @@ tgs_build_reply(krb5_context context,
     size_t num_capath = 0;
 
     hdb_entry_ex *krbtgt_out = NULL;
+    struct kdc_fetch fetch[2];
 
     METHOD_DATA enc_pa_data;
 
@@ -1550,6 +1564,7 @@ tgs_build_reply(krb5_context context,
     Key *tkey_check;
     Key *tkey_sign;
     int flags = HDB_F_FOR_TGS_REQ;
+    uint64_t t;
 
     memset(&sessionkey, 0, sizeof(sessionkey));
     memset(&adtkt, 0, sizeof(adtkt));
@@ -1607,7 +1622,9 @@ tgs_build_reply(krb5_context context,
 	    ret = KRB5KDC_ERR_ETYPE_NOSUPP; /* XXX */
 	    goto out;
 	}
-	ret = krb5_decrypt_ticket(context, t, &uukey->key, &adtkt, 0);
+	ret = hdb_entry_unseal_key(context, uu, uukey);
+	if (ret == 0)
+	    ret = krb5_decrypt_ticket(context, t, &uukey->key, &adtkt, 0);
 	_kdc_free_ent(context, uu);
 	if(ret)
 	    goto out;
@@ -1628,16 +1645,18 @@ tgs_build_reply(krb5_context context,
     ret = krb5_unparse_name(context, cp, &cpn);
     if (ret)
 	goto out;
-    unparse_flags (KDCOptions2int(b->kdc_options),
-		   asn1_KDCOptions_units(),
-		   opt_str, sizeof(opt_str));
-    if(*opt_str)
-	kdc_log(context, config, 0,
-		"TGS-REQ %s from %s for %s [%s]",
-		cpn, from, spn, opt_str);
-    else
-	kdc_log(context, config, 0,
-		"TGS-REQ %s from %s for %s", cpn, from, spn);
+    if (kdc_log_enabled(context, config, 0)) {
+	unparse_flags (KDCOptions2int(b->kdc_options),
+		       asn1_KDCOptions_units(),
+		       opt_str, sizeof(opt_str));
+	if(*opt_str)
+	    kdc_log(context, config, 0,
+		    "TGS-REQ %s from %s for %s [%s]",
+		    cpn, from, spn, opt_str);
+	else
+	    kdc_log(context, config, 0,
+		    "TGS-REQ %s from %s for %s", cpn, from, spn);
+    }
 
     /*
      * Fetch server
@@ -1786,7 +1805,7 @@ server_lookup:
 	} else {
 	    Key *skey;
 
-	    ret = _kdc_find_etype(context,
+	    ret = _kdc_find_etype(context, config,
 				  krb5_principal_is_krbtgt(context, sp) ?
 				  config->tgt_use_strongest_session_key :
 				  config->svc_use_strongest_session_key, FALSE,
@@ -1825,6 +1844,8 @@ server_lookup:
 
     ret = hdb_enctype2key(context, &krbtgt->entry, NULL, /* XXX use the right kvno! */
 			  krbtgt_etype, &tkey_check);
+    if (ret == 0)
+	ret = hdb_entry_unseal_key(context, krbtgt, tkey_check);
     if(ret) {
 	kdc_log(context, config, 0,
 		    "Failed to find key for krbtgt PAC check");
@@ -1857,8 +1878,27 @@ server_lookup:
         goto out;
     }
 
-    ret = _kdc_db_fetch(context, config, krbtgt_out_principal,
-			HDB_F_GET_KRBTGT, NULL, NULL, &krbtgt_out);
+    /*
+     * Look up the krbtgt and the client together, the client entry is
+     * only needed further down.
+     */
+    fetch[0].principal = krbtgt_out_principal;
+    fetch[0].flags = HDB_F_GET_KRBTGT;
+    fetch[0].kvno_ptr = NULL;
+    fetch[1].principal = cp;
+    fetch[1].flags = HDB_F_GET_CLIENT | flags;
+    fetch[1].kvno_ptr = NULL;
+    ret = _kdc_db_fetch_many(context, config, 2, fetch);
+    if (ret) {
+	kdc_log(context, config, 0,
+		"Failed to look up %s and client %s", krbtgt_out_n, cpn);
+	goto out;
+    }
+    krbtgt_out = fetch[0].h;
+    client = fetch[1].h;
+    clientdb = fetch[1].db;
+
+    ret = fetch[0].ret;
     if (ret) {
 	char *ktpn = NULL;
 	ret = krb5_unparse_name(context, krbtgt->entry.principal, &ktpn);
@@ -1900,14 +1940,15 @@ server_lookup:
     }
     ret = hdb_enctype2key(context, &krbtgt_out->entry, NULL,
 			  tkey_sign->key.keytype, &tkey_sign);
+    if (ret == 0)
+	ret = hdb_entry_unseal_key(context, krbtgt_out, tkey_sign);
     if(ret) {
 	kdc_log(context, config, 0,
 		    "Failed to find key for krbtgt PAC signature");
 	goto out;
     }
 
-    ret = _kdc_db_fetch(context, config, cp, HDB_F_GET_CLIENT | flags,
-			NULL, &clientdb, &client);
+    ret = fetch[1].ret;
     if(ret == HDB_ERR_NOT_FOUND_HERE) {
 	/* This is OK, we are just trying to find out if they have
 	 * been disabled or deleted in the meantime, missing secrets
@@ -1936,11 +1977,13 @@ server_lookup:
 	krb5_free_error_message(context, msg);
     }
 
+    t = _kdc_trace_clock(_kdc_trace);
     ret = check_PAC(context, config, cp, NULL,
 		    client, server, krbtgt,
 		    &tkey_check->key,
 		    ekey, &tkey_sign->key,
 		    tgt, &rspac, &signedpath);
+    _kdc_trace_stage(_kdc_trace, "pac_verify", t);
     if (ret) {
 	const char *msg = krb5_get_error_message(context, ret);
 	kdc_log(context, config, 0,
@@ -2061,6 +2104,7 @@ server_lookup:
 		    krb5_free_error_message(context, msg);
 		    goto out;
 		}
+		t = _kdc_trace_clock(_kdc_trace);
 		ret = _kdc_pac_generate(context, s4u2self_impersonated_client, &p);
 		if (ret) {
 		    kdc_log(context, config, 0, "PAC generation failed for -- %s",
@@ -2079,6 +2123,7 @@ server_lookup:
 			goto out;
 		    }
 		}
+		_kdc_trace_stage(_kdc_trace, "pac", t);
 	    }
 
 	    /*
@@ -2146,7 +2191,9 @@ server_lookup:
 	    goto out;
 	}
 
-	ret = krb5_decrypt_ticket(context, t, &clientkey->key, &adtkt, 0);
+	ret = hdb_entry_unseal_key(context, client, clientkey);
+	if (ret == 0)
+	    ret = krb5_decrypt_ticket(context, t, &clientkey->key, &adtkt, 0);
 	if (ret) {
 	    kdc_log(context, config, 0,
 		    "failed to decrypt ticket for "
@@ -2208,11 +2255,13 @@ server_lookup:
 	 * TODO: pass in t->sname and t->realm and build
 	 * a S4U_DELEGATION_INFO blob to the PAC.
 	 */
+	t = _kdc_trace_clock(_kdc_trace);
 	ret = check_PAC(context, config, tp, dp,
 			client, server, krbtgt,
 			&clientkey->key,
 			ekey, &tkey_sign->key,
 			&adtkt, &rspac, &ad_signedpath);
+	_kdc_trace_stage(_kdc_trace, "pac_verify", t);
 	if (ret) {
 	    const char *msg = krb5_get_error_message(context, ret);
 	    kdc_log(context, config, 0,
@@ -2409,6 +2458,7 @@ _kdc_tgs_rep(krb5_context context,
     int rk_is_subkey = 0;
     time_t *csec = NULL;
     int *cusec = NULL;
+    uint64_t t;
 
     if(req->padata == NULL){
 	ret = KRB5KDC_ERR_PREAUTH_REQUIRED; /* XXX ??? */
@@ -2426,6 +2476,7 @@ _kdc_tgs_rep(krb5_context context,
 		"TGS-REQ from %s without PA-TGS-REQ", from);
 	goto out;
     }
+    t = _kdc_trace_clock(_kdc_trace);
     ret = tgs_parse_request(context, config,
 			    &req->req_body, tgs_req,
 			    &krbtgt,
@@ -2437,6 +2488,7 @@ _kdc_tgs_rep(krb5_context context,
 			    &auth_data,
 			    &replykey,
 			    &rk_is_subkey);
+    _kdc_trace_stage(_kdc_trace, "ap_req", t);
     if (ret == HDB_ERR_NOT_FOUND_HERE) {
 	/* kdc_log() is called in tgs_parse_request() */
 	goto out;
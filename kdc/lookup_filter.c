@@ -0,0 +1,570 @@
+/*
+ * Copyright (c) 2026 Kungliga Tekniska Högskolan
+ * (Royal Institute of Technology, Stockholm, Sweden).
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the Institute nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE INSTITUTE AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE INSTITUTE OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Negative lookup filter.
+ *
+ * For databases where a fetch can only succeed for the exact encoded
+ * principal name (HDB_CAP_F_EXACT_LOOKUP), keep a Bloom filter of the
+ * names of all entries and their aliases.  A name that is not in the
+ * filter cannot be in the database, so lookups for nonexistent
+ * principals are answered without touching the backend.
+ *
+ * The filter is built by iterating over the database in a thread of
+ * its own, started the first time the filter is needed, and swapped in
+ * when complete; lookups go to the backend meanwhile.  When the
+ * database files change (kadmind, iprop) the filter is dropped at once
+ * and a new one built, at most once per rebuild interval.  Databases
+ * that must not be opened twice (HDB_CAP_F_ONE_HANDLE, LMDB) get no
+ * filter, as it could only be built through the KDC's own handle on
+ * the request path; their lookups are cheap anyway.
+ */
+
+#include "kdc_locl.h"
+
+#define FILTER_BITS_PER_NAME	16
+#define FILTER_HASHES		8
+#define FILTER_MIN_BITS		1024
+
+enum filter_state {
+    FILTER_NONE = 0,
+    FILTER_BUILDING,
+    FILTER_VALID
+};
+
+struct db_filter {
+    char *name;				/* as configured, with any prefix */
+    struct kdc_watch *watch;
+    enum filter_state state;
+    unsigned gen;			/* bumped when the database changes */
+    time_t last_build;
+    krb5_error_code build_ret;		/* outcome of the last build */
+    int announce;			/* build_ret not logged yet */
+    unsigned char *bits;
+    uint64_t mask;			/* number of bits - 1 */
+    size_t count;
+};
+
+struct kdc_lookup_filter {
+    HEIMDAL_MUTEX mutex;
+    time_t rebuild_interval;
+    int builders;			/* build threads running */
+    int shutdown;			/* freed once builders is 0 */
+    int num_db;
+    struct db_filter *dbs;
+};
+
+static uint64_t
+name_hash(const krb5_data *key)
+{
+    const unsigned char *p = key->data;
+    uint64_t h = 0xcbf29ce484222325ULL;
+    size_t i;
+
+    for (i = 0; i < key->length; i++) {
+	h ^= p[i];
+	h *= 0x100000001b3ULL;
+    }
+    /* FNV is weak in the low bits, mix before splitting */
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    return h;
+}
+
+static krb5_error_code
+principal_hash(krb5_context context, krb5_const_principal p, uint64_t *h)
+{
+    krb5_error_code ret;
+    krb5_data key;
+
+    ret = hdb_principal2key(context, p, &key);
+    if (ret)
+	return ret;
+    *h = name_hash(&key);
+    krb5_data_free(&key);
+    return 0;
+}
+
+/*
+ * Bit i of the FILTER_HASHES probes is h1 + i * h2, the usual double
+ * hashing construction.
+ */
+
+static void
+filter_set(unsigned char *bits, uint64_t mask, uint64_t h)
+{
+    uint64_t h1 = h & 0xffffffff, h2 = (h >> 32) | 1, b;
+    int i;
+
+    for (i = 0; i < FILTER_HASHES; i++) {
+	b = (h1 + i * h2) & mask;
+	bits[b >> 3] |= 1 << (b & 7);
+    }
+}
+
+static int
+filter_test(const unsigned char *bits, uint64_t mask, uint64_t h)
+{
+    uint64_t h1 = h & 0xffffffff, h2 = (h >> 32) | 1, b;
+    int i;
+
+    for (i = 0; i < FILTER_HASHES; i++) {
+	b = (h1 + i * h2) & mask;
+	if ((bits[b >> 3] & (1 << (b & 7))) == 0)
+	    return 0;
+    }
+    return 1;
+}
+
+static krb5_error_code
+add_hash(krb5_context context, uint64_t **hashes, size_t *num, size_t *alloc,
+	 krb5_const_principal p)
+{
+    krb5_error_code ret;
+    uint64_t *tmp;
+
+    if (*num == *alloc) {
+	size_t n = *alloc ? *alloc * 2 : 1024;
+
+	tmp = realloc(*hashes, n * sizeof(tmp[0]));
+	if (tmp == NULL)
+	    return krb5_enomem(context);
+	*hashes = tmp;
+	*alloc = n;
+    }
+    ret = principal_hash(context, p, &(*hashes)[*num]);
+    if (ret == 0)
+	(*num)++;
+    return ret;
+}
+
+/*
+ * Read the names of all entries, and their aliases, from `db' and
+ * build a filter from them.
+ */
+
+static krb5_error_code
+build_filter(krb5_context context, HDB *db,
+	     unsigned char **bitsp, uint64_t *maskp, size_t *countp)
+{
+    const HDB_Ext_Aliases *aliases;
+    uint64_t *hashes = NULL, nbits;
+    size_t num = 0, alloc = 0, i;
+    unsigned char *bits;
+    hdb_entry_ex ent;
+    krb5_error_code ret;
+    int opened = 0;
+
+    if (!db->hdb_openp) {
+	ret = db->hdb_open(context, db, O_RDONLY, 0);
+	if (ret)
+	    return ret;
+	opened = 1;
+    }
+
+    memset(&ent, 0, sizeof(ent));
+    ret = db->hdb_firstkey(context, db, 0, &ent);
+    while (ret == 0) {
+	ret = add_hash(context, &hashes, &num, &alloc, ent.entry.principal);
+	if (ret == 0)
+	    ret = hdb_entry_get_aliases(&ent.entry, &aliases);
+	for (i = 0; ret == 0 && aliases != NULL && i < aliases->aliases.len; i++)
+	    ret = add_hash(context, &hashes, &num, &alloc,
+			   &aliases->aliases.val[i]);
+	hdb_free_entry(context, &ent);
+	if (ret)
+	    break;
+	memset(&ent, 0, sizeof(ent));
+	ret = db->hdb_nextkey(context, db, 0, &ent);
+    }
+    if (opened)
+	db->hdb_close(context, db);
+    if (ret != HDB_ERR_NOENTRY) {
+	free(hashes);
+	return ret;
+    }
+
+    for (nbits = FILTER_MIN_BITS; nbits < num * FILTER_BITS_PER_NAME; )
+	nbits <<= 1;
+    bits = calloc(1, nbits / 8);
+    if (bits == NULL) {
+	free(hashes);
+	return krb5_enomem(context);
+    }
+    for (i = 0; i < num; i++)
+	filter_set(bits, nbits - 1, hashes[i]);
+    free(hashes);
+
+    *bitsp = bits;
+    *maskp = nbits - 1;
+    *countp = num;
+    return 0;
+}
+
+/*
+ * Allocate the per database state, with the names the databases are
+ * configured under: hdb_name has lost the backend prefix, and the
+ * build threads need it to open the right kind of database.
+ */
+
+static krb5_error_code
+alloc_dbs(krb5_context context, krb5_kdc_configuration *config,
+	  struct kdc_lookup_filter *f)
+{
+    struct hdb_dbinfo *info, *d;
+    krb5_error_code ret;
+    const char *name;
+    int i;
+
+    ret = hdb_get_dbinfo(context, &info);
+    if (ret)
+	return ret;
+
+    f->dbs = calloc(config->num_db, sizeof(f->dbs[0]));
+    if (f->dbs == NULL) {
+	hdb_free_dbinfo(context, &info);
+	return krb5_enomem(context);
+    }
+    f->num_db = config->num_db;
+
+    d = NULL;
+    for (i = 0; i < f->num_db; i++) {
+	d = hdb_dbinfo_get_next(info, d);
+	if (d == NULL)
+	    break;
+	name = hdb_dbinfo_get_dbname(context, d);
+	if (name == NULL)
+	    name = hdb_default_db(context);
+	f->dbs[i].name = strdup(name);
+	if (f->dbs[i].name == NULL) {
+	    ret = krb5_enomem(context);
+	    break;
+	}
+    }
+    hdb_free_dbinfo(context, &info);
+    return ret;
+}
+
+static void
+filter_free(struct kdc_lookup_filter *f)
+{
+    int i;
+
+    for (i = 0; i < f->num_db; i++) {
+	free(f->dbs[i].name);
+	_kdc_watch_free(f->dbs[i].watch);
+	free(f->dbs[i].bits);
+    }
+    free(f->dbs);
+    HEIMDAL_MUTEX_destroy(&f->mutex);
+    free(f);
+}
+
+/*
+ * Install the result of a build of filter `d', unless the database
+ * was seen to change, or the filters were flushed, after the build
+ * started.  A change nobody has looked for yet is caught by the watch
+ * the next time the filter is used.  The outcome is logged by the
+ * next lookup, which has a configuration to log to.
+ */
+
+static void
+build_done(struct db_filter *d, unsigned gen, krb5_error_code ret,
+	   unsigned char *bits, uint64_t mask, size_t count)
+{
+    d->state = FILTER_NONE;
+    if (ret == 0 && gen != d->gen) {
+	free(bits);
+	return;
+    }
+    d->build_ret = ret;
+    d->announce = 1;
+    if (ret)
+	return;
+    free(d->bits);
+    d->bits = bits;
+    d->mask = mask;
+    d->count = count;
+    d->state = FILTER_VALID;
+}
+
+#ifdef ENABLE_PTHREAD_SUPPORT
+struct build_arg {
+    krb5_context context;
+    struct kdc_lookup_filter *f;
+    int db_index;
+    unsigned gen;
+};
+
+/*
+ * Scan the database through a handle of our own, so that the request
+ * path never waits for a build.
+ */
+
+static void *
+build_thread(void *ptr)
+{
+    struct build_arg *a = ptr;
+    struct kdc_lookup_filter *f = a->f;
+    unsigned char *bits = NULL;
+    uint64_t mask = 0;
+    size_t count = 0;
+    krb5_error_code ret;
+    HDB *db;
+    int gone;
+
+    ret = hdb_create(a->context, &db, f->dbs[a->db_index].name);
+    if (ret == 0) {
+	ret = build_filter(a->context, db, &bits, &mask, &count);
+	(*db->hdb_destroy)(a->context, db);
+    }
+
+    HEIMDAL_MUTEX_lock(&f->mutex);
+    build_done(&f->dbs[a->db_index], a->gen, ret, bits, mask, count);
+    f->builders--;
+    gone = f->shutdown && f->builders == 0;
+    HEIMDAL_MUTEX_unlock(&f->mutex);
+
+    if (gone)
+	filter_free(f);
+    krb5_free_context(a->context);
+    free(a);
+    return NULL;
+}
+#endif
+
+/*
+ * Build filter `db_index' in a new thread if possible.  Called, and
+ * returns, with the mutex held; it is only dropped for a build in the
+ * calling thread, which is what happens without thread support.
+ */
+
+static void
+start_build(krb5_context context, krb5_kdc_configuration *config,
+	    struct kdc_lookup_filter *f, int db_index)
+{
+    struct db_filter *d = &f->dbs[db_index];
+    HDB *db = config->db[db_index];
+    unsigned char *bits = NULL;
+    uint64_t mask = 0;
+    size_t count = 0;
+    krb5_error_code ret;
+    unsigned gen;
+
+    d->state = FILTER_BUILDING;
+    d->last_build = kdc_time;
+    (void)_kdc_watch_changed(d->watch);
+    gen = d->gen;
+
+#ifdef ENABLE_PTHREAD_SUPPORT
+    {
+	struct build_arg *a;
+	pthread_attr_t attr;
+	pthread_t thread;
+
+	a = calloc(1, sizeof(*a));
+	if (a != NULL && krb5_copy_context(context, &a->context) == 0) {
+	    a->f = f;
+	    a->db_index = db_index;
+	    a->gen = gen;
+	    pthread_attr_init(&attr);
+	    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	    if (pthread_create(&thread, &attr, build_thread, a) == 0) {
+		pthread_attr_destroy(&attr);
+		f->builders++;
+		return;
+	    }
+	    pthread_attr_destroy(&attr);
+	    krb5_free_context(a->context);
+	}
+	free(a);
+    }
+#endif
+
+    HEIMDAL_MUTEX_unlock(&f->mutex);
+    ret = build_filter(context, db, &bits, &mask, &count);
+    HEIMDAL_MUTEX_lock(&f->mutex);
+    build_done(d, gen, ret, bits, mask, count);
+}
+
+krb5_error_code
+_kdc_lookup_filter_init(krb5_context context, krb5_kdc_configuration *config)
+{
+    struct kdc_lookup_filter *f;
+
+    config->lookup_filter = NULL;
+
+    if (!krb5_config_get_bool_default(context, NULL, FALSE, "kdc",
+				      "negative-lookup-filter", NULL))
+	return 0;
+
+    f = calloc(1, sizeof(*f));
+    if (f == NULL)
+	return krb5_enomem(context);
+    HEIMDAL_MUTEX_init(&f->mutex);
+    f->rebuild_interval =
+	krb5_config_get_time_default(context, NULL, 10, "kdc",
+				     "negative-lookup-filter-rebuild-interval",
+				     NULL);
+    config->lookup_filter = f;
+    return 0;
+}
+
+/*
+ * Free the filters.  A build still running in another thread frees
+ * them when it finishes.
+ */
+
+void
+_kdc_lookup_filter_free(struct kdc_lookup_filter *f)
+{
+    int gone;
+
+    if (f == NULL)
+	return;
+    HEIMDAL_MUTEX_lock(&f->mutex);
+    f->shutdown = 1;
+    gone = f->builders == 0;
+    HEIMDAL_MUTEX_unlock(&f->mutex);
+    if (gone)
+	filter_free(f);
+}
+
+/*
+ * Drop all filters so they are rebuilt on next use, for example when
+ * the databases are re-opened.
+ */
+
+void
+_kdc_lookup_filter_flush(krb5_context context, krb5_kdc_configuration *config)
+{
+    struct kdc_lookup_filter *f = config->lookup_filter;
+    int i;
+
+    if (f == NULL)
+	return;
+    HEIMDAL_MUTEX_lock(&f->mutex);
+    for (i = 0; i < f->num_db; i++) {
+	if (f->dbs[i].state == FILTER_VALID) {
+	    free(f->dbs[i].bits);
+	    f->dbs[i].bits = NULL;
+	    f->dbs[i].state = FILTER_NONE;
+	}
+	f->dbs[i].gen++;
+	f->dbs[i].last_build = 0;
+    }
+    HEIMDAL_MUTEX_unlock(&f->mutex);
+}
+
+/*
+ * Returns HDB_ERR_NOENTRY if `principal' is known not to be in
+ * database `db_index', zero if it may be.
+ */
+
+krb5_error_code
+_kdc_lookup_filter_check(krb5_context context, krb5_kdc_configuration *config,
+			 int db_index, krb5_const_principal principal)
+{
+    struct kdc_lookup_filter *f = config->lookup_filter;
+    HDB *db = config->db[db_index];
+    struct db_filter *d;
+    krb5_error_code ret;
+    time_t now = kdc_time;
+    uint64_t h;
+
+    if (f == NULL || (db->hdb_capability_flags & HDB_CAP_F_EXACT_LOOKUP) == 0 ||
+	(db->hdb_capability_flags & (HDB_CAP_F_ONE_HANDLE|HDB_CAP_F_IN_MEMORY)))
+	return 0;
+    if (principal_hash(context, principal, &h) != 0)
+	return 0;
+
+    HEIMDAL_MUTEX_lock(&f->mutex);
+
+    if (f->dbs == NULL && alloc_dbs(context, config, f) != 0)
+	goto maybe;
+    if (db_index >= f->num_db || f->dbs[db_index].name == NULL)
+	goto maybe;
+    d = &f->dbs[db_index];
+
+    if (d->watch == NULL) {
+	if (_kdc_watch_create(context, &d->watch) != 0)
+	    goto maybe;
+	if (_kdc_watch_add_db(context, d->watch, db->hdb_name) != 0) {
+	    _kdc_watch_free(d->watch);
+	    d->watch = NULL;
+	    goto maybe;
+	}
+    }
+
+    if (d->announce) {
+	if (d->build_ret) {
+	    const char *msg = krb5_get_error_message(context, d->build_ret);
+	    kdc_log(context, config, 0,
+		    "Failed to build lookup filter for %s: %s",
+		    db->hdb_name, msg);
+	    krb5_free_error_message(context, msg);
+	} else {
+	    kdc_log(context, config, 3, "Built lookup filter for %s: %lu names",
+		    db->hdb_name, (unsigned long)d->count);
+	}
+	d->announce = 0;
+    }
+
+    if (d->state != FILTER_BUILDING && _kdc_watch_changed(d->watch)) {
+	if (d->state == FILTER_VALID)
+	    kdc_log(context, config, 4,
+		    "Database %s changed, dropping lookup filter",
+		    db->hdb_name);
+	free(d->bits);
+	d->bits = NULL;
+	d->state = FILTER_NONE;
+	d->gen++;
+    }
+
+    if (d->state == FILTER_VALID) {
+	ret = filter_test(d->bits, d->mask, h) ? 0 : HDB_ERR_NOENTRY;
+	HEIMDAL_MUTEX_unlock(&f->mutex);
+	return ret;
+    }
+
+    if (d->state == FILTER_NONE &&
+	(d->last_build == 0 || d->last_build + f->rebuild_interval <= now))
+	start_build(context, config, f, db_index);
+
+ maybe:
+    HEIMDAL_MUTEX_unlock(&f->mutex);
+    return 0;
+}
@@ -43,6 +43,7 @@
 #endif
 
 sig_atomic_t exit_flag = 0;
+sig_atomic_t reopen_db_flag = 0;
 
 int detach_from_console = -1;
 int daemon_child = -1;
@@ -59,6 +60,14 @@ sigterm(int sig)
     exit_flag = sig;
 }
 
+#ifdef SIGHUP
+static RETSIGTYPE
+sighup(int sig)
+{
+    reopen_db_flag = 1;
+}
+#endif
+
 /*
  * Allow dropping root bit, since heimdal reopens the database all the
  * time the database needs to be owned by the user you are switched
@@ -146,6 +155,11 @@ main(int argc, char **argv)
 	sigaction(SIGXCPU, &sa, NULL);
 #endif
 
+#ifdef SIGHUP
+	sa.sa_handler = sighup;
+	sigaction(SIGHUP, &sa, NULL);
+#endif
+
 #ifdef SIGCHLD
 	sa.sa_handler = sigchld;
 	sigaction(SIGCHLD, &sa, NULL);
@@ -165,6 +179,9 @@ main(int argc, char **argv)
 #ifdef SIGXCPU
     signal(SIGXCPU, sigterm);
 #endif
+#ifdef SIGHUP
+    signal(SIGHUP, sighup);
+#endif
 #ifdef SIGPIPE
     signal(SIGPIPE, SIG_IGN);
 #endif
@@ -174,6 +191,7 @@ main(int argc, char **argv)
     switch_environment();
 
     start_kdc(context, config, argv[0]);
+    krb5_kdc_free_config(context, config);
     krb5_free_context(context);
     return 0;
 }
@@ -0,0 +1,505 @@
+/*
+ * Copyright (c) 2026 Kungliga Tekniska Högskolan
+ * (Royal Institute of Technology, Stockholm, Sweden).
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the Institute nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE INSTITUTE AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE INSTITUTE OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+
+/*
+ * Request counters and latency histograms.
+ *
+ * The counters live in one anonymous shared mapping made before the
+ * KDC forks its workers.  Each worker process has its own slot in it
+ * (restarted workers take over the slot of the one they replace, so
+ * totals keep growing), and only adds to that slot, with atomic adds
+ * where the compiler has them so that request threads need no lock.
+ * Whoever is asked for the metrics sums all slots.
+ *
+ * Latencies go in log-linear histograms: each power of two of
+ * microseconds is split in four, so a bucket is within 25% of any
+ * value in it, from 1us to about 4.5 minutes.
+ */
+
+#include "kdc_locl.h"
+
+#define METRICS_WORKERS		64
+#define METRICS_ERRORS		128	/* protocol error codes tracked */
+#define METRICS_ETYPES		64	/* enctypes tracked */
+#define METRICS_PADATA		256	/* padata types tracked */
+
+#define HIST_SUB_BITS		2
+#define HIST_SUB		(1 << HIST_SUB_BITS)
+#define HIST_BUCKETS		(27 * HIST_SUB)
+
+#if defined(__GNUC__) && defined(HAVE___SYNC_ADD_AND_FETCH)
+#define metrics_add(p, n)	((void)__sync_add_and_fetch((p), (n)))
+#else
+/* Concurrent request threads may lose an update now and then */
+#define metrics_add(p, n)	((void)(*(p) += (n)))
+#endif
+
+struct metrics_hist {
+    uint64_t bucket[HIST_BUCKETS];
+    uint64_t sum;			/* microseconds */
+    uint64_t count;
+};
+
+struct metrics_worker {
+    uint64_t requests[KDC_METRIC_REQ_MAX][2];	/* udp, tcp */
+    uint64_t errors[METRICS_ERRORS + 1];
+    uint64_t enctypes[METRICS_ETYPES + 1];
+    uint64_t preauth[METRICS_PADATA + 1];
+    struct metrics_hist request[KDC_METRIC_REQ_MAX];
+    struct metrics_hist stage[KDC_METRIC_STAGE_MAX];
+};
+
+struct kdc_metrics {
+    struct metrics_worker w[METRICS_WORKERS];
+};
+
+static const char *req_names[KDC_METRIC_REQ_MAX] = {
+    "as", "tgs", "digest", "kx509", "unknown"
+};
+
+static const struct {
+    const char *name;
+    const char *help;
+} stage_names[KDC_METRIC_STAGE_MAX] = {
+    { "kdc_db_fetch_duration_seconds",
+      "Time to look up a set of principals in the databases." },
+    { "kdc_crypto_duration_seconds", "Time spent encrypting a reply." },
+    { "kdc_encode_duration_seconds", "Time spent encoding a reply." }
+};
+
+/* This process's slot */
+static unsigned int worker_slot;
+
+/*
+ * Return a monotonic time in microseconds, for measuring intervals.
+ */
+
+uint64_t
+_kdc_time_usec(void)
+{
+    struct timeval tv;
+
+#if defined(HAVE_CLOCK_GETTIME) && defined(CLOCK_MONOTONIC)
+    struct timespec ts;
+
+    if (clock_gettime(CLOCK_MONOTONIC, &ts) == 0)
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+#endif
+    gettimeofday(&tv, NULL);
+    return (uint64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+krb5_error_code
+_kdc_metrics_init(krb5_context context, krb5_kdc_configuration *config)
+{
+    struct kdc_metrics *m = NULL;
+
+    config->metrics = NULL;
+    config->metrics_socket =
+	krb5_config_get_string(context, NULL, "kdc", "metrics-socket", NULL);
+    if (config->metrics_socket == NULL)
+	return 0;
+
+#if defined(HAVE_MMAP) && !defined(NO_MMAP) && defined(MAP_ANON)
+    m = mmap(NULL, sizeof(*m), PROT_READ | PROT_WRITE,
+	     MAP_SHARED | MAP_ANON, -1, 0);
+    if (m == MAP_FAILED) {
+	krb5_error_code ret = errno;
+	krb5_set_error_message(context, ret, "mmap of KDC metrics failed: %s",
+			       strerror(ret));
+	return ret;
+    }
+#else
+    /* Without shared memory each worker only reports its own counts */
+    m = calloc(1, sizeof(*m));
+    if (m == NULL)
+	return krb5_enomem(context);
+#endif
+    config->metrics = m;
+    return 0;
+}
+
+/**
+ * Select the slot of the KDC metrics that this process adds to.
+ * Worker processes call this after they are forked, with a number
+ * that is unique among the running workers.
+ */
+
+void
+krb5_kdc_metrics_set_worker(int n)
+{
+    worker_slot = (unsigned int)n % METRICS_WORKERS;
+}
+
+static struct metrics_worker *
+this_worker(krb5_kdc_configuration *config)
+{
+    return &config->metrics->w[worker_slot];
+}
+
+static size_t
+hist_bucket(uint64_t v)
+{
+    unsigned int msb = 0;
+    size_t i;
+
+    if (v < HIST_SUB)
+	return v;
+    while ((v >> msb) > 1)
+	msb++;
+    i = (msb - HIST_SUB_BITS + 1) * HIST_SUB +
+	((v >> (msb - HIST_SUB_BITS)) & (HIST_SUB - 1));
+    return min(i, HIST_BUCKETS - 1);
+}
+
+/* Largest value in bucket `i', in microseconds */
+static uint64_t
+hist_le(size_t i)
+{
+    unsigned int msb = i / HIST_SUB + HIST_SUB_BITS - 1;
+
+    if (i < HIST_SUB)
+	return i;
+    return ((uint64_t)(HIST_SUB + i % HIST_SUB + 1) <<
+	    (msb - HIST_SUB_BITS)) - 1;
+}
+
+static void
+hist_add(struct metrics_hist *h, uint64_t usec)
+{
+    metrics_add(&h->bucket[hist_bucket(usec)], 1);
+    metrics_add(&h->sum, usec);
+    metrics_add(&h->count, 1);
+}
+
+/*
+ * Helpers for timing a stage that is done in several pieces: start
+ * with t = _kdc_metrics_clock(), and after each piece add its time to
+ * an accumulator with t = _kdc_metrics_lap(config, t, &acc).  Both are
+ * free of clock reads when neither metrics nor a request trace (see
+ * trace.c) want the time.
+ */
+
+uint64_t
+_kdc_metrics_clock(krb5_kdc_configuration *config)
+{
+    return config->metrics || _kdc_trace ? _kdc_time_usec() : 0;
+}
+
+uint64_t
+_kdc_metrics_lap(krb5_kdc_configuration *config, uint64_t t, uint64_t *acc)
+{
+    uint64_t now;
+
+    if (t == 0)
+	return 0;
+    now = _kdc_time_usec();
+    *acc += now - t;
+    return now;
+}
+
+void
+_kdc_metrics_stage(krb5_kdc_configuration *config,
+		   enum kdc_metric_stage stage, uint64_t usec)
+{
+    if (config->metrics == NULL)
+	return;
+    hist_add(&this_worker(config)->stage[stage], usec);
+}
+
+void
+_kdc_metrics_enctype(krb5_kdc_configuration *config, krb5_enctype etype)
+{
+    if (config->metrics == NULL)
+	return;
+    metrics_add(&this_worker(config)->enctypes[etype >= 0 &&
+			etype < METRICS_ETYPES ? etype : METRICS_ETYPES], 1);
+}
+
+void
+_kdc_metrics_preauth(krb5_kdc_configuration *config, int padata_type)
+{
+    if (config->metrics == NULL)
+	return;
+    metrics_add(&this_worker(config)->preauth[padata_type >= 0 &&
+			padata_type < METRICS_PADATA ?
+			padata_type : METRICS_PADATA], 1);
+}
+
+/*
+ * Count a finished request of `type' that started at `start' (0 to
+ * not time it).  A failed request is counted under its error code, as
+ * is a request that was answered with a KRB-ERROR.
+ */
+
+void
+_kdc_metrics_request(krb5_kdc_configuration *config,
+		     enum kdc_metric_req type, int datagram,
+		     krb5_error_code ret, const krb5_data *reply,
+		     uint64_t start)
+{
+    struct metrics_worker *w;
+    int code = -1;
+
+    if (config->metrics == NULL)
+	return;
+    w = this_worker(config);
+
+    metrics_add(&w->requests[type][datagram ? 0 : 1], 1);
+
+    if (ret) {
+	if (ret >= KRB5KDC_ERR_NONE && ret < KRB5KDC_ERR_NONE + METRICS_ERRORS)
+	    code = ret - KRB5KDC_ERR_NONE;
+	else
+	    code = METRICS_ERRORS;
+    } else if (reply != NULL && reply->length > 0 &&
+	       ((unsigned char *)reply->data)[0] == 0x7e) {
+	/* [APPLICATION 30], a KRB-ERROR */
+	KRB_ERROR error;
+
+	if (decode_KRB_ERROR(reply->data, reply->length, &error, NULL) == 0) {
+	    if (error.error_code >= 0 && error.error_code < METRICS_ERRORS)
+		code = error.error_code;
+	    else
+		code = METRICS_ERRORS;
+	    free_KRB_ERROR(&error);
+	}
+    }
+    if (code >= 0)
+	metrics_add(&w->errors[code], 1);
+
+    if (start)
+	hist_add(&w->request[type], _kdc_time_usec() - start);
+}
+
+const char *
+_kdc_metrics_req_name(enum kdc_metric_req type)
+{
+    return req_names[type];
+}
+
+/*
+ * Prometheus text exposition
+ */
+
+#define USEC_FMT	"%lu.%06lu"
+#define USEC_ARGS(u)	(unsigned long)((u) / 1000000), \
+			(unsigned long)((u) % 1000000)
+
+/* `labels' is "" or a label set without the braces */
+static struct rk_strpool *
+fmt_hist(struct rk_strpool *p, const char *name, const char *labels,
+	 const struct metrics_hist *h)
+{
+    const char *sep = *labels ? "," : "";
+    uint64_t cum = 0;
+    size_t i;
+
+    for (i = 0; p && i < HIST_BUCKETS - 1; i++) {
+	cum += h->bucket[i];
+	p = rk_strpoolprintf(p, "%s_bucket{%s%sle=\"" USEC_FMT "\"} %llu\n",
+			     name, labels, sep, USEC_ARGS(hist_le(i)),
+			     (unsigned long long)cum);
+    }
+    if (p)
+	p = rk_strpoolprintf(p, "%s_bucket{%s%sle=\"+Inf\"} %llu\n",
+			     name, labels, sep, (unsigned long long)h->count);
+    if (p)
+	p = rk_strpoolprintf(p, "%s_sum%s%s%s " USEC_FMT "\n"
+			     "%s_count%s%s%s %llu\n",
+			     name, *labels ? "{" : "", labels, *labels ? "}" : "",
+			     USEC_ARGS(h->sum),
+			     name, *labels ? "{" : "", labels, *labels ? "}" : "",
+			     (unsigned long long)h->count);
+    return p;
+}
+
+static void
+hist_sum(struct metrics_hist *t, const struct metrics_hist *h)
+{
+    size_t i;
+
+    for (i = 0; i < HIST_BUCKETS; i++)
+	t->bucket[i] += h->bucket[i];
+    t->sum += h->sum;
+    t->count += h->count;
+}
+
+/**
+ * Format the KDC metrics, summed over all worker processes, in the
+ * Prometheus text exposition format.
+ *
+ * @param context A Kerberos 5 context
+ * @param config the KDC configuration
+ * @param out the formatted metrics, free with free()
+ *
+ * @return 0 on success, ENOENT if metrics are not enabled
+ */
+
+krb5_error_code
+krb5_kdc_metrics_format(krb5_context context,
+			krb5_kdc_configuration *config,
+			char **out)
+{
+    struct metrics_worker *t, *w;
+    struct rk_strpool *p = NULL;
+    size_t i, j;
+
+    *out = NULL;
+    if (config->metrics == NULL)
+	return ENOENT;
+
+    t = calloc(1, sizeof(*t));
+    if (t == NULL)
+	return krb5_enomem(context);
+
+    /* Workers keep counting meanwhile, each value is close enough */
+    for (w = config->metrics->w;
+	 w < config->metrics->w + METRICS_WORKERS; w++) {
+	for (i = 0; i < KDC_METRIC_REQ_MAX; i++) {
+	    t->requests[i][0] += w->requests[i][0];
+	    t->requests[i][1] += w->requests[i][1];
+	    hist_sum(&t->request[i], &w->request[i]);
+	}
+	for (i = 0; i <= METRICS_ERRORS; i++)
+	    t->errors[i] += w->errors[i];
+	for (i = 0; i <= METRICS_ETYPES; i++)
+	    t->enctypes[i] += w->enctypes[i];
+	for (i = 0; i <= METRICS_PADATA; i++)
+	    t->preauth[i] += w->preauth[i];
+	for (i = 0; i < KDC_METRIC_STAGE_MAX; i++)
+	    hist_sum(&t->stage[i], &w->stage[i]);
+    }
+
+    p = rk_strpoolprintf(p, "# HELP kdc_requests_total "
+			 "Requests processed, by type and transport.\n"
+			 "# TYPE kdc_requests_total counter\n");
+    for (i = 0; p && i < KDC_METRIC_REQ_MAX; i++)
+	for (j = 0; p && j < 2; j++)
+	    p = rk_strpoolprintf(p, "kdc_requests_total{type=\"%s\","
+				 "transport=\"%s\"} %llu\n", req_names[i],
+				 j ? "tcp" : "udp",
+				 (unsigned long long)t->requests[i][j]);
+
+    if (p == NULL)
+	goto out;
+    p = rk_strpoolprintf(p, "# HELP kdc_errors_total "
+			 "Requests answered with an error, by protocol "
+			 "error code.\n"
+			 "# TYPE kdc_errors_total counter\n");
+    for (i = 0; p && i <= METRICS_ERRORS; i++) {
+	if (t->errors[i] == 0)
+	    continue;
+	if (i == METRICS_ERRORS)
+	    p = rk_strpoolprintf(p, "kdc_errors_total{code=\"other\"} %llu\n",
+				 (unsigned long long)t->errors[i]);
+	else
+	    p = rk_strpoolprintf(p, "kdc_errors_total{code=\"%lu\"} %llu\n",
+				 (unsigned long)i,
+				 (unsigned long long)t->errors[i]);
+    }
+
+    if (p == NULL)
+	goto out;
+    p = rk_strpoolprintf(p, "# HELP kdc_session_enctypes_total "
+			 "Tickets issued, by session key enctype.\n"
+			 "# TYPE kdc_session_enctypes_total counter\n");
+    for (i = 0; p && i <= METRICS_ETYPES; i++) {
+	char *name = NULL;
+
+	if (t->enctypes[i] == 0)
+	    continue;
+	if (i < METRICS_ETYPES &&
+	    krb5_enctype_to_string(context, (krb5_enctype)i, &name) != 0)
+	    name = NULL;
+	if (name)
+	    p = rk_strpoolprintf(p, "kdc_session_enctypes_total"
+				 "{enctype=\"%s\"} %llu\n", name,
+				 (unsigned long long)t->enctypes[i]);
+	else if (i < METRICS_ETYPES)
+	    p = rk_strpoolprintf(p, "kdc_session_enctypes_total"
+				 "{enctype=\"%lu\"} %llu\n", (unsigned long)i,
+				 (unsigned long long)t->enctypes[i]);
+	else
+	    p = rk_strpoolprintf(p, "kdc_session_enctypes_total"
+				 "{enctype=\"other\"} %llu\n",
+				 (unsigned long long)t->enctypes[i]);
+	free(name);
+    }
+
+    if (p == NULL)
+	goto out;
+    p = rk_strpoolprintf(p, "# HELP kdc_preauth_total "
+			 "Successful pre-authentications, by padata type.\n"
+			 "# TYPE kdc_preauth_total counter\n");
+    for (i = 0; p && i <= METRICS_PADATA; i++) {
+	if (t->preauth[i] == 0)
+	    continue;
+	if (i == METRICS_PADATA)
+	    p = rk_strpoolprintf(p, "kdc_preauth_total{padata_type=\"other\"} "
+				 "%llu\n", (unsigned long long)t->preauth[i]);
+	else
+	    p = rk_strpoolprintf(p, "kdc_preauth_total{padata_type=\"%lu\"} "
+				 "%llu\n", (unsigned long)i,
+				 (unsigned long long)t->preauth[i]);
+    }
+
+    if (p == NULL)
+	goto out;
+    p = rk_strpoolprintf(p, "# HELP kdc_request_duration_seconds "
+			 "Time to process a request, by type.\n"
+			 "# TYPE kdc_request_duration_seconds histogram\n");
+    for (i = 0; p && i < KDC_METRIC_REQ_MAX; i++) {
+	char labels[32];
+
+	snprintf(labels, sizeof(labels), "type=\"%s\"", req_names[i]);
+	p = fmt_hist(p, "kdc_request_duration_seconds", labels,
+		     &t->request[i]);
+    }
+
+    for (i = 0; p && i < KDC_METRIC_STAGE_MAX; i++) {
+	p = rk_strpoolprintf(p, "# HELP %s %s\n# TYPE %s histogram\n",
+			     stage_names[i].name, stage_names[i].help,
+			     stage_names[i].name);
+	if (p)
+	    p = fmt_hist(p, stage_names[i].name, "", &t->stage[i]);
+    }
+
+ out:
+    free(t);
+    if (p == NULL)
+	return krb5_enomem(context);
+    *out = rk_strpoolcollect(p);
+    return 0;
+}
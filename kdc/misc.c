@@ -49,39 +49,136 @@ name_type_ok(krb5_context context,
     return 0;
 }
 
-struct timeval _kdc_now;
+HEIMDAL_THREAD_LOCAL struct timeval _kdc_now;
 
-krb5_error_code
-_kdc_db_fetch(krb5_context context,
-	      krb5_kdc_configuration *config,
-	      krb5_const_principal principal,
-	      unsigned flags,
-	      krb5uint32 *kvno_ptr,
-	      HDB **db,
-	      hdb_entry_ex **h)
+/*
+ * Open `db' for a lookup.  With "keep-databases-open" the handle is
+ * left open across requests for backends that can tell us when it has
+ * gone stale, and only re-opened when the backend says so.
+ */
+
+static krb5_error_code
+db_open(krb5_context context, krb5_kdc_configuration *config, HDB *db)
+{
+    krb5_error_code ret;
+
+    if (db->hdb_openp) {
+	if (db->hdb_check_changed(context, db) == 0)
+	    return 0;
+	kdc_log(context, config, 3, "Database %s changed, re-opening",
+		db->hdb_name);
+	db->hdb_close(context, db);
+	db->hdb_openp = 0;
+    }
+
+    ret = db->hdb_open(context, db, O_RDONLY, 0);
+    if (ret == 0 && config->keep_databases_open &&
+	db->hdb_check_changed != NULL)
+	db->hdb_openp = 1;
+    return ret;
+}
+
+static void
+db_close(krb5_context context, HDB *db)
+{
+    if (!db->hdb_openp)
+	db->hdb_close(context, db);
+}
+
+/**
+ * Close any database handles kept open across requests, for example
+ * after a SIGHUP.  They are re-opened on next use.
+ */
+
+void
+krb5_kdc_close_databases(krb5_context context,
+			 krb5_kdc_configuration *config)
 {
-    hdb_entry_ex *ent = NULL;
-    krb5_error_code ret = HDB_ERR_NOENTRY;
     int i;
-    unsigned kvno = 0;
-    krb5_principal enterprise_principal = NULL;
-    krb5_const_principal princ;
 
-    *h = NULL;
+    for (i = 0; i < config->num_db; i++) {
+	if (config->db[i]->hdb_openp) {
+	    config->db[i]->hdb_close(context, config->db[i]);
+	    config->db[i]->hdb_openp = 0;
+	}
+    }
+    _kdc_entry_cache_flush(context, config);
+    _kdc_crypto_cache_flush(context, config);
+    _kdc_lookup_filter_flush(context, config);
+}
+
+/*
+ * Look up `n' principals at once.  Each database is opened once and
+ * asked for all the principals not yet found with hdb_fetch_many(), so
+ * backends that can answer several lookups in one go (one read
+ * transaction, one round trip) get the chance to.  The result of each
+ * lookup is left in f[i].ret, f[i].h and f[i].db as _kdc_db_fetch()
+ * would have returned them; the return value is only non-zero for
+ * errors that are not specific to one of the lookups.
+ */
+
+struct fetch_state {
+    hdb_entry_ex *ent;
+    krb5_principal enterprise_principal;
+    char *cache_key;
+    unsigned long cache_gen;		/* see _kdc_entry_cache_put() */
+    unsigned char *use;			/* databases to search, see db_route.c */
+    unsigned flags;
+    unsigned kvno;
+    int done;
+};
+
+static krb5_error_code
+fetch_prepare(krb5_context context,
+	      krb5_kdc_configuration *config,
+	      struct kdc_fetch *f,
+	      struct fetch_state *s)
+{
+    krb5_const_principal principal = f->principal;
+    krb5_error_code ret;
+    int i;
 
     if (!name_type_ok(context, config, principal))
-        goto out2;
+	return HDB_ERR_NOENTRY;
 
-    if (kvno_ptr != NULL && *kvno_ptr != 0) {
-	kvno = *kvno_ptr;
-	flags |= HDB_F_KVNO_SPECIFIED;
+    s->flags = f->flags;
+    if (f->kvno_ptr != NULL && *f->kvno_ptr != 0) {
+	s->kvno = *f->kvno_ptr;
+	s->flags |= HDB_F_KVNO_SPECIFIED;
     } else {
-	flags |= HDB_F_ALL_KVNOS;
+	s->flags |= HDB_F_ALL_KVNOS;
     }
 
-    ent = calloc(1, sizeof (*ent));
-    if (ent == NULL)
-        return krb5_enomem(context);
+    s->ent = calloc(1, sizeof (*s->ent));
+    if (s->ent == NULL)
+	return krb5_enomem(context);
+
+    if (config->entry_cache) {
+	char *name;
+
+	ret = krb5_unparse_name(context, principal, &name);
+	if (ret)
+	    return ret;
+	ret = asprintf(&s->cache_key, "%x:%u:%d:%s", s->flags, s->kvno,
+		       (int)principal->name.name_type, name);
+	free(name);
+	if (ret == -1 || s->cache_key == NULL) {
+	    s->cache_key = NULL;
+	    return krb5_enomem(context);
+	}
+	ret = _kdc_entry_cache_get(context, config, s->cache_key, &i, s->ent,
+				   &s->cache_gen);
+	if (ret == 0) {
+	    kdc_log(context, config, 5, "Entry cache hit for %s",
+		    s->cache_key);
+	    s->ent->db = config->db[i];
+	    f->db = config->db[i];
+	    f->h = s->ent;
+	    s->ent = NULL;
+	    s->done = 1;
+	    return 0;
+	}
+    }
 
     if (principal->name.name_type == KRB5_NT_ENTERPRISE_PRINCIPAL) {
         if (principal->name.name_string.len != 1) {
@@ -90,74 +187,200 @@ _kdc_db_fetch(krb5_context context,
                                    "malformed request: "
                                    "enterprise name with %d name components",
                                    principal->name.name_string.len);
-            goto out;
+            return ret;
         }
         ret = krb5_parse_name(context, principal->name.name_string.val[0],
-                              &enterprise_principal);
+                              &s->enterprise_principal);
         if (ret)
-            goto out;
+            return ret;
+    }
+
+    if (config->db_routes && config->num_db > 0) {
+	s->use = malloc(config->num_db);
+	if (s->use == NULL)
+	    return krb5_enomem(context);
+	(void) _kdc_db_route(context, config,
+			     s->enterprise_principal ?
+			     s->enterprise_principal : principal, s->use);
+    }
+    return HDB_ERR_NOENTRY;
+}
+
+krb5_error_code
+_kdc_db_fetch_many(krb5_context context,
+		   krb5_kdc_configuration *config,
+		   size_t n,
+		   struct kdc_fetch *f)
+{
+    struct fetch_state *s;
+    hdb_fetch_request *reqs;
+    size_t *idx;
+    krb5_error_code ret;
+    size_t j, k, m;
+    uint64_t start, usec = 0;
+    int i;
+
+    start = _kdc_metrics_clock(config);
+
+    for (j = 0; j < n; j++) {
+	f[j].h = NULL;
+	f[j].db = NULL;
+	f[j].ret = HDB_ERR_NOENTRY;
+	HEIM_PROBE4(kdc, db__fetch__start,
+		    HEIM_PROBE_REALM(f[j].principal),
+		    HEIM_PROBE_COMP(f[j].principal, 0),
+		    HEIM_PROBE_COMP(f[j].principal, 1), f[j].flags);
+    }
+
+    s = calloc(n, sizeof(*s));
+    reqs = calloc(n, sizeof(*reqs));
+    idx = calloc(n, sizeof(*idx));
+    if (s == NULL || reqs == NULL || idx == NULL) {
+	free(s);
+	free(reqs);
+	free(idx);
+	for (j = 0; j < n; j++) {
+	    f[j].ret = ENOMEM;
+	    HEIM_PROBE4(kdc, db__fetch__done,
+			HEIM_PROBE_REALM(f[j].principal),
+			HEIM_PROBE_COMP(f[j].principal, 0),
+			HEIM_PROBE_COMP(f[j].principal, 1), f[j].ret);
+	}
+	return krb5_enomem(context);
+    }
+
+    for (j = 0; j < n; j++) {
+	f[j].ret = fetch_prepare(context, config, &f[j], &s[j]);
+	if (f[j].ret != HDB_ERR_NOENTRY || s[j].ent == NULL)
+	    s[j].done = 1;
     }
 
     for (i = 0; i < config->num_db; i++) {
-	ret = config->db[i]->hdb_open(context, config->db[i], O_RDONLY, 0);
+	HDB *db = config->db[i];
+
+	for (j = 0, m = 0; j < n; j++) {
+	    krb5_const_principal princ = f[j].principal;
+
+	    if (s[j].done || (s[j].use && !s[j].use[i]))
+		continue;
+	    if (_kdc_lookup_filter_check(context, config, i,
+					 s[j].enterprise_principal ?
+					 s[j].enterprise_principal : princ))
+		continue;
+	    if (!(db->hdb_capability_flags & HDB_CAP_F_HANDLE_ENTERPRISE_PRINCIPAL) &&
+		s[j].enterprise_principal)
+		princ = s[j].enterprise_principal;
+
+	    reqs[m].principal = princ;
+	    reqs[m].flags = s[j].flags | HDB_F_DECRYPT | HDB_F_LAZY_UNSEAL;
+	    reqs[m].kvno = s[j].kvno;
+	    reqs[m].entry = s[j].ent;
+	    reqs[m].ret = HDB_ERR_NOENTRY;
+	    idx[m++] = j;
+	}
+	if (m == 0)
+	    continue;
+
+	ret = db_open(context, config, db);
 	if (ret) {
 	    const char *msg = krb5_get_error_message(context, ret);
 	    kdc_log(context, config, 0, "Failed to open database: %s", msg);
 	    krb5_free_error_message(context, msg);
+	    for (k = 0; k < m; k++)
+		f[idx[k]].ret = ret;
 	    continue;
 	}
+	(void) hdb_fetch_many(context, db, m, reqs);
+	db_close(context, db);
 
-        princ = principal;
-        if (!(config->db[i]->hdb_capability_flags & HDB_CAP_F_HANDLE_ENTERPRISE_PRINCIPAL) && enterprise_principal)
-            princ = enterprise_principal;
-
-	ret = config->db[i]->hdb_fetch_kvno(context,
-					    config->db[i],
-					    princ,
-					    flags | HDB_F_DECRYPT,
-					    kvno,
-					    ent);
-	config->db[i]->hdb_close(context, config->db[i]);
-
-	switch (ret) {
-	case HDB_ERR_WRONG_REALM:
-	    /*
-	     * the ent->entry.principal just contains hints for the client
-	     * to retry. This is important for enterprise principal routing
-	     * between trusts.
-	     */
-	    /* fall through */
-	case 0:
-	    if (db)
-		*db = config->db[i];
-	    *h = ent;
-            ent = NULL;
-            goto out;
-
-	case HDB_ERR_NOENTRY:
-	    /* Check the other databases */
-	    continue;
+	for (k = 0; k < m; k++) {
+	    j = idx[k];
+	    f[j].ret = reqs[k].ret;
+
+	    if (f[j].ret == 0 && s[j].cache_key &&
+		(db->hdb_capability_flags & HDB_CAP_F_IN_MEMORY) == 0)
+		_kdc_entry_cache_put(context, config, s[j].cache_key, i,
+				     s[j].ent, s[j].cache_gen);
 
-	default:
-	    /* 
-	     * This is really important, because errors like
-	     * HDB_ERR_NOT_FOUND_HERE (used to indicate to Samba that
-	     * the RODC on which this code is running does not have
-	     * the key we need, and so a proxy to the KDC is required)
-	     * have specific meaning, and need to be propogated up.
-	     */
-	    goto out;
+	    switch (f[j].ret) {
+	    case HDB_ERR_WRONG_REALM:
+		/*
+		 * the ent->entry.principal just contains hints for the client
+		 * to retry. This is important for enterprise principal routing
+		 * between trusts.
+		 */
+		/* fall through */
+	    case 0:
+		f[j].db = db;
+		f[j].h = s[j].ent;
+		s[j].ent = NULL;
+		s[j].done = 1;
+		break;
+
+	    case HDB_ERR_NOENTRY:
+		/* Check the other databases */
+		break;
+
+	    default:
+		/* 
+		 * This is really important, because errors like
+		 * HDB_ERR_NOT_FOUND_HERE (used to indicate to Samba that
+		 * the RODC on which this code is running does not have
+		 * the key we need, and so a proxy to the KDC is required)
+		 * have specific meaning, and need to be propogated up.
+		 */
+		s[j].done = 1;
+		break;
+	    }
 	}
     }
 
-out2:
-    if (ret == HDB_ERR_NOENTRY) {
-	krb5_set_error_message(context, ret, "no such entry found in hdb");
+    for (j = 0; j < n; j++) {
+	if (f[j].ret == HDB_ERR_NOENTRY)
+	    krb5_set_error_message(context, f[j].ret,
+				   "no such entry found in hdb");
+	krb5_free_principal(context, s[j].enterprise_principal);
+	free(s[j].cache_key);
+	free(s[j].use);
+	free(s[j].ent);
+	HEIM_PROBE4(kdc, db__fetch__done,
+		    HEIM_PROBE_REALM(f[j].principal),
+		    HEIM_PROBE_COMP(f[j].principal, 0),
+		    HEIM_PROBE_COMP(f[j].principal, 1), f[j].ret);
     }
-out:
-    krb5_free_principal(context, enterprise_principal);
-    free(ent);
-    return ret;
+    free(s);
+    free(reqs);
+    free(idx);
+
+    _kdc_metrics_lap(config, start, &usec);
+    _kdc_metrics_stage(config, KDC_METRIC_STAGE_DB_FETCH, usec);
+    _kdc_trace_add(_kdc_trace, "db_fetch", usec);
+    return 0;
+}
+
+krb5_error_code
+_kdc_db_fetch(krb5_context context,
+	      krb5_kdc_configuration *config,
+	      krb5_const_principal principal,
+	      unsigned flags,
+	      krb5uint32 *kvno_ptr,
+	      HDB **db,
+	      hdb_entry_ex **h)
+{
+    struct kdc_fetch f;
+    krb5_error_code ret;
+
+    f.principal = principal;
+    f.flags = flags;
+    f.kvno_ptr = kvno_ptr;
+
+    ret = _kdc_db_fetch_many(context, config, 1, &f);
+    if (ret)
+	return ret;
+    if (db && f.db)
+	*db = f.db;
+    *h = f.h;
+    return f.ret;
 }
 
 void
@@ -193,6 +416,9 @@ _kdc_get_preferred_key(krb5_context context,
 	    ret = hdb_enctype2key(context, &h->entry, NULL, p[i], key);
 	    if (ret != 0)
 		continue;
+	    ret = hdb_entry_unseal_key(context, h, *key);
+	    if (ret)
+		return ret;
 	    if (enctype != NULL)
 		*enctype = p[i];
 	    return 0;
@@ -208,6 +434,9 @@ _kdc_get_preferred_key(krb5_context context,
 				  h->entry.keys.val[i].key.keytype, key);
 	    if (ret != 0)
 		continue;
+	    ret = hdb_entry_unseal_key(context, h, *key);
+	    if (ret)
+		return ret;
 	    if (enctype != NULL)
 		*enctype = (*key)->key.keytype;
 	    return 0;
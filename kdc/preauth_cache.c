@@ -0,0 +1,175 @@
+/*
+ * Copyright (c) 2026 Kungliga Tekniska Högskolan
+ * (Royal Institute of Technology, Stockholm, Sweden).
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the Institute nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE INSTITUTE AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE INSTITUTE OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Cache of the METHOD-DATA sent with KDC_ERR_PREAUTH_REQUIRED.
+ *
+ * Most AS exchanges start with a request without pre-authentication
+ * that is answered with the list of mechanisms and the ETYPE-INFO2 for
+ * the client's key.  That answer only depends on the client entry and
+ * the enctypes in the request, so the encoded METHOD-DATA is kept in a
+ * small direct mapped table keyed by the client name, its kvno and
+ * modification time, and the requested enctypes.  A changed key or
+ * entry gives a different key, so stale slots are just never hit
+ * again and get overwritten.
+ */
+
+#include "kdc_locl.h"
+
+#define PREAUTH_CACHE_MAX_AGE	300
+
+struct preauth_slot {
+    char *key;
+    unsigned long hash;
+    time_t created;
+    krb5_data e_data;
+};
+
+struct kdc_preauth_cache {
+    HEIMDAL_MUTEX mutex;
+    size_t size;
+    struct preauth_slot *slots;
+};
+
+static unsigned long
+key_hash(const char *s)
+{
+    unsigned long h = 2166136261UL;
+
+    while (*s) {
+	h ^= (unsigned char)*s++;
+	h *= 16777619UL;
+    }
+    return h;
+}
+
+krb5_error_code
+_kdc_preauth_cache_init(krb5_context context, krb5_kdc_configuration *config)
+{
+    struct kdc_preauth_cache *c;
+    int size;
+
+    config->preauth_cache = NULL;
+
+    size = krb5_config_get_int_default(context, NULL, 0, "kdc",
+				       "preauth-required-cache-size", NULL);
+    if (size <= 0)
+	return 0;
+
+    c = calloc(1, sizeof(*c));
+    if (c == NULL)
+	return krb5_enomem(context);
+    c->slots = calloc(size, sizeof(c->slots[0]));
+    if (c->slots == NULL) {
+	free(c);
+	return krb5_enomem(context);
+    }
+    c->size = size;
+    HEIMDAL_MUTEX_init(&c->mutex);
+    config->preauth_cache = c;
+    return 0;
+}
+
+void
+_kdc_preauth_cache_free(struct kdc_preauth_cache *c)
+{
+    size_t i;
+
+    if (c == NULL)
+	return;
+    for (i = 0; i < c->size; i++) {
+	free(c->slots[i].key);
+	krb5_data_free(&c->slots[i].e_data);
+    }
+    free(c->slots);
+    HEIMDAL_MUTEX_destroy(&c->mutex);
+    free(c);
+}
+
+/*
+ * Look up `key' and, if found, return a copy of the encoded
+ * METHOD-DATA in `e_data'.
+ */
+
+krb5_error_code
+_kdc_preauth_cache_get(krb5_context context, krb5_kdc_configuration *config,
+		       const char *key, krb5_data *e_data)
+{
+    struct kdc_preauth_cache *c = config->preauth_cache;
+    unsigned long hash = key_hash(key);
+    struct preauth_slot *s = &c->slots[hash % c->size];
+    krb5_error_code ret = HDB_ERR_NOENTRY;
+
+    krb5_data_zero(e_data);
+
+    HEIMDAL_MUTEX_lock(&c->mutex);
+    if (s->key != NULL && s->hash == hash && strcmp(s->key, key) == 0 &&
+	s->created + PREAUTH_CACHE_MAX_AGE >= kdc_time)
+	ret = krb5_data_copy(e_data, s->e_data.data, s->e_data.length);
+    HEIMDAL_MUTEX_unlock(&c->mutex);
+
+    return ret;
+}
+
+/*
+ * Remember the encoded METHOD-DATA `e_data' under `key', replacing
+ * whatever was in its slot.
+ */
+
+void
+_kdc_preauth_cache_put(krb5_context context, krb5_kdc_configuration *config,
+		       const char *key, const krb5_data *e_data)
+{
+    struct kdc_preauth_cache *c = config->preauth_cache;
+    unsigned long hash = key_hash(key);
+    struct preauth_slot *s = &c->slots[hash % c->size];
+    krb5_data copy;
+    char *k;
+
+    k = strdup(key);
+    if (k == NULL)
+	return;
+    if (krb5_data_copy(&copy, e_data->data, e_data->length) != 0) {
+	free(k);
+	return;
+    }
+
+    HEIMDAL_MUTEX_lock(&c->mutex);
+    free(s->key);
+    krb5_data_free(&s->e_data);
+    s->key = k;
+    s->hash = hash;
+    s->created = kdc_time;
+    s->e_data = copy;
+    HEIMDAL_MUTEX_unlock(&c->mutex);
+}
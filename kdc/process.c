@@ -60,17 +60,20 @@ kdc_as_req(krb5_context context,
     struct kdc_request_desc r;
     krb5_error_code ret;
     size_t len;
+    uint64_t t = _kdc_trace_clock(_kdc_trace);
 
     memset(&r, 0, sizeof(r));
 
     ret = decode_AS_REQ(req_buffer->data, req_buffer->length, &r.req, &len);
     if (ret)
 	return ret;
+    _kdc_trace_stage(_kdc_trace, "decode", t);
 
     r.context = context;
     r.config = config;
     r.request.data = req_buffer->data;
     r.request.length = req_buffer->length;
+    r.trace = _kdc_trace;
 
     *claim = 1;
 
@@ -93,10 +96,12 @@ kdc_tgs_req(krb5_context context,
     krb5_error_code ret;
     KDC_REQ req;
     size_t len;
+    uint64_t t = _kdc_trace_clock(_kdc_trace);
 
     ret = decode_TGS_REQ(req_buffer->data, req_buffer->length, &req, &len);
     if (ret)
 	return ret;
+    _kdc_trace_stage(_kdc_trace, "decode", t);
 
     *claim = 1;
 
@@ -167,18 +172,51 @@ kdc_kx509(krb5_context context,
 #endif
 
 
-static struct krb5_kdc_service services[] =  {
-    { KS_KRB5,		kdc_as_req },
-    { KS_KRB5,		kdc_tgs_req },
+/*
+ * Each request type is known by the outer tag of its encoding, so the
+ * dispatcher looks at that once and hands the request to the one
+ * service that can decode it instead of letting every service try.
+ * kx509 requests start with a version number whose first byte reads
+ * as universal tag 0.
+ */
+
+static const struct kdc_service_tag {
+    Der_class cl;
+    Der_type ty;
+    unsigned int tag;
+    enum kdc_metric_req metric;
+    struct krb5_kdc_service service;
+} services[] =  {
+    { ASN1_C_APPL, CONS, 10,	KDC_METRIC_REQ_AS,	{ KS_KRB5,	kdc_as_req } },
+    { ASN1_C_APPL, CONS, 12,	KDC_METRIC_REQ_TGS,	{ KS_KRB5,	kdc_tgs_req } },
 #ifdef DIGEST
-    { 0,		kdc_digest },
+    { ASN1_C_APPL, CONS, 128,	KDC_METRIC_REQ_DIGEST,	{ 0,		kdc_digest } },
 #endif
 #ifdef KX509
-    { 0,		kdc_kx509 },
+    { ASN1_C_UNIV, PRIM, 0,	KDC_METRIC_REQ_KX509,	{ 0,		kdc_kx509 } },
 #endif
-    { 0, NULL }
+    { 0, 0, 0, 0, { 0, NULL } }
 };
 
+static const struct kdc_service_tag *
+find_service(const unsigned char *buf, size_t len)
+{
+    Der_class cl;
+    Der_type ty;
+    unsigned int tag;
+    unsigned int i;
+
+    if (der_get_tag(buf, len, &cl, &ty, &tag, NULL) != 0)
+	return NULL;
+
+    for (i = 0; services[i].service.process != NULL; i++) {
+	if (services[i].tag == tag && services[i].cl == cl &&
+	    services[i].ty == ty)
+	    return &services[i];
+    }
+    return NULL;
+}
+
 /*
  * handle the request in `buf, len', from `addr' (or `from' as a string),
  * sending a reply in `reply'.
@@ -195,31 +233,53 @@ krb5_kdc_process_request(krb5_context context,
 			 struct sockaddr *addr,
 			 int datagram_reply)
 {
+    const struct kdc_service_tag *s;
+    const struct krb5_kdc_service *service;
     krb5_error_code ret;
-    unsigned int i;
     krb5_data req_buffer;
     int claim = 0;
-    heim_auto_release_t pool = heim_auto_release_create();
+    heim_auto_release_t pool;
+    struct kdc_trace trace;
+    uint64_t start = _kdc_metrics_clock(config);
+
+    HEIM_PROBE3(kdc, request__start, from, len, datagram_reply);
+
+    s = find_service(buf, len);
+    if (s == NULL) {
+	_kdc_metrics_request(config, KDC_METRIC_REQ_UNKNOWN, datagram_reply,
+			     0, NULL, 0);
+	HEIM_PROBE3(kdc, request__done, "unknown", -1, 0);
+	return -1;
+    }
+    service = &s->service;
 
     req_buffer.data = buf;
     req_buffer.length = len;
 
-    for (i = 0; services[i].process != NULL; i++) {
-	ret = (*services[i].process)(context, config, &req_buffer,
-				     reply, from, addr, datagram_reply,
-				     &claim);
-	if (claim) {
-	    if (services[i].flags & KS_NO_LENGTH)
-		*prependlength = 0;
-
-	    heim_release(pool);
-	    return ret;
-	}
-    }
-
+    pool = heim_auto_release_create();
+    _kdc_trace_begin(config, &trace);
+    ret = (*service->process)(context, config, &req_buffer,
+			      reply, from, addr, datagram_reply,
+			      &claim);
+    _kdc_trace_end(context, config,
+		   _kdc_metrics_req_name(claim ? s->metric :
+					 KDC_METRIC_REQ_UNKNOWN),
+		   from, ret);
     heim_release(pool);
 
-    return -1;
+    if (!claim) {
+	_kdc_metrics_request(config, KDC_METRIC_REQ_UNKNOWN, datagram_reply,
+			     0, NULL, 0);
+	HEIM_PROBE3(kdc, request__done, "unknown", -1, 0);
+	return -1;
+    }
+    _kdc_metrics_request(config, s->metric, datagram_reply, ret, reply,
+			 start);
+    HEIM_PROBE3(kdc, request__done, _kdc_metrics_req_name(s->metric),
+		ret, reply->length);
+    if (service->flags & KS_NO_LENGTH)
+	*prependlength = 0;
+    return ret;
 }
 
 /*
@@ -239,25 +299,41 @@ krb5_kdc_process_krb5_request(krb5_context context,
 			      struct sockaddr *addr,
 			      int datagram_reply)
 {
+    const struct kdc_service_tag *s;
     krb5_error_code ret;
-    unsigned int i;
     krb5_data req_buffer;
     int claim = 0;
+    struct kdc_trace trace;
+    uint64_t start = _kdc_metrics_clock(config);
+
+    HEIM_PROBE3(kdc, request__start, from, len, datagram_reply);
+
+    s = find_service(buf, len);
+    if (s == NULL || (s->service.flags & KS_KRB5) == 0) {
+	HEIM_PROBE3(kdc, request__done, "unknown", -1, 0);
+	return -1;
+    }
 
     req_buffer.data = buf;
     req_buffer.length = len;
 
-    for (i = 0; services[i].process != NULL; i++) {
-	if ((services[i].flags & KS_KRB5) == 0)
-	    continue;
-	ret = (*services[i].process)(context, config, &req_buffer,
-				     reply, from, addr, datagram_reply,
-				     &claim);
-	if (claim)
-	    return ret;
+    _kdc_trace_begin(config, &trace);
+    ret = (*s->service.process)(context, config, &req_buffer,
+				reply, from, addr, datagram_reply,
+				&claim);
+    _kdc_trace_end(context, config,
+		   _kdc_metrics_req_name(claim ? s->metric :
+					 KDC_METRIC_REQ_UNKNOWN),
+		   from, ret);
+    if (!claim) {
+	HEIM_PROBE3(kdc, request__done, "unknown", -1, 0);
+	return -1;
     }
-
-    return -1;
+    _kdc_metrics_request(config, s->metric, datagram_reply, ret, reply,
+			 start);
+    HEIM_PROBE3(kdc, request__done, _kdc_metrics_req_name(s->metric),
+		ret, reply->length);
+    return ret;
 }
 
 /*
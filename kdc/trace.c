@@ -0,0 +1,145 @@
+/*
+ * Copyright (c) 2026 Kungliga Tekniska Högskolan
+ * (Royal Institute of Technology, Stockholm, Sweden).
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the Institute nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE INSTITUTE AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE INSTITUTE OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Per-request stage timings.
+ *
+ * With [kdc] slow-request-threshold set, every request carries a
+ * small trace on the stack of the thread serving it.  The stages of
+ * the request add their monotonic time to it as they finish, one
+ * entry each time they run, so a request that fetches three entries
+ * shows three db_fetch entries.  When the request is done and took
+ * longer than the threshold, the whole breakdown is logged as one
+ * key=value record:
+ *
+ *   slow-request type=as from=... error=0 total_us=52310 decode_us=14
+ *       db_fetch_us=51020 preauth_us=840 db_fetch_us=230 ...
+ *
+ * Requests under the threshold are dropped without any formatting,
+ * and with no threshold nothing reads the clock at all.
+ */
+
+#include "kdc_locl.h"
+
+HEIMDAL_THREAD_LOCAL struct kdc_trace *_kdc_trace;
+
+void
+_kdc_trace_begin(krb5_kdc_configuration *config, struct kdc_trace *t)
+{
+    if (config->slow_request_threshold <= 0) {
+	_kdc_trace = NULL;
+	return;
+    }
+    t->n = 0;
+    t->dropped = 0;
+    t->start = _kdc_time_usec();
+    _kdc_trace = t;
+}
+
+uint64_t
+_kdc_trace_clock(struct kdc_trace *t)
+{
+    return t ? _kdc_time_usec() : 0;
+}
+
+void
+_kdc_trace_add(struct kdc_trace *t, const char *stage, uint64_t usec)
+{
+    if (t == NULL)
+	return;
+    if (t->n < KDC_TRACE_MAX) {
+	t->ev[t->n].stage = stage;
+	t->ev[t->n].usec = usec;
+	t->n++;
+    } else {
+	t->dropped++;
+    }
+}
+
+/*
+ * Add the time since `start', from _kdc_trace_clock(), as `stage'.
+ */
+
+void
+_kdc_trace_stage(struct kdc_trace *t, const char *stage, uint64_t start)
+{
+    if (t == NULL || start == 0)
+	return;
+    _kdc_trace_add(t, stage, _kdc_time_usec() - start);
+}
+
+/*
+ * Finish the trace of this thread's request and log it if it was
+ * slow.  Must be called on every path out of the request once
+ * _kdc_trace_begin() has been.
+ */
+
+void
+_kdc_trace_end(krb5_context context,
+	       krb5_kdc_configuration *config,
+	       const char *type,
+	       const char *from,
+	       krb5_error_code ret)
+{
+    struct kdc_trace *t = _kdc_trace;
+    struct rk_strpool *p;
+    uint64_t total;
+    unsigned int i;
+    char *s;
+
+    if (t == NULL)
+	return;
+    _kdc_trace = NULL;
+
+    total = _kdc_time_usec() - t->start;
+    if (total < (uint64_t)config->slow_request_threshold * 1000)
+	return;
+
+    p = rk_strpoolprintf(NULL, "slow-request type=%s from=%s error=%d "
+			 "total_us=%llu", type, from ? from : "-", ret,
+			 (unsigned long long)total);
+    for (i = 0; p && i < t->n; i++)
+	p = rk_strpoolprintf(p, " %s_us=%llu", t->ev[i].stage,
+			     (unsigned long long)t->ev[i].usec);
+    if (p && t->dropped)
+	p = rk_strpoolprintf(p, " dropped=%u", t->dropped);
+    s = rk_strpoolcollect(p);
+    if (s == NULL || *s == '\0') {
+	kdc_log(context, config, 0, "slow-request type=%s total_us=%llu",
+		type, (unsigned long long)total);
+	free(s);
+	return;
+    }
+    kdc_log(context, config, 0, "%s", s);
+    free(s);
+}
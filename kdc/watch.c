@@ -0,0 +1,185 @@
+/*
+ * Copyright (c) 2026 Kungliga Tekniska Högskolan
+ * (Royal Institute of Technology, Stockholm, Sweden).
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the Institute nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE INSTITUTE AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE INSTITUTE OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Detect changes to database files by comparing stat() results, for
+ * the caches that have to be dropped or rebuilt when the database is
+ * modified behind the KDC's back (kadmind, ipropd-slave, kdb5_util).
+ */
+
+#include "kdc_locl.h"
+
+struct watch_file {
+    char *path;
+    int present;
+    dev_t dev;
+    ino_t ino;
+    off_t size;
+    time_t mtime;
+    long mtime_nsec;
+};
+
+struct kdc_watch {
+    struct watch_file *files;
+    size_t num_files;
+};
+
+static void
+watch_stat(struct watch_file *w)
+{
+    struct stat sb;
+
+    if (stat(w->path, &sb) != 0) {
+	w->present = 0;
+	w->dev = 0;
+	w->ino = 0;
+	w->size = 0;
+	w->mtime = 0;
+	w->mtime_nsec = 0;
+	return;
+    }
+    w->present = 1;
+    w->dev = sb.st_dev;
+    w->ino = sb.st_ino;
+    w->size = sb.st_size;
+    w->mtime = sb.st_mtime;
+#ifdef HAVE_STRUCT_STAT_ST_MTIM
+    w->mtime_nsec = sb.st_mtim.tv_nsec;
+#else
+    w->mtime_nsec = 0;
+#endif
+}
+
+krb5_error_code
+_kdc_watch_create(krb5_context context, struct kdc_watch **w)
+{
+    *w = calloc(1, sizeof(**w));
+    if (*w == NULL)
+	return krb5_enomem(context);
+    return 0;
+}
+
+void
+_kdc_watch_free(struct kdc_watch *w)
+{
+    size_t i;
+
+    if (w == NULL)
+	return;
+    for (i = 0; i < w->num_files; i++)
+	free(w->files[i].path);
+    free(w->files);
+    free(w);
+}
+
+/*
+ * Add the file named by the format string; it need not exist yet.
+ */
+
+krb5_error_code
+_kdc_watch_add(krb5_context context, struct kdc_watch *w, const char *fmt, ...)
+{
+    struct watch_file *tmp;
+    va_list ap;
+    char *path;
+    int aret;
+
+    va_start(ap, fmt);
+    aret = vasprintf(&path, fmt, ap);
+    va_end(ap);
+    if (aret == -1 || path == NULL)
+	return krb5_enomem(context);
+
+    tmp = realloc(w->files, (w->num_files + 1) * sizeof(w->files[0]));
+    if (tmp == NULL) {
+	free(path);
+	return krb5_enomem(context);
+    }
+    w->files = tmp;
+    memset(&w->files[w->num_files], 0, sizeof(w->files[0]));
+    w->files[w->num_files].path = path;
+    watch_stat(&w->files[w->num_files]);
+    w->num_files++;
+    return 0;
+}
+
+/*
+ * Add the files a database named `name' may live in, under the names
+ * the file based backends use.  Backend prefixes, as in
+ * "mdb:/var/heimdal/heimdal" or "snapshot:mdb:/var/heimdal/heimdal",
+ * are skipped.
+ */
+
+krb5_error_code
+_kdc_watch_add_db(krb5_context context, struct kdc_watch *w, const char *name)
+{
+    krb5_error_code ret;
+    const char *p, *q;
+
+    while ((p = strchr(name, ':')) != NULL &&
+	   ((q = strchr(name, '/')) == NULL || p < q))
+	name = p + 1;
+
+    ret = _kdc_watch_add(context, w, "%s", name);
+    if (ret == 0)
+	ret = _kdc_watch_add(context, w, "%s.db", name);
+    if (ret == 0)
+	ret = _kdc_watch_add(context, w, "%s.mdb", name);
+    return ret;
+}
+
+/*
+ * Returns non-zero if any of the watched files changed since the last
+ * call.
+ */
+
+int
+_kdc_watch_changed(struct kdc_watch *w)
+{
+    struct watch_file old;
+    int changed = 0;
+    size_t i;
+
+    for (i = 0; i < w->num_files; i++) {
+	old = w->files[i];
+	watch_stat(&w->files[i]);
+	if (old.present != w->files[i].present ||
+	    old.dev != w->files[i].dev ||
+	    old.ino != w->files[i].ino ||
+	    old.size != w->files[i].size ||
+	    old.mtime != w->files[i].mtime ||
+	    old.mtime_nsec != w->files[i].mtime_nsec)
+	    changed = 1;
+    }
+    return changed;
+}
@@ -41,9 +41,305 @@
 #include "rijndael-alg-fst.h"
 #include "aes.h"
 
+/*
+ * On x86 use the AES-NI instructions when the CPU has them.  The
+ * choice is made once at runtime, and since the round keys are laid
+ * out differently for the two implementations, every AES_KEY in the
+ * process uses the same one.
+ */
+
+#if defined(__GNUC__) && (__GNUC__ >= 5 || defined(__clang__)) && \
+    (defined(__x86_64__) || defined(__i386__)) && \
+    defined(HAVE_CPUID_H) && defined(HAVE_WMMINTRIN_H)
+#define USE_AESNI 1
+#endif
+
+#ifdef USE_AESNI
+
+#include <cpuid.h>
+#include <wmmintrin.h>
+
+#define AESNI_TARGET __attribute__((target("aes,sse2")))
+
+static int aesni_state = -1;
+
+static int
+have_aesni(void)
+{
+    unsigned int a, b, c, d;
+
+    if (aesni_state == -1) {
+	if (__get_cpuid(1, &a, &b, &c, &d) &&
+	    (c & (1U << 25)) && (d & (1U << 26)))
+	    aesni_state = 1;
+	else
+	    aesni_state = 0;
+    }
+    return aesni_state;
+}
+
+static AESNI_TARGET inline __m128i
+aesni_expand(__m128i k, __m128i t)
+{
+    k = _mm_xor_si128(k, _mm_slli_si128(k, 4));
+    k = _mm_xor_si128(k, _mm_slli_si128(k, 4));
+    k = _mm_xor_si128(k, _mm_slli_si128(k, 4));
+    return _mm_xor_si128(k, t);
+}
+
+#define EXPAND128(i, rcon)						\
+    k0 = aesni_expand(k0, _mm_shuffle_epi32(				\
+	_mm_aeskeygenassist_si128(k0, rcon), 0xff));			\
+    rk[i] = k0
+
+#define EXPAND256(i, rcon)						\
+    k0 = aesni_expand(k0, _mm_shuffle_epi32(				\
+	_mm_aeskeygenassist_si128(k1, rcon), 0xff));			\
+    rk[i] = k0;								\
+    if (i < 14) {							\
+	k1 = aesni_expand(k1, _mm_shuffle_epi32(			\
+	    _mm_aeskeygenassist_si128(k0, 0), 0xaa));			\
+	rk[i + 1] = k1;							\
+    }
+
+/*
+ * Expand the encryption key schedule into rk[0..rounds].  AES-192 is
+ * rare enough that it borrows the table driven expansion and just
+ * converts the big endian words to the byte order AES-NI wants.
+ */
+
+static AESNI_TARGET int
+aesni_key_expand(const unsigned char *userkey, int bits, __m128i *rk)
+{
+    __m128i k0, k1;
+
+    switch (bits) {
+    case 128:
+	k0 = _mm_loadu_si128((const __m128i *)userkey);
+	rk[0] = k0;
+	EXPAND128(1, 0x01);
+	EXPAND128(2, 0x02);
+	EXPAND128(3, 0x04);
+	EXPAND128(4, 0x08);
+	EXPAND128(5, 0x10);
+	EXPAND128(6, 0x20);
+	EXPAND128(7, 0x40);
+	EXPAND128(8, 0x80);
+	EXPAND128(9, 0x1b);
+	EXPAND128(10, 0x36);
+	return 10;
+    case 192: {
+	uint32_t w[4 * 13];
+	unsigned char b[sizeof(w)];
+	int i;
+
+	if (rijndaelKeySetupEnc(w, userkey, bits) != 12)
+	    return 0;
+	for (i = 0; i < 4 * 13; i++) {
+	    b[4 * i    ] = (w[i] >> 24) & 0xff;
+	    b[4 * i + 1] = (w[i] >> 16) & 0xff;
+	    b[4 * i + 2] = (w[i] >>  8) & 0xff;
+	    b[4 * i + 3] = (w[i]      ) & 0xff;
+	}
+	for (i = 0; i < 13; i++)
+	    rk[i] = _mm_loadu_si128((const __m128i *)&b[16 * i]);
+	memset_s(w, sizeof(w), 0, sizeof(w));
+	memset_s(b, sizeof(b), 0, sizeof(b));
+	return 12;
+    }
+    case 256:
+	k0 = _mm_loadu_si128((const __m128i *)userkey);
+	k1 = _mm_loadu_si128((const __m128i *)(userkey + 16));
+	rk[0] = k0;
+	rk[1] = k1;
+	EXPAND256(2, 0x01);
+	EXPAND256(4, 0x02);
+	EXPAND256(6, 0x04);
+	EXPAND256(8, 0x08);
+	EXPAND256(10, 0x10);
+	EXPAND256(12, 0x20);
+	EXPAND256(14, 0x40);
+	return 14;
+    default:
+	return 0;
+    }
+}
+
+#undef EXPAND128
+#undef EXPAND256
+
+static AESNI_TARGET void
+aesni_store_key(AES_KEY *key, const __m128i *rk, int rounds)
+{
+    int i;
+
+    for (i = 0; i <= rounds; i++)
+	_mm_storeu_si128((__m128i *)&key->key[4 * i], rk[i]);
+    key->rounds = rounds;
+}
+
+static AESNI_TARGET int
+aesni_set_encrypt_key(const unsigned char *userkey, int bits, AES_KEY *key)
+{
+    __m128i rk[15];
+    int rounds;
+
+    rounds = aesni_key_expand(userkey, bits, rk);
+    if (rounds == 0) {
+	key->rounds = 0;
+	return -1;
+    }
+    aesni_store_key(key, rk, rounds);
+    memset_s(rk, sizeof(rk), 0, sizeof(rk));
+    return 0;
+}
+
+/*
+ * The decryption schedule is the encryption schedule reversed, with
+ * InvMixColumns applied to all but the first and last round keys.
+ */
+
+static AESNI_TARGET int
+aesni_set_decrypt_key(const unsigned char *userkey, int bits, AES_KEY *key)
+{
+    __m128i ek[15], dk[15];
+    int i, rounds;
+
+    rounds = aesni_key_expand(userkey, bits, ek);
+    if (rounds == 0) {
+	key->rounds = 0;
+	return -1;
+    }
+    dk[0] = ek[rounds];
+    for (i = 1; i < rounds; i++)
+	dk[i] = _mm_aesimc_si128(ek[rounds - i]);
+    dk[rounds] = ek[0];
+    aesni_store_key(key, dk, rounds);
+    memset_s(ek, sizeof(ek), 0, sizeof(ek));
+    memset_s(dk, sizeof(dk), 0, sizeof(dk));
+    return 0;
+}
+
+#define RK(key, i) _mm_loadu_si128((const __m128i *)&(key)->key[4 * (i)])
+
+static AESNI_TARGET inline __m128i
+aesni_encrypt_block(__m128i b, const AES_KEY *key)
+{
+    int i;
+
+    b = _mm_xor_si128(b, RK(key, 0));
+    for (i = 1; i < key->rounds; i++)
+	b = _mm_aesenc_si128(b, RK(key, i));
+    return _mm_aesenclast_si128(b, RK(key, key->rounds));
+}
+
+static AESNI_TARGET inline __m128i
+aesni_decrypt_block(__m128i b, const AES_KEY *key)
+{
+    int i;
+
+    b = _mm_xor_si128(b, RK(key, 0));
+    for (i = 1; i < key->rounds; i++)
+	b = _mm_aesdec_si128(b, RK(key, i));
+    return _mm_aesdeclast_si128(b, RK(key, key->rounds));
+}
+
+static AESNI_TARGET void
+aesni_encrypt(const unsigned char *in, unsigned char *out, const AES_KEY *key)
+{
+    __m128i b = _mm_loadu_si128((const __m128i *)in);
+
+    _mm_storeu_si128((__m128i *)out, aesni_encrypt_block(b, key));
+}
+
+static AESNI_TARGET void
+aesni_decrypt(const unsigned char *in, unsigned char *out, const AES_KEY *key)
+{
+    __m128i b = _mm_loadu_si128((const __m128i *)in);
+
+    _mm_storeu_si128((__m128i *)out, aesni_decrypt_block(b, key));
+}
+
+/*
+ * Process the whole blocks of a CBC operation and return the number
+ * of bytes consumed.  Encryption is inherently serial; decryption
+ * runs four independent blocks through the pipeline at a time.  All
+ * ciphertext is loaded before anything is stored so in == out works.
+ */
+
+static AESNI_TARGET unsigned long
+aesni_cbc_encrypt(const unsigned char *in, unsigned char *out,
+		  unsigned long size, const AES_KEY *key,
+		  unsigned char *iv, int forward_encrypt)
+{
+    unsigned long done = 0;
+    __m128i v, c0, c1, c2, c3, b0, b1, b2, b3, k;
+    int i;
+
+    v = _mm_loadu_si128((const __m128i *)iv);
+
+    if (forward_encrypt) {
+	while (size - done >= AES_BLOCK_SIZE) {
+	    b0 = _mm_loadu_si128((const __m128i *)(in + done));
+	    v = aesni_encrypt_block(_mm_xor_si128(b0, v), key);
+	    _mm_storeu_si128((__m128i *)(out + done), v);
+	    done += AES_BLOCK_SIZE;
+	}
+	_mm_storeu_si128((__m128i *)iv, v);
+	return done;
+    }
+
+    while (size - done >= 4 * AES_BLOCK_SIZE) {
+	c0 = _mm_loadu_si128((const __m128i *)(in + done));
+	c1 = _mm_loadu_si128((const __m128i *)(in + done + 16));
+	c2 = _mm_loadu_si128((const __m128i *)(in + done + 32));
+	c3 = _mm_loadu_si128((const __m128i *)(in + done + 48));
+	k = RK(key, 0);
+	b0 = _mm_xor_si128(c0, k);
+	b1 = _mm_xor_si128(c1, k);
+	b2 = _mm_xor_si128(c2, k);
+	b3 = _mm_xor_si128(c3, k);
+	for (i = 1; i < key->rounds; i++) {
+	    k = RK(key, i);
+	    b0 = _mm_aesdec_si128(b0, k);
+	    b1 = _mm_aesdec_si128(b1, k);
+	    b2 = _mm_aesdec_si128(b2, k);
+	    b3 = _mm_aesdec_si128(b3, k);
+	}
+	k = RK(key, key->rounds);
+	b0 = _mm_aesdeclast_si128(b0, k);
+	b1 = _mm_aesdeclast_si128(b1, k);
+	b2 = _mm_aesdeclast_si128(b2, k);
+	b3 = _mm_aesdeclast_si128(b3, k);
+	_mm_storeu_si128((__m128i *)(out + done), _mm_xor_si128(b0, v));
+	_mm_storeu_si128((__m128i *)(out + done + 16), _mm_xor_si128(b1, c0));
+	_mm_storeu_si128((__m128i *)(out + done + 32), _mm_xor_si128(b2, c1));
+	_mm_storeu_si128((__m128i *)(out + done + 48), _mm_xor_si128(b3, c2));
+	v = c3;
+	done += 4 * AES_BLOCK_SIZE;
+    }
+    while (size - done >= AES_BLOCK_SIZE) {
+	c0 = _mm_loadu_si128((const __m128i *)(in + done));
+	b0 = aesni_decrypt_block(c0, key);
+	_mm_storeu_si128((__m128i *)(out + done), _mm_xor_si128(b0, v));
+	v = c0;
+	done += AES_BLOCK_SIZE;
+    }
+    _mm_storeu_si128((__m128i *)iv, v);
+    return done;
+}
+
+#undef RK
+
+#endif /* USE_AESNI */
+
 int
 AES_set_encrypt_key(const unsigned char *userkey, const int bits, AES_KEY *key)
 {
+#ifdef USE_AESNI
+    if (have_aesni())
+	return aesni_set_encrypt_key(userkey, bits, key);
+#endif
     key->rounds = rijndaelKeySetupEnc(key->key, userkey, bits);
     if (key->rounds == 0)
 	return -1;
@@ -53,6 +349,10 @@ AES_set_encrypt_key(const unsigned char *userkey, const int bits, AES_KEY *key)
 int
 AES_set_decrypt_key(const unsigned char *userkey, const int bits, AES_KEY *key)
 {
+#ifdef USE_AESNI
+    if (have_aesni())
+	return aesni_set_decrypt_key(userkey, bits, key);
+#endif
     key->rounds = rijndaelKeySetupDec(key->key, userkey, bits);
     if (key->rounds == 0)
 	return -1;
@@ -62,12 +362,24 @@ AES_set_decrypt_key(const unsigned char *userkey, const int bits, AES_KEY *key)
 void
 AES_encrypt(const unsigned char *in, unsigned char *out, const AES_KEY *key)
 {
+#ifdef USE_AESNI
+    if (have_aesni()) {
+	aesni_encrypt(in, out, key);
+	return;
+    }
+#endif
     rijndaelEncrypt(key->key, key->rounds, in, out);
 }
 
 void
 AES_decrypt(const unsigned char *in, unsigned char *out, const AES_KEY *key)
 {
+#ifdef USE_AESNI
+    if (have_aesni()) {
+	aesni_decrypt(in, out, key);
+	return;
+    }
+#endif
     rijndaelDecrypt(key->key, key->rounds, in, out);
 }
 
@@ -79,6 +391,17 @@ AES_cbc_encrypt(const unsigned char *in, unsigned char *out,
     unsigned char tmp[AES_BLOCK_SIZE];
     int i;
 
+#ifdef USE_AESNI
+    if (have_aesni()) {
+	unsigned long done;
+
+	done = aesni_cbc_encrypt(in, out, size, key, iv, forward_encrypt);
+	in += done;
+	out += done;
+	size -= done;
+    }
+#endif
+
     if (forward_encrypt) {
 	while (size >= AES_BLOCK_SIZE) {
 	    for (i = 0; i < AES_BLOCK_SIZE; i++)
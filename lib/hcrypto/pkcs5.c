@@ -39,7 +39,125 @@
 #endif
 
 #include <evp.h>
+#include <evp-hcrypto.h>
 #include <hmac.h>
+#include <sha.h>
+
+/*
+ * Digests whose state is a plain structure that can be copied by
+ * assignment, so the keyed HMAC inner and outer states can be
+ * computed once and then reused for every iteration.
+ */
+
+union pbkdf2_md_ctx {
+    SHA_CTX sha1;
+    SHA256_CTX sha256;
+    SHA512_CTX sha512;
+};
+
+static int
+pbkdf2_md_is_copyable(const EVP_MD *md)
+{
+    return md == EVP_hcrypto_sha1() ||
+	md == EVP_hcrypto_sha256() ||
+	md == EVP_hcrypto_sha384() ||
+	md == EVP_hcrypto_sha512();
+}
+
+/*
+ * PBKDF2 with the HMAC key schedule precomputed.  Each iteration is
+ * then two digest finalizations of a single block each, instead of
+ * a full HMAC with allocation, key padding and four compressions.
+ */
+
+static int
+pbkdf2_precomputed(const void *password, size_t password_len,
+		   const void *salt, size_t salt_len,
+		   unsigned long iter,
+		   const EVP_MD *md,
+		   size_t keylen, void *key)
+{
+    union pbkdf2_md_ctx ictx, octx, ctx;
+    unsigned char pad[128];
+    unsigned char tk[EVP_MAX_MD_SIZE];
+    unsigned char u[EVP_MAX_MD_SIZE], t[EVP_MAX_MD_SIZE];
+    unsigned char counter[4];
+    size_t hsize, bsize, i, len;
+    unsigned char *p = key;
+    uint32_t keypart = 1;
+    unsigned long n;
+
+    hsize = md->hash_size;
+    bsize = md->block_size;
+
+    if (bsize > sizeof(pad) || hsize > sizeof(u))
+	return 0;
+
+    if (password_len > bsize) {
+	(md->init)((void *)&ctx);
+	(md->update)((void *)&ctx, password, password_len);
+	(md->final)(tk, (void *)&ctx);
+	password = tk;
+	password_len = hsize;
+    }
+
+    memset(pad, 0x36, bsize);
+    for (i = 0; i < password_len; i++)
+	pad[i] ^= ((const unsigned char *)password)[i];
+    (md->init)((void *)&ictx);
+    (md->update)((void *)&ictx, pad, bsize);
+
+    memset(pad, 0x5c, bsize);
+    for (i = 0; i < password_len; i++)
+	pad[i] ^= ((const unsigned char *)password)[i];
+    (md->init)((void *)&octx);
+    (md->update)((void *)&octx, pad, bsize);
+
+    while (keylen) {
+	len = keylen > hsize ? hsize : keylen;
+
+	counter[0] = (keypart >> 24) & 0xff;
+	counter[1] = (keypart >> 16) & 0xff;
+	counter[2] = (keypart >> 8)  & 0xff;
+	counter[3] = (keypart)       & 0xff;
+
+	ctx = ictx;
+	(md->update)((void *)&ctx, salt, salt_len);
+	(md->update)((void *)&ctx, counter, sizeof(counter));
+	(md->final)(u, (void *)&ctx);
+	ctx = octx;
+	(md->update)((void *)&ctx, u, hsize);
+	(md->final)(u, (void *)&ctx);
+
+	memcpy(t, u, hsize);
+	for (n = 1; n < iter; n++) {
+	    ctx = ictx;
+	    (md->update)((void *)&ctx, u, hsize);
+	    (md->final)(u, (void *)&ctx);
+	    ctx = octx;
+	    (md->update)((void *)&ctx, u, hsize);
+	    (md->final)(u, (void *)&ctx);
+
+	    for (i = 0; i < hsize; i++)
+		t[i] ^= u[i];
+	}
+
+	memcpy(p, t, len);
+	p += len;
+	keylen -= len;
+	keypart++;
+    }
+
+    memset_s(&ictx, sizeof(ictx), 0, sizeof(ictx));
+    memset_s(&octx, sizeof(octx), 0, sizeof(octx));
+    memset_s(&ctx, sizeof(ctx), 0, sizeof(ctx));
+    memset_s(pad, sizeof(pad), 0, sizeof(pad));
+    memset_s(tk, sizeof(tk), 0, sizeof(tk));
+    memset_s(u, sizeof(u), 0, sizeof(u));
+    memset_s(t, sizeof(t), 0, sizeof(t));
+
+    return 1;
+}
 
 /**
  * As descriped in PKCS5, convert a password, salt, and iteration counter into a crypto key.
@@ -76,6 +194,10 @@ PKCS5_PBKDF2_HMAC(const void * password, size_t password_len,
     if (md == NULL)
 	return 0;
 
+    if (pbkdf2_md_is_copyable(md))
+	return pbkdf2_precomputed(password, password_len, salt, salt_len,
+				  iter, md, keylen, key);
+
     checksumsize = EVP_MD_size(md);
     datalen = salt_len + 4;
 
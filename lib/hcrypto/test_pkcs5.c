@@ -101,6 +101,71 @@ const struct tests pkcs5_tests[] = {
     }
 };
 
+struct md_tests {
+    const EVP_MD *(*md)(void);
+    const char *password;
+    const char *salt;
+    int iterations;
+    size_t keylen;
+    const void *key;
+};
+
+const struct md_tests pkcs5_md_tests[] = {
+    { EVP_sha256,
+      "password",
+      "salt",
+      1,
+      32,
+      "\x12\x0f\xb6\xcf\xfc\xf8\xb3\x2c\x43\xe7\x22\x52\x56\xc4\xf8\x37"
+      "\xa8\x65\x48\xc9\x2c\xcc\x35\x48\x08\x05\x98\x7c\xb7\x0b\xe1\x7b"
+    },
+    { EVP_sha256,
+      "password",
+      "salt",
+      4096,
+      32,
+      "\xc5\xe4\x78\xd5\x92\x88\xc8\x41\xaa\x53\x0d\xb6\x84\x5c\x4c\x8d"
+      "\x96\x28\x93\xa0\x01\xce\x4e\x11\xa4\x96\x38\x73\xaa\x98\x13\x4a"
+    },
+    { EVP_sha256,
+      "passwordPASSWORDpassword",
+      "saltSALTsaltSALTsaltSALTsaltSALTsalt",
+      4096,
+      40,
+      "\x34\x8c\x89\xdb\xcb\xd3\x2b\x2f\x32\xd8\x14\xb8\x11\x6e\x84\xcf"
+      "\x2b\x17\x34\x7e\xbc\x18\x00\x18\x1c\x4e\x2a\x1f\xb8\xdd\x53\xe1"
+      "\xc6\x35\x51\x8c\x7d\xac\x47\xe9"
+    },
+    { EVP_sha384,
+      "password",
+      "salt",
+      1,
+      48,
+      "\xc0\xe1\x4f\x06\xe4\x9e\x32\xd7\x3f\x9f\x52\xdd\xf1\xd0\xc5\xc7"
+      "\x19\x16\x09\x23\x36\x31\xda\xdd\x76\xa5\x67\xdb\x42\xb7\x86\x76"
+      "\xb3\x8f\xc8\x00\xcc\x53\xdd\xb6\x42\xf5\xc7\x44\x42\xe6\x2b\xe4"
+    },
+    { EVP_sha384,
+      "password",
+      "salt",
+      4096,
+      64,
+      "\x55\x97\x26\xbe\x38\xdb\x12\x5b\xc8\x5e\xd7\x89\x5f\x6e\x3c\xf5"
+      "\x74\xc7\xa0\x1c\x08\x0c\x34\x47\xdb\x1e\x8a\x76\x76\x4d\xeb\x3c"
+      "\x30\x7b\x94\x85\x3f\xbe\x42\x4f\x64\x88\xc5\xf4\xf1\x28\x96\x26"
+      "\x1d\x1e\xb4\x30\x35\x3c\x76\x9e\xe2\xa7\x7a\x26\xfd\x0a\x23\x47"
+    },
+    { EVP_sha384,
+      "XXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXX",
+      "pass phrase exceeds block size",
+      1200,
+      48,
+      "\xfe\xe3\xe1\x84\xc9\x25\x3e\x10\x47\xc8\x7d\x53\xc6\xa5\xe3\x77"
+      "\x29\x41\x76\xbd\x4b\xe3\x9b\xac\x05\x6c\x11\xdd\x17\xc5\x93\x80"
+      "\x53\xbf\x1a\x01\xb7\x0c\xd0\x7f\x9e\x80\xab\x01\x7a\x37\x95\x4c"
+    }
+};
+
 static int
 test_pkcs5_pbe2(const struct tests *t)
 {
@@ -134,6 +199,28 @@ test_pkcs5_pbe2(const struct tests *t)
     return error;
 }
 
+static int
+test_pkcs5_md(const struct md_tests *t)
+{
+    unsigned char key[64];
+    int ret;
+
+    ret = PKCS5_PBKDF2_HMAC(t->password, strlen(t->password),
+			    t->salt, strlen(t->salt),
+			    t->iterations, (t->md)(),
+			    t->keylen, key);
+    if (ret != 1)
+	errx(1, "PKCS5_PBKDF2_HMAC: %d", ret);
+
+    if (memcmp(t->key, key, t->keylen) != 0) {
+	printf("incorrect %d byte key for %s/%s/%d\n", (int)t->keylen,
+	       t->password, t->salt, t->iterations);
+	return 1;
+    }
+
+    return 0;
+}
+
 int
 main(int argc, char **argv)
 {
@@ -142,6 +229,8 @@ main(int argc, char **argv)
 
     for (i = 0; i < sizeof(pkcs5_tests)/sizeof(pkcs5_tests[0]); i++)
 	ret += test_pkcs5_pbe2(&pkcs5_tests[i]);
+    for (i = 0; i < sizeof(pkcs5_md_tests)/sizeof(pkcs5_md_tests[0]); i++)
+	ret += test_pkcs5_md(&pkcs5_md_tests[i]);
 
     return ret;
 }
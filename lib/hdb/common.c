@@ -52,6 +52,40 @@ hdb_principal2key(krb5_context context, krb5_const_principal p, krb5_data *key)
     return ret;
 }
 
+/*
+ * Like hdb_principal2key(), but encode into `buf' when the key fits,
+ * saving a copy of the principal and an allocation.  If *allocated is
+ * set on return the key is on the heap and must be freed with
+ * krb5_data_free().
+ */
+
+krb5_error_code
+_hdb_principal2key_buf(krb5_context context, krb5_const_principal p,
+		       unsigned char *buf, size_t buflen,
+		       krb5_data *key, int *allocated)
+{
+    Principal tmp = *p;
+    size_t len, size = 0;
+    int ret;
+
+    *allocated = 0;
+    tmp.name.name_type = 0;
+
+    len = length_Principal(&tmp);
+    if (len > buflen) {
+	*allocated = 1;
+	return hdb_principal2key(context, p, key);
+    }
+    ret = encode_Principal(buf + buflen - 1, buflen, &tmp, &size);
+    if (ret)
+	return ret;
+    if (size != len)
+	krb5_abortx(context, "internal asn.1 encoder error");
+    key->data = buf + buflen - len;
+    key->length = len;
+    return 0;
+}
+
 int
 hdb_key2principal(krb5_context context, krb5_data *key, krb5_principal p)
 {
@@ -103,8 +137,10 @@ _hdb_fetch_kvno(krb5_context context, HDB *db, krb5_const_principal principal,
 		unsigned flags, krb5_kvno kvno, hdb_entry_ex *entry)
 {
     krb5_principal enterprise_principal = NULL;
+    unsigned char buf[256];
     krb5_data key, value;
     krb5_error_code ret;
+    int allocated;
 
     if (principal->name.name_type == KRB5_NT_ENTERPRISE_PRINCIPAL) {
 	if (principal->name.name_string.len != 1) {
@@ -121,11 +157,15 @@ _hdb_fetch_kvno(krb5_context context, HDB *db, krb5_const_principal principal,
 	principal = enterprise_principal;
     }
 
-    hdb_principal2key(context, principal, &key);
+    ret = _hdb_principal2key_buf(context, principal, buf, sizeof(buf),
+				 &key, &allocated);
     if (enterprise_principal)
 	krb5_free_principal(context, enterprise_principal);
+    if (ret)
+	return ret;
     ret = db->hdb__get(context, db, key, &value);
-    krb5_data_free(&key);
+    if (allocated)
+	krb5_data_free(&key);
     if(ret)
 	return ret;
     ret = hdb_value2entry(context, &value, &entry->entry);
@@ -140,12 +180,16 @@ _hdb_fetch_kvno(krb5_context context, HDB *db, krb5_const_principal principal,
 	    krb5_data_free(&value);
 	    return ret;
 	}
-	hdb_principal2key(context, alias.principal, &key);
+	ret = _hdb_principal2key_buf(context, alias.principal, buf,
+				     sizeof(buf), &key, &allocated);
 	krb5_data_free(&value);
 	free_hdb_entry_alias(&alias);
+	if (ret)
+	    return ret;
 
 	ret = db->hdb__get(context, db, key, &value);
-	krb5_data_free(&key);
+	if (allocated)
+	    krb5_data_free(&key);
 	if (ret)
 	    return ret;
 	ret = hdb_value2entry(context, &value, &entry->entry);
@@ -155,6 +199,33 @@ _hdb_fetch_kvno(krb5_context context, HDB *db, krb5_const_principal principal,
 	}
     }
     krb5_data_free(&value);
+
+    return _hdb_unseal_fetched_keys(context, db, flags, kvno, entry);
+}
+
+/*
+ * Decrypt the keys of a freshly fetched entry as asked for by the
+ * HDB_F_DECRYPT, HDB_F_ALL_KVNOS, HDB_F_KVNO_SPECIFIED and
+ * HDB_F_LAZY_UNSEAL flags.  The entry is freed on failure.
+ */
+
+krb5_error_code
+_hdb_unseal_fetched_keys(krb5_context context, HDB *db, unsigned flags,
+			 krb5_kvno kvno, hdb_entry_ex *entry)
+{
+    krb5_error_code ret;
+
+    /*
+     * Leave the keys sealed for hdb_entry_unseal_key(), unless a
+     * key set from the history has to be swapped in below.
+     */
+    if ((flags & HDB_F_DECRYPT) && (flags & HDB_F_LAZY_UNSEAL) &&
+	((flags & (HDB_F_KVNO_SPECIFIED|HDB_F_ALL_KVNOS)) != HDB_F_KVNO_SPECIFIED ||
+	 kvno == entry->entry.kvno)) {
+	entry->db = db;
+	return 0;
+    }
+
     if ((flags & HDB_F_DECRYPT) && (flags & HDB_F_ALL_KVNOS)) {
 	/* Decrypt the current keys */
 	ret = hdb_unseal_keys(context, db, &entry->entry);
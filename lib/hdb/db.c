@@ -365,7 +365,8 @@ hdb_db1_create(krb5_context context, HDB **db,
     }
     (*db)->hdb_master_key_set = 0;
     (*db)->hdb_openp = 0;
-    (*db)->hdb_capability_flags = HDB_CAP_F_HANDLE_ENTERPRISE_PRINCIPAL;
+    (*db)->hdb_capability_flags =
+	HDB_CAP_F_HANDLE_ENTERPRISE_PRINCIPAL | HDB_CAP_F_EXACT_LOOKUP;
     (*db)->hdb_open = DB_open;
     (*db)->hdb_close = DB_close;
     (*db)->hdb_fetch_kvno = _hdb_fetch_kvno;
@@ -1717,6 +1717,161 @@ LDAP_fetch_kvno(krb5_context context, HDB * db, krb5_const_principal principal,
     return ret;
 }
 
+/*
+ * Look up several principals with one search, OR-ing their
+ * krb5PrincipalName filters together.  Directory entries are matched
+ * back to the requests by name.  Requests in a default realm the
+ * search does not answer are retried one by one, so that the Samba
+ * account fallback of LDAP__lookup_princ() still applies to them.
+ */
+
+#define LDAP_FETCH_MANY_MAX 64	/* principals per search */
+
+static int
+LDAP_default_realm_p(krb5_context context, krb5_const_principal princ)
+{
+    krb5_realm *r, *r0;
+    int found = 0;
+
+    if (krb5_get_default_realms(context, &r0))
+	return 1;
+    for (r = r0; *r != NULL && !found; r++)
+	found = strcmp(krb5_principal_get_realm(context, princ), *r) == 0;
+    krb5_free_host_realm(context, r0);
+    return found;
+}
+
+static krb5_error_code
+LDAP_fetch_chunk(krb5_context context, HDB * db, size_t n,
+		 hdb_fetch_request *reqs)
+{
+    LDAPMessage *msg = NULL, *e;
+    struct berval **vals;
+    char *names[LDAP_FETCH_MANY_MAX];
+    char *filter = NULL, *quote, *tmp;
+    krb5_error_code ret;
+    size_t i, k;
+    int rc;
+
+    for (i = 0; i < n; i++) {
+	names[i] = NULL;
+	reqs[i].ret = HDB_ERR_NOENTRY;
+    }
+
+    filter = strdup("(&(objectClass=krb5Principal)(|");
+    if (filter == NULL) {
+	ret = ENOMEM;
+	goto out;
+    }
+    for (i = 0; i < n; i++) {
+	ret = krb5_unparse_name(context, reqs[i].principal, &names[i]);
+	if (ret)
+	    goto out;
+	ret = escape_value(context, names[i], &quote);
+	if (ret)
+	    goto out;
+	rc = asprintf(&tmp, "%s(krb5PrincipalName=%s)", filter, quote);
+	free(quote);
+	if (rc < 0) {
+	    ret = ENOMEM;
+	    goto out;
+	}
+	free(filter);
+	filter = tmp;
+    }
+    rc = asprintf(&tmp, "%s))", filter);
+    if (rc < 0) {
+	ret = ENOMEM;
+	goto out;
+    }
+    free(filter);
+    filter = tmp;
+
+    ret = LDAP__connect(context, db);
+    if (ret)
+	goto out;
+    ret = LDAP_no_size_limit(context, HDB2LDAP(db));
+    if (ret)
+	goto out;
+
+    rc = ldap_search_ext_s(HDB2LDAP(db), HDB2BASE(db),
+			   LDAP_SCOPE_SUBTREE, filter,
+			   krb5kdcentry_attrs, 0,
+			   NULL, NULL, NULL,
+			   0, &msg);
+    if (check_ldap(context, db, rc)) {
+	ret = HDB_ERR_NOENTRY;
+	krb5_set_error_message(context, ret, "ldap_search_ext_s: "
+			       "filter: %s - error: %s",
+			       filter, ldap_err2string(rc));
+	goto out;
+    }
+
+    for (e = ldap_first_entry(HDB2LDAP(db), msg); e != NULL;
+	 e = ldap_next_entry(HDB2LDAP(db), e)) {
+	vals = ldap_get_values_len(HDB2LDAP(db), e, "krb5PrincipalName");
+	if (vals == NULL)
+	    continue;
+	/* Several requests may be for the same principal */
+	for (i = 0; i < n; i++) {
+	    if (names[i] == NULL)
+		continue;
+	    for (k = 0; vals[k] != NULL; k++) {
+		if (vals[k]->bv_len == strlen(names[i]) &&
+		    memcmp(vals[k]->bv_val, names[i], vals[k]->bv_len) == 0)
+		    break;
+	    }
+	    if (vals[k] == NULL)
+		continue;
+	    reqs[i].ret = LDAP_message2entry(context, db, e, reqs[i].flags,
+					     reqs[i].entry);
+	    if (reqs[i].ret == 0 && db->hdb_master_key_set &&
+		(reqs[i].flags & HDB_F_DECRYPT)) {
+		reqs[i].ret = hdb_unseal_keys(context, db,
+					      &reqs[i].entry->entry);
+		if (reqs[i].ret)
+		    hdb_free_entry(context, reqs[i].entry);
+	    }
+	    free(names[i]);
+	    names[i] = NULL;
+	}
+	ldap_value_free_len(vals);
+    }
+    ret = 0;
+
+  out:
+    if (ret == ENOMEM)
+	krb5_set_error_message(context, ret, "malloc: out of memory");
+    if (msg)
+	ldap_msgfree(msg);
+    free(filter);
+    for (i = 0; i < n; i++) {
+	if (names[i] == NULL)
+	    continue;
+	free(names[i]);
+	if (ret)
+	    reqs[i].ret = ret;
+	else if (LDAP_default_realm_p(context, reqs[i].principal))
+	    reqs[i].ret = LDAP_fetch_kvno(context, db, reqs[i].principal,
+					  reqs[i].flags, reqs[i].kvno,
+					  reqs[i].entry);
+    }
+    return ret;
+}
+
+static krb5_error_code
+LDAP_fetch_many(krb5_context context, HDB * db, size_t n,
+		hdb_fetch_request *reqs)
+{
+    size_t m;
+
+    for (; n > 0; n -= m, reqs += m) {
+	m = n < LDAP_FETCH_MANY_MAX ? n : LDAP_FETCH_MANY_MAX;
+	(void) LDAP_fetch_chunk(context, db, m, reqs);
+    }
+    return 0;
+}
+
 #if 0
 static krb5_error_code
 LDAP_fetch(krb5_context context, HDB * db, krb5_const_principal principal,
@@ -2020,6 +2175,7 @@ hdb_ldap_common(krb5_context context,
     (*db)->hdb_open = LDAP_open;
     (*db)->hdb_close = LDAP_close;
     (*db)->hdb_fetch_kvno = LDAP_fetch_kvno;
+    (*db)->hdb_fetch_many = LDAP_fetch_many;
     (*db)->hdb_store = LDAP_store;
     (*db)->hdb_remove = LDAP_remove;
     (*db)->hdb_firstkey = LDAP_firstkey;
@@ -47,6 +47,9 @@ typedef struct mdb_info {
     MDB_txn *t;
     MDB_dbi d;
     MDB_cursor *c;
+    MDB_txn *rt;		/* reset between lookups, see read_txn() */
+    dev_t dev;
+    ino_t ino;
 } mdb_info;
 
 static krb5_error_code
@@ -56,13 +59,76 @@ DB_close(krb5_context context, HDB *db)
 
     mdb_cursor_close(mi->c);
     mdb_txn_abort(mi->t);
+    if (mi->rt)
+	mdb_txn_abort(mi->rt);
     mdb_env_close(mi->e);
     mi->c = 0;
     mi->t = 0;
+    mi->rt = 0;
     mi->e = 0;
     return 0;
 }
 
+/*
+ * Lookups share one read-only transaction that is reset when done and
+ * renewed for the next lookup, which keeps its reader slot instead of
+ * allocating a transaction each time.  Values returned by mdb_get()
+ * point into the map and are only valid until read_txn_done().
+ */
+static int
+read_txn(mdb_info *mi)
+{
+    int code;
+
+    if (mi->rt) {
+	code = mdb_txn_renew(mi->rt);
+	if (code == 0)
+	    return 0;
+	mdb_txn_abort(mi->rt);
+	mi->rt = 0;
+    }
+    code = mdb_txn_begin(mi->e, NULL, MDB_RDONLY, &mi->rt);
+    if (code == MDB_MAP_RESIZED) {
+	/* another process grew the map, adopt its size and retry */
+	code = mdb_env_set_mapsize(mi->e, 0);
+	if (code == 0)
+	    code = mdb_txn_begin(mi->e, NULL, MDB_RDONLY, &mi->rt);
+    }
+    if (code)
+	mi->rt = 0;
+    return code;
+}
+
+static void
+read_txn_done(mdb_info *mi)
+{
+    mdb_txn_reset(mi->rt);
+}
+
+/*
+ * LMDB readers always see the latest committed transaction, so an open
+ * environment only goes stale when the file itself is replaced.
+ */
+static krb5_error_code
+DB_check_changed(krb5_context context, HDB *db)
+{
+    mdb_info *mi = (mdb_info *)db->hdb_db;
+    struct stat st;
+    char *fn;
+    int ret;
+
+    if (mi->e == NULL)
+	return HDB_ERR_DB_CHANGED;
+
+    if (asprintf(&fn, "%s.mdb", db->hdb_name) == -1)
+	return krb5_enomem(context);
+    ret = stat(fn, &st);
+    free(fn);
+    if (ret == -1 || st.st_dev != mi->dev || st.st_ino != mi->ino)
+	return HDB_ERR_DB_CHANGED;
+    return 0;
+}
+
 static krb5_error_code
 DB_destroy(krb5_context context, HDB *db)
 {
@@ -206,26 +272,147 @@ static krb5_error_code
 DB__get(krb5_context context, HDB *db, krb5_data key, krb5_data *reply)
 {
     mdb_info *mi = (mdb_info*)db->hdb_db;
-    MDB_txn *txn;
     MDB_val k, v;
     int code;
 
     k.mv_data = key.data;
     k.mv_size = key.length;
 
-    code = mdb_txn_begin(mi->e, NULL, MDB_RDONLY, &txn);
+    code = read_txn(mi);
     if (code)
 	return code;
 
-    code = mdb_get(txn, mi->d, &k, &v);
+    code = mdb_get(mi->rt, mi->d, &k, &v);
     if (code == 0)
-	krb5_data_copy(reply, v.mv_data, v.mv_size);
-    mdb_txn_abort(txn);
+	code = krb5_data_copy(reply, v.mv_data, v.mv_size);
+    read_txn_done(mi);
     if(code == MDB_NOTFOUND)
 	return HDB_ERR_NOENTRY;
     return code;
 }
 
+/*
+ * Look up `key' and decode the entry straight from the map, without
+ * copying the value first.
+ */
+static krb5_error_code
+get_entry(krb5_context context, mdb_info *mi, krb5_data *key,
+	  unsigned flags, hdb_entry *entry)
+{
+    unsigned char buf[256];
+    hdb_entry_alias alias;
+    krb5_data akey;
+    MDB_val k, v;
+    int allocated, code;
+
+    k.mv_data = key->data;
+    k.mv_size = key->length;
+    code = mdb_get(mi->rt, mi->d, &k, &v);
+    if (code)
+	return code;
+    code = decode_hdb_entry(v.mv_data, v.mv_size, entry, NULL);
+    if (code != ASN1_BAD_ID)
+	return code;
+    if ((flags & HDB_F_CANON) == 0)
+	return HDB_ERR_NOENTRY;
+
+    code = decode_hdb_entry_alias(v.mv_data, v.mv_size, &alias, NULL);
+    if (code)
+	return code;
+    code = _hdb_principal2key_buf(context, alias.principal, buf, sizeof(buf),
+				  &akey, &allocated);
+    free_hdb_entry_alias(&alias);
+    if (code)
+	return code;
+
+    k.mv_data = akey.data;
+    k.mv_size = akey.length;
+    code = mdb_get(mi->rt, mi->d, &k, &v);
+    if (allocated)
+	krb5_data_free(&akey);
+    if (code)
+	return code;
+    return decode_hdb_entry(v.mv_data, v.mv_size, entry, NULL);
+}
+
+/* Fetch an entry; the caller has started the read transaction */
+static krb5_error_code
+fetch_txn(krb5_context context, HDB *db, krb5_const_principal principal,
+	  unsigned flags, krb5_kvno kvno, hdb_entry_ex *entry)
+{
+    mdb_info *mi = (mdb_info*)db->hdb_db;
+    krb5_principal enterprise_principal = NULL;
+    unsigned char buf[256];
+    krb5_data key;
+    int allocated;
+    krb5_error_code code;
+
+    if (principal->name.name_type == KRB5_NT_ENTERPRISE_PRINCIPAL) {
+	if (principal->name.name_string.len != 1) {
+	    code = KRB5_PARSE_MALFORMED;
+	    krb5_set_error_message(context, code, "malformed principal: "
+				   "enterprise name with %d name components",
+				   principal->name.name_string.len);
+	    return code;
+	}
+	code = krb5_parse_name(context, principal->name.name_string.val[0],
+			       &enterprise_principal);
+	if (code)
+	    return code;
+	principal = enterprise_principal;
+    }
+
+    code = _hdb_principal2key_buf(context, principal, buf, sizeof(buf),
+				  &key, &allocated);
+    krb5_free_principal(context, enterprise_principal);
+    if (code)
+	return code;
+
+    code = get_entry(context, mi, &key, flags, &entry->entry);
+    if (allocated)
+	krb5_data_free(&key);
+    if (code == MDB_NOTFOUND)
+	return HDB_ERR_NOENTRY;
+    if (code)
+	return code;
+
+    return _hdb_unseal_fetched_keys(context, db, flags, kvno, entry);
+}
+
+static krb5_error_code
+DB_fetch_kvno(krb5_context context, HDB *db, krb5_const_principal principal,
+	      unsigned flags, krb5_kvno kvno, hdb_entry_ex *entry)
+{
+    mdb_info *mi = (mdb_info*)db->hdb_db;
+    krb5_error_code code;
+
+    code = read_txn(mi);
+    if (code)
+	return code;
+    code = fetch_txn(context, db, principal, flags, kvno, entry);
+    read_txn_done(mi);
+    return code;
+}
+
+/* All lookups are done in one read transaction */
+static krb5_error_code
+DB_fetch_many(krb5_context context, HDB *db, size_t n,
+	      hdb_fetch_request *reqs)
+{
+    mdb_info *mi = (mdb_info*)db->hdb_db;
+    krb5_error_code code;
+    size_t i;
+
+    code = read_txn(mi);
+    if (code)
+	return code;
+    for (i = 0; i < n; i++)
+	reqs[i].ret = fetch_txn(context, db, reqs[i].principal,
+				reqs[i].flags, reqs[i].kvno, reqs[i].entry);
+    read_txn_done(mi);
+    return 0;
+}
+
 static krb5_error_code
 DB__put(krb5_context context, HDB *db, int replace,
 	krb5_data key, krb5_data value)
@@ -292,9 +479,15 @@ DB_open(krb5_context context, HDB *db, int flags, mode_t mode)
 {
     mdb_info *mi = (mdb_info *)db->hdb_db;
     MDB_txn *txn;
+    struct stat st;
     char *fn;
     krb5_error_code ret;
-    int myflags = MDB_NOSUBDIR, tmp;
+    /*
+     * MDB_NOTLS ties reader slots to transactions rather than threads,
+     * so the lookup transaction kept by read_txn() can coexist with the
+     * one DB_firstkey() opens for iteration.
+     */
+    int myflags = MDB_NOSUBDIR | MDB_NOTLS, tmp, fd;
 
     if((flags & O_ACCMODE) == O_RDONLY)
       myflags |= MDB_RDONLY;
@@ -343,6 +536,17 @@ fail:
 	return ret;
     }
 
+    /* Remember which file we opened for DB_check_changed() */
+    ret = mdb_env_get_fd(mi->e, &fd);
+    if (ret)
+	goto fail;
+    if (fstat(fd, &st) == -1) {
+	ret = errno;
+	goto fail;
+    }
+    mi->dev = st.st_dev;
+    mi->ino = st.st_ino;
+
     ret = mdb_txn_begin(mi->e, NULL, MDB_RDONLY, &txn);
     if (ret)
 	goto fail;
@@ -396,10 +600,16 @@ hdb_mdb_create(krb5_context context, HDB **db,
     }
     (*db)->hdb_master_key_set = 0;
     (*db)->hdb_openp = 0;
-    (*db)->hdb_capability_flags = HDB_CAP_F_HANDLE_ENTERPRISE_PRINCIPAL;
+    /*
+     * A process must not open an LMDB environment twice: closing one
+     * of the handles drops the POSIX locks held through the others.
+     */
+    (*db)->hdb_capability_flags =
+	HDB_CAP_F_HANDLE_ENTERPRISE_PRINCIPAL | HDB_CAP_F_EXACT_LOOKUP |
+	HDB_CAP_F_ONE_HANDLE;
     (*db)->hdb_open  = DB_open;
     (*db)->hdb_close = DB_close;
-    (*db)->hdb_fetch_kvno = _hdb_fetch_kvno;
+    (*db)->hdb_fetch_kvno = DB_fetch_kvno;
     (*db)->hdb_store = _hdb_store;
     (*db)->hdb_remove = _hdb_remove;
     (*db)->hdb_firstkey = DB_firstkey;
@@ -412,6 +622,8 @@ hdb_mdb_create(krb5_context context, HDB **db,
     (*db)->hdb__del = DB__del;
     (*db)->hdb_destroy = DB_destroy;
     (*db)->hdb_set_sync = DB_set_sync;
+    (*db)->hdb_check_changed = DB_check_changed;
+    (*db)->hdb_fetch_many = DB_fetch_many;
     return 0;
 }
 #endif /* HAVE_LMDB */
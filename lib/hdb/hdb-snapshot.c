@@ -0,0 +1,911 @@
+/*
+ * Copyright (c) 2026 Kungliga Tekniska Högskolan
+ * (Royal Institute of Technology, Stockholm, Sweden).
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the Institute nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE INSTITUTE AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE INSTITUTE OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Read-only, in-memory snapshot of another database:
+ *
+ *	dbname = snapshot:mdb:/var/heimdal/heimdal
+ *
+ * The source database is read once into an open addressing hash table
+ * of decoded entries, keyed by the database key of each principal and
+ * alias, and lookups copy the entry out of the table without touching
+ * the source.  Keys are kept as stored in the source, sealed with the
+ * master key of this database.
+ *
+ * At most every hdb-snapshot-check-interval a lookup stat()s the
+ * source files.  When they changed, for example because ipropd-slave
+ * applied an update, a new snapshot is built (in a separate thread
+ * when we have threads) and swapped in once complete; until then
+ * lookups are answered from the old one.  Snapshots are shared by all
+ * handles on the same source in the process.
+ */
+
+#include "hdb_locl.h"
+#include <heim_threads.h>
+
+#define SNAPSHOT_MIN_SLOTS	16
+
+struct snap_slot {
+    uint64_t hash;		/* 0 for an empty slot */
+    uint32_t key_off;		/* database key, in keys[] */
+    uint32_t key_len;
+    uint32_t ent;		/* index into ents[] */
+    uint32_t alias;		/* key is an alias of the entry */
+};
+
+struct snapshot {
+    unsigned int refs;
+    size_t num_ents;
+    hdb_entry *ents;
+    size_t mask;
+    struct snap_slot *slots;
+    unsigned char *keys;
+};
+
+struct snap_file {
+    char *path;
+    int exists;
+    dev_t dev;
+    ino_t ino;
+    off_t size;
+    time_t mtime;
+    long mtime_nsec;
+};
+
+#define SNAPSHOT_NUM_FILES	3
+
+struct snap_source {
+    struct snap_source *next;
+    unsigned int refs;
+    char *name;			/* the source database */
+    HEIMDAL_MUTEX load_mutex;	/* held while loading the first snapshot */
+    struct snapshot *current;
+    int building;
+    time_t last_check;
+    struct snap_file files[SNAPSHOT_NUM_FILES];
+};
+
+struct snap_handle {
+    struct snap_source *src;
+    struct snapshot *snap;
+    time_t interval;
+    time_t next_check;
+    size_t cursor;
+};
+
+static HEIMDAL_MUTEX snap_mutex = HEIMDAL_MUTEX_INITIALIZER;
+static struct snap_source *snap_sources;
+
+static uint64_t
+key_hash(const unsigned char *p, size_t len)
+{
+    uint64_t h = 0xcbf29ce484222325ULL;
+
+    while (len--) {
+	h ^= *p++;
+	h *= 0x100000001b3ULL;
+    }
+    return h ? h : 1;
+}
+
+static void
+snapshot_free(struct snapshot *s)
+{
+    size_t i, k;
+
+    if (s == NULL)
+	return;
+    for (i = 0; i < s->num_ents; i++) {
+	for (k = 0; k < s->ents[i].keys.len; k++) {
+	    Key *key = &s->ents[i].keys.val[k];
+	    memset(key->key.keyvalue.data, 0, key->key.keyvalue.length);
+	}
+	free_hdb_entry(&s->ents[i]);
+    }
+    free(s->ents);
+    free(s->slots);
+    free(s->keys);
+    free(s);
+}
+
+/* Drop a reference; returns `s' if the caller should free it */
+static struct snapshot *
+snapshot_unref_locked(struct snapshot *s)
+{
+    if (s == NULL || --s->refs > 0)
+	return NULL;
+    return s;
+}
+
+static const struct snap_slot *
+snapshot_lookup(const struct snapshot *s, const krb5_data *key)
+{
+    uint64_t hash = key_hash(key->data, key->length);
+    const struct snap_slot *slot;
+    size_t i;
+
+    for (i = hash & s->mask; s->slots[i].hash != 0; i = (i + 1) & s->mask) {
+	slot = &s->slots[i];
+	if (slot->hash == hash && slot->key_len == key->length &&
+	    memcmp(s->keys + slot->key_off, key->data, key->length) == 0)
+	    return slot;
+    }
+    return NULL;
+}
+
+/*
+ * Building a snapshot: the entries and their keys are collected in
+ * growing arrays and hashed into a table of twice as many slots at the
+ * end.
+ */
+
+struct snap_build {
+    struct snapshot *s;
+    size_t ents_alloc;
+    struct snap_slot *keys;
+    size_t num_keys;
+    size_t keys_alloc;
+    size_t arena_len;
+    size_t arena_alloc;
+};
+
+static krb5_error_code
+build_add_key(krb5_context context, struct snap_build *b,
+	      krb5_const_principal principal, uint32_t ent, uint32_t alias)
+{
+    struct snap_slot *slot;
+    krb5_data key;
+    krb5_error_code ret;
+
+    ret = hdb_principal2key(context, principal, &key);
+    if (ret)
+	return ret;
+
+    if (b->arena_len + key.length > UINT32_MAX) {
+	krb5_data_free(&key);
+	krb5_set_error_message(context, ERANGE, "database too large "
+			       "for a snapshot");
+	return ERANGE;
+    }
+    if (b->arena_len + key.length > b->arena_alloc) {
+	size_t n = b->arena_alloc ? b->arena_alloc * 2 : 4096;
+	unsigned char *p;
+
+	while (n < b->arena_len + key.length)
+	    n *= 2;
+	p = realloc(b->s->keys, n);
+	if (p == NULL) {
+	    krb5_data_free(&key);
+	    return krb5_enomem(context);
+	}
+	b->s->keys = p;
+	b->arena_alloc = n;
+    }
+    if (b->num_keys == b->keys_alloc) {
+	size_t n = b->keys_alloc ? b->keys_alloc * 2 : 256;
+
+	slot = realloc(b->keys, n * sizeof(b->keys[0]));
+	if (slot == NULL) {
+	    krb5_data_free(&key);
+	    return krb5_enomem(context);
+	}
+	b->keys = slot;
+	b->keys_alloc = n;
+    }
+
+    slot = &b->keys[b->num_keys++];
+    slot->hash = key_hash(key.data, key.length);
+    slot->key_off = b->arena_len;
+    slot->key_len = key.length;
+    slot->ent = ent;
+    slot->alias = alias;
+    memcpy(b->s->keys + b->arena_len, key.data, key.length);
+    b->arena_len += key.length;
+    krb5_data_free(&key);
+    return 0;
+}
+
+static krb5_error_code
+build_add_entry(krb5_context context, struct snap_build *b, hdb_entry_ex *ent)
+{
+    struct snapshot *s = b->s;
+    const HDB_Ext_Aliases *aliases;
+    krb5_error_code ret;
+    hdb_entry *e;
+    size_t i;
+
+    if (ent->entry.principal == NULL)
+	return 0;
+
+    if (s->num_ents == b->ents_alloc) {
+	size_t n = b->ents_alloc ? b->ents_alloc * 2 : 256;
+
+	e = realloc(s->ents, n * sizeof(s->ents[0]));
+	if (e == NULL)
+	    return krb5_enomem(context);
+	s->ents = e;
+	b->ents_alloc = n;
+    }
+    if (s->num_ents >= UINT32_MAX)
+	return ERANGE;
+
+    /* Take over the decoded entry unless the backend still owns it */
+    e = &s->ents[s->num_ents];
+    if (ent->free_entry == NULL) {
+	*e = ent->entry;
+	memset(&ent->entry, 0, sizeof(ent->entry));
+    } else {
+	ret = copy_hdb_entry(&ent->entry, e);
+	if (ret)
+	    return ret;
+    }
+    s->num_ents++;
+
+    ret = build_add_key(context, b, e->principal, s->num_ents - 1, 0);
+    if (ret)
+	return ret;
+
+    ret = hdb_entry_get_aliases(e, &aliases);
+    for (i = 0; ret == 0 && aliases != NULL && i < aliases->aliases.len; i++)
+	ret = build_add_key(context, b, &aliases->aliases.val[i],
+			    s->num_ents - 1, 1);
+    return ret;
+}
+
+static krb5_error_code
+build_table(krb5_context context, struct snap_build *b)
+{
+    struct snapshot *s = b->s;
+    struct snap_slot *slot;
+    size_t i, j, n = SNAPSHOT_MIN_SLOTS;
+
+    while (n < b->num_keys * 2)
+	n *= 2;
+    s->slots = calloc(n, sizeof(s->slots[0]));
+    if (s->slots == NULL)
+	return krb5_enomem(context);
+    s->mask = n - 1;
+
+    for (i = 0; i < b->num_keys; i++) {
+	slot = &b->keys[i];
+	for (j = slot->hash & s->mask; s->slots[j].hash != 0;
+	     j = (j + 1) & s->mask) {
+	    /* The first of several entries with the same key wins */
+	    if (s->slots[j].hash == slot->hash &&
+		s->slots[j].key_len == slot->key_len &&
+		memcmp(s->keys + s->slots[j].key_off,
+		       s->keys + slot->key_off, slot->key_len) == 0)
+		break;
+	}
+	if (s->slots[j].hash == 0)
+	    s->slots[j] = *slot;
+    }
+    return 0;
+}
+
+static krb5_error_code
+snapshot_build(krb5_context context, const char *name, struct snapshot **out)
+{
+    struct snap_build b;
+    hdb_entry_ex ent;
+    krb5_error_code ret, ret2;
+    HDB *src;
+
+    *out = NULL;
+    memset(&b, 0, sizeof(b));
+
+    b.s = calloc(1, sizeof(*b.s));
+    if (b.s == NULL)
+	return krb5_enomem(context);
+    b.s->refs = 1;
+
+    ret = hdb_create(context, &src, name);
+    if (ret) {
+	free(b.s);
+	return ret;
+    }
+    ret = src->hdb_open(context, src, O_RDONLY, 0);
+    if (ret) {
+	src->hdb_destroy(context, src);
+	free(b.s);
+	return ret;
+    }
+
+    memset(&ent, 0, sizeof(ent));
+    for (ret = src->hdb_firstkey(context, src, 0, &ent);
+	 ret == 0;
+	 ret = src->hdb_nextkey(context, src, 0, &ent)) {
+	ret = build_add_entry(context, &b, &ent);
+	hdb_free_entry(context, &ent);
+	memset(&ent, 0, sizeof(ent));
+	if (ret)
+	    break;
+    }
+    if (ret == HDB_ERR_NOENTRY)
+	ret = 0;
+
+    ret2 = src->hdb_close(context, src);
+    if (ret == 0)
+	ret = ret2;
+    src->hdb_destroy(context, src);
+
+    if (ret == 0)
+	ret = build_table(context, &b);
+    free(b.keys);
+    if (ret) {
+	snapshot_free(b.s);
+	return ret;
+    }
+    *out = b.s;
+    return 0;
+}
+
+/*
+ * Change detection on the files the source database may live in,
+ * under the names the file based backends use.
+ */
+
+static krb5_error_code
+source_add_files(krb5_context context, struct snap_source *s)
+{
+    static const char *suffixes[SNAPSHOT_NUM_FILES] = { "", ".db", ".mdb" };
+    const char *name = s->name, *p, *q;
+    size_t i;
+
+    /* Skip backend prefixes, as in "mdb:/var/heimdal/heimdal" */
+    while ((p = strchr(name, ':')) != NULL &&
+	   ((q = strchr(name, '/')) == NULL || p < q))
+	name = p + 1;
+
+    for (i = 0; i < SNAPSHOT_NUM_FILES; i++) {
+	if (asprintf(&s->files[i].path, "%s%s", name, suffixes[i]) == -1 ||
+	    s->files[i].path == NULL) {
+	    s->files[i].path = NULL;
+	    return krb5_enomem(context);
+	}
+    }
+    return 0;
+}
+
+static int
+source_changed_locked(struct snap_source *s)
+{
+    struct snap_file *f;
+    struct stat st;
+    long nsec;
+    int changed = 0;
+    size_t i;
+
+    for (i = 0; i < SNAPSHOT_NUM_FILES; i++) {
+	f = &s->files[i];
+	if (stat(f->path, &st) == -1) {
+	    if (f->exists)
+		changed = 1;
+	    f->exists = 0;
+	    continue;
+	}
+#ifdef HAVE_STRUCT_STAT_ST_MTIM
+	nsec = st.st_mtim.tv_nsec;
+#else
+	nsec = 0;
+#endif
+	if (!f->exists || f->dev != st.st_dev || f->ino != st.st_ino ||
+	    f->size != st.st_size || f->mtime != st.st_mtime ||
+	    f->mtime_nsec != nsec)
+	    changed = 1;
+	f->exists = 1;
+	f->dev = st.st_dev;
+	f->ino = st.st_ino;
+	f->size = st.st_size;
+	f->mtime = st.st_mtime;
+	f->mtime_nsec = nsec;
+    }
+    return changed;
+}
+
+static void
+source_free(struct snap_source *s)
+{
+    size_t i;
+
+    snapshot_free(s->current);
+    for (i = 0; i < SNAPSHOT_NUM_FILES; i++)
+	free(s->files[i].path);
+    HEIMDAL_MUTEX_destroy(&s->load_mutex);
+    free(s->name);
+    free(s);
+}
+
+/* Drop a reference; returns `s' if the caller should free it */
+static struct snap_source *
+source_unref_locked(struct snap_source *s)
+{
+    struct snap_source **sp;
+
+    if (--s->refs > 0)
+	return NULL;
+    for (sp = &snap_sources; *sp != NULL; sp = &(*sp)->next) {
+	if (*sp == s) {
+	    *sp = s->next;
+	    break;
+	}
+    }
+    if (s->current != NULL && --s->current->refs > 0)
+	s->current = NULL;
+    return s;
+}
+
+static void
+rebuild_done(struct snap_source *s, struct snapshot *snap)
+{
+    struct snapshot *old = NULL;
+    struct snap_source *gone;
+    size_t i;
+
+    HEIMDAL_MUTEX_lock(&snap_mutex);
+    if (snap != NULL) {
+	old = snapshot_unref_locked(s->current);
+	s->current = snap;
+    } else {
+	/* Try again at the next check */
+	for (i = 0; i < SNAPSHOT_NUM_FILES; i++)
+	    s->files[i].exists = 0;
+    }
+    s->building = 0;
+    gone = source_unref_locked(s);
+    HEIMDAL_MUTEX_unlock(&snap_mutex);
+
+    snapshot_free(old);
+    if (gone)
+	source_free(gone);
+}
+
+#ifdef ENABLE_PTHREAD_SUPPORT
+struct rebuild_arg {
+    krb5_context context;
+    struct snap_source *src;
+};
+
+static void *
+rebuild_thread(void *ptr)
+{
+    struct rebuild_arg *a = ptr;
+    struct snapshot *snap;
+
+    if (snapshot_build(a->context, a->src->name, &snap))
+	snap = NULL;
+    rebuild_done(a->src, snap);
+    krb5_free_context(a->context);
+    free(a);
+    return NULL;
+}
+#endif
+
+/*
+ * Build a new snapshot of `s', in a new thread if possible.  The
+ * caller has marked the source as building and holds a reference to it
+ * for us.
+ */
+
+static void
+rebuild(krb5_context context, struct snap_source *s)
+{
+    struct snapshot *snap;
+#ifdef ENABLE_PTHREAD_SUPPORT
+    struct rebuild_arg *a;
+    pthread_attr_t attr;
+    pthread_t thread;
+
+    a = calloc(1, sizeof(*a));
+    if (a != NULL && krb5_copy_context(context, &a->context) == 0) {
+	a->src = s;
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	if (pthread_create(&thread, &attr, rebuild_thread, a) == 0) {
+	    pthread_attr_destroy(&attr);
+	    return;
+	}
+	pthread_attr_destroy(&attr);
+	krb5_free_context(a->context);
+    }
+    free(a);
+#endif
+
+    if (snapshot_build(context, s->name, &snap))
+	snap = NULL;
+    rebuild_done(s, snap);
+}
+
+/*
+ * Pick up the current snapshot of the source, after starting a rebuild
+ * if the source changed.
+ */
+
+static void
+snapshot_refresh(krb5_context context, struct snap_handle *h)
+{
+    struct snap_source *s = h->src;
+    struct snapshot *old = NULL;
+    time_t now = time(NULL);
+    int start = 0;
+
+    h->next_check = now + h->interval;
+
+    HEIMDAL_MUTEX_lock(&snap_mutex);
+    if (!s->building && s->last_check + h->interval <= now) {
+	s->last_check = now;
+	if (source_changed_locked(s)) {
+	    s->building = 1;
+	    s->refs++;
+	    start = 1;
+	}
+    }
+    HEIMDAL_MUTEX_unlock(&snap_mutex);
+
+    if (start)
+	rebuild(context, s);
+
+    HEIMDAL_MUTEX_lock(&snap_mutex);
+    if (h->snap != s->current) {
+	old = snapshot_unref_locked(h->snap);
+	h->snap = s->current;
+	h->snap->refs++;
+    }
+    HEIMDAL_MUTEX_unlock(&snap_mutex);
+
+    snapshot_free(old);
+}
+
+static krb5_error_code
+snap_open(krb5_context context, HDB *db, int flags, mode_t mode)
+{
+    struct snap_handle *h = db->hdb_db;
+    struct snap_source *s = h->src;
+    struct snapshot *snap = NULL;
+    krb5_error_code ret = 0;
+    int load;
+
+    if (h->snap != NULL)
+	return 0;
+
+    /*
+     * The first handle on a source loads it.  Other handles on the
+     * same source wait for it on the source's load lock, the global
+     * lock is not held while the source is read.
+     */
+    HEIMDAL_MUTEX_lock(&s->load_mutex);
+
+    HEIMDAL_MUTEX_lock(&snap_mutex);
+    load = s->current == NULL;
+    if (load) {
+	s->last_check = time(NULL);
+	(void) source_changed_locked(s);
+    }
+    HEIMDAL_MUTEX_unlock(&snap_mutex);
+
+    if (load)
+	ret = snapshot_build(context, s->name, &snap);
+
+    HEIMDAL_MUTEX_lock(&snap_mutex);
+    if (load && ret == 0)
+	s->current = snap;
+    if (ret == 0) {
+	h->snap = s->current;
+	h->snap->refs++;
+    }
+    HEIMDAL_MUTEX_unlock(&snap_mutex);
+
+    HEIMDAL_MUTEX_unlock(&s->load_mutex);
+
+    h->next_check = time(NULL) + h->interval;
+    return ret;
+}
+
+/* The snapshot is kept across close and open, it is not a file */
+static krb5_error_code
+snap_close(krb5_context context, HDB *db)
+{
+    return 0;
+}
+
+static krb5_error_code
+snap_check_changed(krb5_context context, HDB *db)
+{
+    return 0;
+}
+
+static krb5_error_code
+snap_destroy(krb5_context context, HDB *db)
+{
+    struct snap_handle *h = db->hdb_db;
+    struct snapshot *old;
+    struct snap_source *gone;
+    krb5_error_code ret;
+
+    HEIMDAL_MUTEX_lock(&snap_mutex);
+    old = snapshot_unref_locked(h->snap);
+    gone = source_unref_locked(h->src);
+    HEIMDAL_MUTEX_unlock(&snap_mutex);
+
+    snapshot_free(old);
+    if (gone)
+	source_free(gone);
+
+    ret = hdb_clear_master_key(context, db);
+    free(h);
+    free(db->hdb_name);
+    free(db);
+    return ret;
+}
+
+static krb5_error_code
+snap_lock(krb5_context context, HDB *db, int operation)
+{
+    return 0;
+}
+
+static krb5_error_code
+snap_unlock(krb5_context context, HDB *db)
+{
+    return 0;
+}
+
+/* Make sure the handle has a snapshot and that it is current */
+static krb5_error_code
+snap_prepare(krb5_context context, HDB *db)
+{
+    struct snap_handle *h = db->hdb_db;
+    krb5_error_code ret;
+
+    if (h->snap == NULL) {
+	ret = snap_open(context, db, O_RDONLY, 0);
+	if (ret)
+	    return ret;
+    }
+    if (time(NULL) >= h->next_check)
+	snapshot_refresh(context, h);
+    return 0;
+}
+
+static krb5_error_code
+snap_lookup(krb5_context context, HDB *db, krb5_const_principal principal,
+	    unsigned flags, krb5_kvno kvno, hdb_entry_ex *entry)
+{
+    struct snap_handle *h = db->hdb_db;
+    krb5_principal enterprise_principal = NULL;
+    const struct snap_slot *slot;
+    unsigned char buf[256];
+    krb5_error_code ret;
+    krb5_data key;
+    int allocated;
+
+    if (principal->name.name_type == KRB5_NT_ENTERPRISE_PRINCIPAL) {
+	if (principal->name.name_string.len != 1) {
+	    ret = KRB5_PARSE_MALFORMED;
+	    krb5_set_error_message(context, ret, "malformed principal: "
+				   "enterprise name with %d name components",
+				   principal->name.name_string.len);
+	    return ret;
+	}
+	ret = krb5_parse_name(context, principal->name.name_string.val[0],
+			      &enterprise_principal);
+	if (ret)
+	    return ret;
+	principal = enterprise_principal;
+    }
+
+    ret = _hdb_principal2key_buf(context, principal, buf, sizeof(buf),
+				 &key, &allocated);
+    if (enterprise_principal)
+	krb5_free_principal(context, enterprise_principal);
+    if (ret)
+	return ret;
+
+    slot = snapshot_lookup(h->snap, &key);
+    if (allocated)
+	krb5_data_free(&key);
+    if (slot == NULL || (slot->alias && (flags & HDB_F_CANON) == 0))
+	return HDB_ERR_NOENTRY;
+
+    ret = copy_hdb_entry(&h->snap->ents[slot->ent], &entry->entry);
+    if (ret)
+	return ret;
+
+    return _hdb_unseal_fetched_keys(context, db, flags, kvno, entry);
+}
+
+static krb5_error_code
+snap_fetch_kvno(krb5_context context, HDB *db, krb5_const_principal principal,
+		unsigned flags, krb5_kvno kvno, hdb_entry_ex *entry)
+{
+    krb5_error_code ret;
+
+    ret = snap_prepare(context, db);
+    if (ret)
+	return ret;
+    return snap_lookup(context, db, principal, flags, kvno, entry);
+}
+
+/* All lookups are answered from the same snapshot */
+static krb5_error_code
+snap_fetch_many(krb5_context context, HDB *db, size_t n,
+		hdb_fetch_request *reqs)
+{
+    krb5_error_code ret;
+    size_t i;
+
+    ret = snap_prepare(context, db);
+    if (ret)
+	return ret;
+    for (i = 0; i < n; i++)
+	reqs[i].ret = snap_lookup(context, db, reqs[i].principal,
+				  reqs[i].flags, reqs[i].kvno, reqs[i].entry);
+    return 0;
+}
+
+static krb5_error_code
+snap_nextkey(krb5_context context, HDB *db, unsigned flags,
+	     hdb_entry_ex *entry)
+{
+    struct snap_handle *h = db->hdb_db;
+    krb5_error_code ret;
+
+    if (h->snap == NULL || h->cursor >= h->snap->num_ents)
+	return HDB_ERR_NOENTRY;
+
+    memset(entry, 0, sizeof(*entry));
+    ret = copy_hdb_entry(&h->snap->ents[h->cursor++], &entry->entry);
+    if (ret)
+	return ret;
+    if (db->hdb_master_key_set && (flags & HDB_F_DECRYPT)) {
+	ret = hdb_unseal_keys(context, db, &entry->entry);
+	if (ret)
+	    hdb_free_entry(context, entry);
+    }
+    return ret;
+}
+
+static krb5_error_code
+snap_firstkey(krb5_context context, HDB *db, unsigned flags,
+	      hdb_entry_ex *entry)
+{
+    struct snap_handle *h = db->hdb_db;
+
+    h->cursor = 0;
+    return snap_nextkey(context, db, flags, entry);
+}
+
+static krb5_error_code
+snap_store(krb5_context context, HDB *db, unsigned flags,
+	   hdb_entry_ex *entry)
+{
+    return HDB_ERR_NO_WRITE_SUPPORT;
+}
+
+static krb5_error_code
+snap_remove(krb5_context context, HDB *db, unsigned flags,
+	    krb5_const_principal principal)
+{
+    return HDB_ERR_NO_WRITE_SUPPORT;
+}
+
+krb5_error_code
+hdb_snapshot_create(krb5_context context, HDB **db, const char *arg)
+{
+    struct snap_handle *h;
+    struct snap_source *s;
+    krb5_error_code ret;
+
+    if (arg == NULL || arg[0] == '\0') {
+	krb5_set_error_message(context, EINVAL, "snapshot database "
+			       "needs a source database");
+	return EINVAL;
+    }
+
+    *db = calloc(1, sizeof(**db));
+    if (*db == NULL)
+	return krb5_enomem(context);
+    h = calloc(1, sizeof(*h));
+    (*db)->hdb_name = strdup(arg);
+    if (h == NULL || (*db)->hdb_name == NULL) {
+	free(h);
+	free((*db)->hdb_name);
+	free(*db);
+	*db = NULL;
+	return krb5_enomem(context);
+    }
+    h->interval = krb5_config_get_time_default(context, NULL, 5, "kdc",
+					       "hdb-snapshot-check-interval",
+					       NULL);
+
+    HEIMDAL_MUTEX_lock(&snap_mutex);
+    for (s = snap_sources; s != NULL; s = s->next) {
+	if (strcmp(s->name, arg) == 0)
+	    break;
+    }
+    if (s == NULL) {
+	s = calloc(1, sizeof(*s));
+	if (s == NULL) {
+	    ret = krb5_enomem(context);
+	} else {
+	    HEIMDAL_MUTEX_init(&s->load_mutex);
+	    if ((s->name = strdup(arg)) == NULL)
+		ret = krb5_enomem(context);
+	    else
+		ret = source_add_files(context, s);
+	}
+	if (ret) {
+	    HEIMDAL_MUTEX_unlock(&snap_mutex);
+	    if (s)
+		source_free(s);
+	    free(h);
+	    free((*db)->hdb_name);
+	    free(*db);
+	    *db = NULL;
+	    return ret;
+	}
+	s->next = snap_sources;
+	snap_sources = s;
+    }
+    s->refs++;
+    h->src = s;
+    HEIMDAL_MUTEX_unlock(&snap_mutex);
+
+    (*db)->hdb_db = h;
+    (*db)->hdb_master_key_set = 0;
+    (*db)->hdb_openp = 0;
+    /*
+     * The KDC must not cache in front of us: a rebuilt snapshot is
+     * swapped in without touching a file it could watch.
+     */
+    (*db)->hdb_capability_flags = HDB_CAP_F_HANDLE_ENTERPRISE_PRINCIPAL |
+	HDB_CAP_F_EXACT_LOOKUP | HDB_CAP_F_IN_MEMORY;
+    (*db)->hdb_open = snap_open;
+    (*db)->hdb_close = snap_close;
+    (*db)->hdb_fetch_kvno = snap_fetch_kvno;
+    (*db)->hdb_store = snap_store;
+    (*db)->hdb_remove = snap_remove;
+    (*db)->hdb_firstkey = snap_firstkey;
+    (*db)->hdb_nextkey = snap_nextkey;
+    (*db)->hdb_lock = snap_lock;
+    (*db)->hdb_unlock = snap_unlock;
+    (*db)->hdb_rename = NULL;
+    (*db)->hdb__get = NULL;
+    (*db)->hdb__put = NULL;
+    (*db)->hdb__del = NULL;
+    (*db)->hdb_destroy = snap_destroy;
+    (*db)->hdb_check_changed = snap_check_changed;
+    (*db)->hdb_fetch_many = snap_fetch_many;
+
+    return 0;
+}
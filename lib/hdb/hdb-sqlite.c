@@ -88,6 +88,12 @@ typedef struct hdb_sqlite_db {
                  " SELECT Entry.data FROM Principal, Entry" \
                  " WHERE Principal.principal = ? AND" \
                  "       Entry.id = Principal.entry"
+#define HDBSQLITE_FETCH_MANY \
+                 " SELECT Principal.principal, Entry.data" \
+                 " FROM Principal, Entry" \
+                 " WHERE Entry.id = Principal.entry AND" \
+                 "       Principal.principal IN ("
+#define HDBSQLITE_FETCH_MANY_MAX 64	/* principals per query */
 #define HDBSQLITE_GET_IDS \
                  " SELECT id, entry FROM Principal" \
                  " WHERE principal = ?"
@@ -464,28 +470,20 @@ hdb_sqlite_make_database(krb5_context context, HDB *db, const char *filename)
 }
 
 /**
- * Retrieves an entry by searching for the given
- * principal in the Principal database table, both
- * for canonical principals and aliases.
+ * The name an entry is stored under for a lookup of `principal':
+ * enterprise principals are looked up by the name they carry.
  *
  * @param context   The current krb5_context
- * @param db        Heimdal database handle
- * @param principal The principal whose entry to search for
- * @param flags     Currently only for HDB_F_DECRYPT
- * @param kvno	    kvno to fetch is HDB_F_KVNO_SPECIFIED use used
+ * @param principal The principal to look up
+ * @param name      Where to store the name, free with free()
  *
  * @return          0 if everything worked, an error code if not
  */
 static krb5_error_code
-hdb_sqlite_fetch_kvno(krb5_context context, HDB *db, krb5_const_principal principal,
-		      unsigned flags, krb5_kvno kvno, hdb_entry_ex *entry)
+lookup_name(krb5_context context, krb5_const_principal principal, char **name)
 {
-    int sqlite_error;
-    krb5_error_code ret;
-    hdb_sqlite_db *hsdb = (hdb_sqlite_db*)(db->hdb_db);
-    sqlite3_stmt *fetch = hsdb->fetch;
-    krb5_data value;
     krb5_principal enterprise_principal = NULL;
+    krb5_error_code ret;
 
     if (principal->name.name_type == KRB5_NT_ENTERPRISE_PRINCIPAL) {
 	if (principal->name.name_string.len != 1) {
@@ -502,10 +500,72 @@ hdb_sqlite_fetch_kvno(krb5_context context, HDB *db, krb5_const_principal princi
 	principal = enterprise_principal;
     }
 
-    ret = bind_principal(context, principal, fetch, 1);
+    ret = krb5_unparse_name(context, principal, name);
     krb5_free_principal(context, enterprise_principal);
+    return ret;
+}
+
+/**
+ * Decodes a fetched entry and unseals its keys as `flags' ask.
+ *
+ * @param context   The current krb5_context
+ * @param db        Heimdal database handle
+ * @param value     The entry as stored
+ * @param flags     Currently only for HDB_F_DECRYPT and HDB_F_LAZY_UNSEAL
+ * @param entry     Where to store the entry
+ *
+ * @return          0 if everything worked, an error code if not
+ */
+static krb5_error_code
+value2entry(krb5_context context, HDB *db, krb5_data *value,
+	    unsigned flags, hdb_entry_ex *entry)
+{
+    krb5_error_code ret;
+
+    ret = hdb_value2entry(context, value, &entry->entry);
+    if(ret)
+        return ret;
+
+    if (db->hdb_master_key_set && (flags & HDB_F_DECRYPT) &&
+        (flags & HDB_F_LAZY_UNSEAL)) {
+        entry->db = db;
+    } else if (db->hdb_master_key_set && (flags & HDB_F_DECRYPT)) {
+        ret = hdb_unseal_keys(context, db, &entry->entry);
+        if(ret)
+           hdb_free_entry(context, entry);
+    }
+    return ret;
+}
+
+/**
+ * Retrieves an entry by searching for the given
+ * principal in the Principal database table, both
+ * for canonical principals and aliases.
+ *
+ * @param context   The current krb5_context
+ * @param db        Heimdal database handle
+ * @param principal The principal whose entry to search for
+ * @param flags     Currently only for HDB_F_DECRYPT
+ * @param kvno	    kvno to fetch is HDB_F_KVNO_SPECIFIED use used
+ *
+ * @return          0 if everything worked, an error code if not
+ */
+static krb5_error_code
+hdb_sqlite_fetch_kvno(krb5_context context, HDB *db, krb5_const_principal principal,
+		      unsigned flags, krb5_kvno kvno, hdb_entry_ex *entry)
+{
+    int sqlite_error;
+    krb5_error_code ret;
+    hdb_sqlite_db *hsdb = (hdb_sqlite_db*)(db->hdb_db);
+    sqlite3_stmt *fetch = hsdb->fetch;
+    krb5_data value;
+    char *name;
+
+    ret = lookup_name(context, principal, &name);
     if (ret)
 	return ret;
+    sqlite3_bind_text(fetch, 1, name, -1, SQLITE_TRANSIENT);
+    free(name);
 
     sqlite_error = hdb_sqlite_step(context, hsdb->db, fetch);
     if (sqlite_error != SQLITE_ROW) {
@@ -524,19 +584,7 @@ hdb_sqlite_fetch_kvno(krb5_context context, HDB *db, krb5_const_principal princi
     value.length = sqlite3_column_bytes(fetch, 0);
     value.data = (void *) sqlite3_column_blob(fetch, 0);
 
-    ret = hdb_value2entry(context, &value, &entry->entry);
-    if(ret)
-        goto out;
-
-    if (db->hdb_master_key_set && (flags & HDB_F_DECRYPT)) {
-        ret = hdb_unseal_keys(context, db, &entry->entry);
-        if(ret) {
-           hdb_free_entry(context, entry);
-           goto out;
-        }
-    }
-
-    ret = 0;
+    ret = value2entry(context, db, &value, flags, entry);
 
 out:
 
@@ -547,6 +595,132 @@ out:
     return ret;
 }
 
+/**
+ * Fetches up to HDBSQLITE_FETCH_MANY_MAX principals with one
+ * Principal.principal IN (...) query.
+ *
+ * @param context   The current krb5_context
+ * @param db        Heimdal database handle
+ * @param n         Number of requests
+ * @param reqs      The lookups to do, see hdb_sqlite_fetch_kvno()
+ * @param names     The names to look up, NULL for requests that are
+ *                  already answered; freed as requests are answered
+ */
+static void
+fetch_chunk(krb5_context context, HDB *db, size_t n,
+	    hdb_fetch_request *reqs, char **names)
+{
+    hdb_sqlite_db *hsdb = (hdb_sqlite_db*)(db->hdb_db);
+    char sql[sizeof(HDBSQLITE_FETCH_MANY) + 2 * HDBSQLITE_FETCH_MANY_MAX];
+    sqlite3_stmt *stmt = NULL;
+    krb5_error_code ret = 0;
+    const char *found;
+    krb5_data value;
+    size_t i, len;
+    int sqlite_error, k = 0;
+
+    len = strlcpy(sql, HDBSQLITE_FETCH_MANY, sizeof(sql));
+    for (i = 0; i < n; i++) {
+	if (names[i] == NULL)
+	    continue;
+	if (k++)
+	    sql[len++] = ',';
+	sql[len++] = '?';
+    }
+    if (k == 0)
+	return;
+    sql[len++] = ')';
+    sql[len] = '\0';
+
+    ret = hdb_sqlite_prepare_stmt(context, hsdb->db, &stmt, sql);
+    if (ret)
+	goto out;
+
+    for (i = 0, k = 0; i < n; i++) {
+	if (names[i] != NULL)
+	    sqlite3_bind_text(stmt, ++k, names[i], -1, SQLITE_TRANSIENT);
+    }
+
+    while ((sqlite_error = hdb_sqlite_step(context, hsdb->db,
+					   stmt)) == SQLITE_ROW) {
+	found = (const char *)sqlite3_column_text(stmt, 0);
+	value.length = sqlite3_column_bytes(stmt, 1);
+	value.data = (void *) sqlite3_column_blob(stmt, 1);
+	if (found == NULL)
+	    continue;
+
+	/* Several requests may be for the same principal */
+	for (i = 0; i < n; i++) {
+	    if (names[i] == NULL || strcmp(names[i], found) != 0)
+		continue;
+	    reqs[i].ret = value2entry(context, db, &value, reqs[i].flags,
+				      reqs[i].entry);
+	    free(names[i]);
+	    names[i] = NULL;
+	}
+    }
+    if (sqlite_error != SQLITE_DONE) {
+	ret = HDB_ERR_UK_RERROR;
+	krb5_set_error_message(context, ret, "sqlite fetch failed: %d",
+			       sqlite_error);
+    }
+
+ out:
+    if (stmt)
+	sqlite3_finalize(stmt);
+    /* What is left was not found, or not looked for */
+    for (i = 0; i < n; i++) {
+	if (names[i] == NULL)
+	    continue;
+	if (ret)
+	    reqs[i].ret = ret;
+	free(names[i]);
+	names[i] = NULL;
+    }
+}
+
+/**
+ * Fetches several principals in one read transaction, so that they
+ * all come from the same version of the database, with one query for
+ * up to HDBSQLITE_FETCH_MANY_MAX of them.
+ *
+ * @param context   The current krb5_context
+ * @param db        Heimdal database handle
+ * @param n         Number of requests
+ * @param reqs      The lookups to do, see hdb_sqlite_fetch_kvno()
+ *
+ * @return          0 if the lookups were done, an error code if not
+ */
+static krb5_error_code
+hdb_sqlite_fetch_many(krb5_context context, HDB *db, size_t n,
+		      hdb_fetch_request *reqs)
+{
+    hdb_sqlite_db *hsdb = (hdb_sqlite_db*)(db->hdb_db);
+    char *names[HDBSQLITE_FETCH_MANY_MAX];
+    krb5_error_code ret;
+    size_t i, m;
+
+    ret = hdb_sqlite_exec_stmt(context, hsdb, "BEGIN TRANSACTION",
+                               HDB_ERR_UK_RERROR);
+    if (ret)
+        return ret;
+
+    for (; n > 0; n -= m, reqs += m) {
+	m = n < HDBSQLITE_FETCH_MANY_MAX ? n : HDBSQLITE_FETCH_MANY_MAX;
+	for (i = 0; i < m; i++) {
+	    names[i] = NULL;
+	    reqs[i].ret = lookup_name(context, reqs[i].principal, &names[i]);
+	    if (reqs[i].ret == 0)
+		reqs[i].ret = HDB_ERR_NOENTRY;
+	}
+	fetch_chunk(context, db, m, reqs, names);
+    }
+
+    if (hdb_sqlite_exec_stmt(context, hsdb, "COMMIT", HDB_ERR_UK_RERROR))
+        (void) hdb_sqlite_exec_stmt(context, hsdb, "ROLLBACK", 0);
+    return 0;
+}
+
 /**
  * Convenience function to step a prepared statement with no
  * value once.
@@ -1030,7 +1204,7 @@ hdb_sqlite_create(krb5_context context, HDB **db, const char *filename)
 
     (*db)->hdb_master_key_set = 0;
     (*db)->hdb_openp = 0;
-    (*db)->hdb_capability_flags = 0;
+    (*db)->hdb_capability_flags = HDB_CAP_F_EXACT_LOOKUP;
 
     (*db)->hdb_open = hdb_sqlite_open;
     (*db)->hdb_close = hdb_sqlite_close;
@@ -1040,6 +1214,7 @@ hdb_sqlite_create(krb5_context context, HDB **db, const char *filename)
     (*db)->hdb_firstkey = hdb_sqlite_firstkey;
     (*db)->hdb_nextkey = hdb_sqlite_nextkey;
     (*db)->hdb_fetch_kvno = hdb_sqlite_fetch_kvno;
+    (*db)->hdb_fetch_many = hdb_sqlite_fetch_many;
     (*db)->hdb_store = hdb_sqlite_store;
     (*db)->hdb_remove = hdb_sqlite_remove;
     (*db)->hdb_destroy = hdb_sqlite_destroy;
@@ -87,6 +87,7 @@ static struct hdb_method methods[] = {
     { HDB_INTERFACE_VERSION, NULL, NULL, "ndbm:",	hdb_ndbm_create},
 #endif
     { HDB_INTERFACE_VERSION, NULL, NULL, "keytab:",	hdb_keytab_create},
+    { HDB_INTERFACE_VERSION, NULL, NULL, "snapshot:",	hdb_snapshot_create},
 #if defined(OPENLDAP) && !defined(OPENLDAP_MODULE)
     { HDB_INTERFACE_VERSION, NULL, NULL, "ldap:",	hdb_ldap_create},
     { HDB_INTERFACE_VERSION, NULL, NULL, "ldapi:",	hdb_ldapi_create},
@@ -256,6 +257,56 @@ hdb_foreach(krb5_context context,
     return ret;
 }
 
+/**
+ * Look up `n' principals in `db', with one backend operation when the
+ * backend supports it.  The result of each lookup is stored in its
+ * request; the return value is non-zero only if none of them could be
+ * done, in which case all requests carry that error.
+ */
+
+krb5_error_code
+hdb_fetch_many(krb5_context context, HDB *db, size_t n,
+	       hdb_fetch_request *reqs)
+{
+    krb5_error_code ret;
+    size_t i;
+
+    if (db->hdb_fetch_many != NULL) {
+	HEIM_PROBE2(hdb, fetch__many__start, db->hdb_name, n);
+	for (i = 0; i < n; i++)
+	    HEIM_PROBE5(hdb, fetch__start, db->hdb_name,
+			HEIM_PROBE_REALM(reqs[i].principal),
+			HEIM_PROBE_COMP(reqs[i].principal, 0),
+			HEIM_PROBE_COMP(reqs[i].principal, 1), reqs[i].kvno);
+	ret = db->hdb_fetch_many(context, db, n, reqs);
+	for (i = 0; i < n; i++) {
+	    if (ret)
+		reqs[i].ret = ret;
+	    HEIM_PROBE5(hdb, fetch__done, db->hdb_name,
+			HEIM_PROBE_REALM(reqs[i].principal),
+			HEIM_PROBE_COMP(reqs[i].principal, 0),
+			HEIM_PROBE_COMP(reqs[i].principal, 1), reqs[i].ret);
+	}
+	HEIM_PROBE3(hdb, fetch__many__done, db->hdb_name, n, ret);
+	return ret;
+    }
+
+    for (i = 0; i < n; i++) {
+	HEIM_PROBE5(hdb, fetch__start, db->hdb_name,
+		    HEIM_PROBE_REALM(reqs[i].principal),
+		    HEIM_PROBE_COMP(reqs[i].principal, 0),
+		    HEIM_PROBE_COMP(reqs[i].principal, 1), reqs[i].kvno);
+	reqs[i].ret = db->hdb_fetch_kvno(context, db, reqs[i].principal,
+					 reqs[i].flags, reqs[i].kvno,
+					 reqs[i].entry);
+	HEIM_PROBE5(hdb, fetch__done, db->hdb_name,
+		    HEIM_PROBE_REALM(reqs[i].principal),
+		    HEIM_PROBE_COMP(reqs[i].principal, 0),
+		    HEIM_PROBE_COMP(reqs[i].principal, 1), reqs[i].ret);
+    }
+    return 0;
+}
+
 krb5_error_code
 hdb_check_db_format(krb5_context context, HDB *db)
 {
@@ -66,12 +66,16 @@ enum hdb_lockop{ HDB_RLOCK, HDB_WLOCK };
 #define HDB_F_FOR_AS_REQ	4096	/* fetch is for a AS REQ */
 #define HDB_F_FOR_TGS_REQ	8192	/* fetch is for a TGS REQ */
 #define HDB_F_PRECHECK		16384	/* check that the operation would succeed */
+#define HDB_F_LAZY_UNSEAL	32768	/* leave keys sealed until used */
 
 /* hdb_capability_flags */
 #define HDB_CAP_F_HANDLE_ENTERPRISE_PRINCIPAL 1
 #define HDB_CAP_F_HANDLE_PASSWORDS	2
 #define HDB_CAP_F_PASSWORD_UPDATE_KEYS	4
 #define HDB_CAP_F_SHARED_DIRECTORY      8
+#define HDB_CAP_F_EXACT_LOOKUP		16	/* fetch matches only the keys of entries and aliases */
+#define HDB_CAP_F_ONE_HANDLE		32	/* only one open handle per process */
+#define HDB_CAP_F_IN_MEMORY		64	/* lookups never touch the disk */
 
 /* auth status values */
 #define HDB_AUTH_SUCCESS		0
@@ -94,8 +98,21 @@ typedef struct hdb_entry_ex {
     void *ctx;
     hdb_entry entry;
     void (*free_entry)(krb5_context, struct hdb_entry_ex *);
+    struct HDB *db;	/* unseals keys left sealed by HDB_F_LAZY_UNSEAL */
 } hdb_entry_ex;
 
+/**
+ * One lookup of a batch passed to hdb_fetch_many()
+ */
+
+typedef struct hdb_fetch_request {
+    krb5_const_principal principal;
+    unsigned flags;
+    krb5_kvno kvno;
+    hdb_entry_ex *entry;	/* filled in on success */
+    krb5_error_code ret;	/* result of this lookup */
+} hdb_fetch_request;
+
 
 /**
  * HDB backend function pointer structure
@@ -279,9 +296,38 @@ typedef struct HDB {
      * sync and does an fsync().
      */
     krb5_error_code (*hdb_set_sync)(krb5_context, struct HDB *, int);
+
+    /**
+     * Check whether an open database is still current
+     *
+     * Returns HDB_ERR_DB_CHANGED if the database backing an open
+     * handle was replaced (e.g., by hprop or an iprop full resync)
+     * since ->hdb_open(), in which case the caller must ->hdb_close()
+     * and ->hdb_open() it again to see the new contents.  Returns 0
+     * if the open handle can continue to be used.
+     *
+     * This call is optional to support.  Only backends that can
+     * safely be kept open across many transactions (without holding
+     * locks that would block writers) should provide it.
+     */
+    krb5_error_code (*hdb_check_changed)(krb5_context, struct HDB *);
+
+    /**
+     * Fetch several entries at once
+     *
+     * Performs the lookups of ->hdb_fetch_kvno() for each request,
+     * storing each result in the request, all from the same view of
+     * the database (e.g., in one transaction).  Returns an error only
+     * if none of the lookups could be done.
+     *
+     * This call is optional to support; hdb_fetch_many() falls back to
+     * calling ->hdb_fetch_kvno() for each request.
+     */
+    krb5_error_code (*hdb_fetch_many)(krb5_context, struct HDB *, size_t,
+				      hdb_fetch_request *);
 }HDB;
 
-#define HDB_INTERFACE_VERSION	10
+#define HDB_INTERFACE_VERSION	12
 
 struct hdb_method {
     int			version;
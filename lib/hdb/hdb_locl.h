@@ -66,6 +66,7 @@
 #include <krb5.h>
 #include <hdb.h>
 #include <hdb-private.h>
+#include <heim_probes.h>
 
 #define HDB_DEFAULT_DB HDB_DB_DIR "/heimdal"
 #define HDB_DB_FORMAT_ENTRY "hdb/db-format"
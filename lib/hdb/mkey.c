@@ -451,6 +451,12 @@ hdb_unseal_key_mkey(krb5_context context, Key *k, hdb_master_key mkey)
     if (ret)
 	return ret;
 
+    /* a null key stays null */
+    if (res.length == 0) {
+	keysize = 0;
+	goto out;
+    }
+
     /* fixup keylength if the key got padded when encrypting it */
     ret = krb5_enctype_keysize(context, k->key.keytype, &keysize);
     if (ret) {
@@ -462,6 +468,7 @@ hdb_unseal_key_mkey(krb5_context context, Key *k, hdb_master_key mkey)
 	return KRB5_BAD_KEYSIZE;
     }
 
+ out:
     memset(k->key.keyvalue.data, 0, k->key.keyvalue.length);
     free(k->key.keyvalue.data);
     k->key.keyvalue = res;
@@ -632,6 +639,20 @@ hdb_unseal_key(krb5_context context, HDB *db, Key *k)
     return hdb_unseal_key_mkey(context, k, db->hdb_master_key);
 }
 
+/**
+ * Decrypt `k', one of the keys of `ent', if the fetch that returned
+ * `ent' left it sealed (HDB_F_LAZY_UNSEAL).  The key is decrypted in
+ * place, so only the first call for a given key does any work.
+ */
+
+krb5_error_code
+hdb_entry_unseal_key(krb5_context context, hdb_entry_ex *ent, Key *k)
+{
+    if (k->mkvno == NULL || ent->db == NULL)
+	return 0;
+    return hdb_unseal_key(context, ent->db, k);
+}
+
 krb5_error_code
 hdb_seal_key_mkey(krb5_context context, Key *k, hdb_master_key mkey)
 {
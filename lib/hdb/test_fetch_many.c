@@ -0,0 +1,172 @@
+/*
+ * Copyright (c) 2026 Kungliga Tekniska Högskolan
+ * (Royal Institute of Technology, Stockholm, Sweden).
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the Institute nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE INSTITUTE AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE INSTITUTE OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Check hdb_fetch_many() against a database holding foo, with the
+ * alias foo-alias, and bar: through the backend's own method, if it
+ * has one, and through the generic loop.
+ */
+
+#include "hdb_locl.h"
+#include <getarg.h>
+
+static int help_flag;
+static int version_flag;
+
+struct getargs args[] = {
+    { "help",		'h',	arg_flag,   &help_flag,    NULL, NULL },
+    { "version",	0,	arg_flag,   &version_flag, NULL, NULL }
+};
+
+static int num_args = sizeof(args) / sizeof(args[0]);
+
+static const struct {
+    const char *name;
+    const char *found;		/* entry returned, NULL if none */
+} tests[] = {
+    { "foo",		"foo" },
+    { "nosuch",		NULL },
+    { "bar",		"bar" },
+    { "foo",		"foo" },	/* duplicate */
+    { "foo-alias",	"foo" },	/* alias */
+    { "nosuch",		NULL }		/* duplicate missing */
+};
+
+#define NUM_TESTS (sizeof(tests) / sizeof(tests[0]))
+
+static int
+check(krb5_context context, HDB *db, const char *realm, const char *path)
+{
+    hdb_fetch_request reqs[NUM_TESTS];
+    hdb_entry_ex ents[NUM_TESTS];
+    krb5_principal p;
+    krb5_error_code ret;
+    int failed = 0;
+    size_t i;
+
+    memset(reqs, 0, sizeof(reqs));
+    memset(ents, 0, sizeof(ents));
+    for (i = 0; i < NUM_TESTS; i++) {
+	ret = krb5_make_principal(context, &p, realm, tests[i].name, NULL);
+	if (ret)
+	    krb5_err(context, 1, ret, "krb5_make_principal");
+	reqs[i].principal = p;
+	reqs[i].entry = &ents[i];
+	reqs[i].ret = -1;
+    }
+
+    ret = hdb_fetch_many(context, db, NUM_TESTS, reqs);
+    if (ret)
+	krb5_err(context, 1, ret, "%s: hdb_fetch_many", path);
+
+    for (i = 0; i < NUM_TESTS; i++) {
+	if (tests[i].found == NULL) {
+	    if (reqs[i].ret != HDB_ERR_NOENTRY) {
+		warnx("%s: %s: expected HDB_ERR_NOENTRY, got %d",
+		      path, tests[i].name, reqs[i].ret);
+		failed = 1;
+	    }
+	    if (reqs[i].ret == 0)
+		hdb_free_entry(context, &ents[i]);
+	} else if (reqs[i].ret) {
+	    const char *msg = krb5_get_error_message(context, reqs[i].ret);
+	    warnx("%s: %s: %s", path, tests[i].name, msg);
+	    krb5_free_error_message(context, msg);
+	    failed = 1;
+	} else {
+	    ret = krb5_make_principal(context, &p, realm, tests[i].found,
+				      NULL);
+	    if (ret)
+		krb5_err(context, 1, ret, "krb5_make_principal");
+	    if (!krb5_principal_compare(context, p, ents[i].entry.principal)) {
+		warnx("%s: %s: returned the wrong entry", path,
+		      tests[i].name);
+		failed = 1;
+	    }
+	    krb5_free_principal(context, p);
+	    hdb_free_entry(context, &ents[i]);
+	}
+	krb5_free_principal(context, (krb5_principal)reqs[i].principal);
+    }
+    return failed;
+}
+
+int
+main(int argc, char **argv)
+{
+    krb5_context context;
+    krb5_error_code ret;
+    int failed, o = 0;
+    HDB *db;
+
+    setprogname(argv[0]);
+
+    if(getarg(args, num_args, argc, argv, &o))
+	krb5_std_usage(1, args, num_args);
+
+    if(help_flag)
+	krb5_std_usage(0, args, num_args);
+
+    if(version_flag){
+	print_version(NULL);
+	exit(0);
+    }
+
+    argc -= o;
+    argv += o;
+    if (argc != 2)
+	errx(1, "usage: %s dbname realm", getprogname());
+
+    ret = krb5_init_context(&context);
+    if (ret)
+	errx (1, "krb5_init_context failed: %d", ret);
+
+    ret = hdb_create(context, &db, argv[0]);
+    if (ret)
+	krb5_err(context, 1, ret, "hdb_create: %s", argv[0]);
+    ret = db->hdb_open(context, db, O_RDONLY, 0);
+    if (ret)
+	krb5_err(context, 1, ret, "hdb_open: %s", argv[0]);
+
+    failed = check(context, db, argv[1],
+		   db->hdb_fetch_many ? "backend" : "generic");
+    if (db->hdb_fetch_many) {
+	db->hdb_fetch_many = NULL;
+	failed |= check(context, db, argv[1], "generic");
+    }
+
+    db->hdb_close(context, db);
+    (*db->hdb_destroy)(context, db);
+    krb5_free_context(context);
+    return failed;
+}
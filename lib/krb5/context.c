@@ -537,11 +537,29 @@ krb5_copy_context(krb5_context context, krb5_context *out)
 
     HEIMDAL_MUTEX_init(&p->mutex);
 
+    p->flags = context->flags & KRB5_CTX_F_HOMEDIR_ACCESS;
+
+    ret = _krb5_config_copy(context, context->cf, &p->cf);
+    if (ret)
+	goto out;
+
+    ret = init_context_from_config_file(p);
+    if (ret)
+	goto out;
+
     if (context->default_cc_name)
 	p->default_cc_name = strdup(context->default_cc_name);
     if (context->default_cc_name_env)
 	p->default_cc_name_env = strdup(context->default_cc_name_env);
 
+    /* keep any changes made to the original since it was configured */
+    free(p->etypes);
+    p->etypes = NULL;
+    free(p->cfg_etypes);
+    p->cfg_etypes = NULL;
+    free(p->etypes_des);
+    p->etypes_des = NULL;
+
     if (context->etypes) {
 	ret = copy_etypes(context, context->etypes, &p->etypes);
 	if (ret)
@@ -565,10 +583,6 @@ krb5_copy_context(krb5_context context, krb5_context *out)
 	    goto out;
     }
 
-    ret = _krb5_config_copy(context, context->cf, &p->cf);
-    if (ret)
-	goto out;
-
     /* XXX should copy */
     krb5_init_ets(p);
 
@@ -585,7 +599,7 @@ krb5_copy_context(krb5_context context, krb5_context *out)
     ret = krb5_set_extra_addresses(p, context->extra_addresses);
     if (ret)
 	goto out;
-    ret = krb5_set_extra_addresses(p, context->ignore_addresses);
+    ret = krb5_set_ignore_addresses(p, context->ignore_addresses);
     if (ret)
 	goto out;
 
@@ -593,6 +607,14 @@ krb5_copy_context(krb5_context context, krb5_context *out)
     if (ret)
 	goto out;
 
+#ifdef PKINIT
+    ret = hx509_context_init(&p->hx509ctx);
+    if (ret)
+	goto out;
+#endif
+    if (rk_SOCK_INIT())
+	p->flags |= KRB5_CTX_F_SOCKETS_INITIALIZED;
+
     *out = p;
 
     return 0;
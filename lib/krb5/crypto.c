@@ -1584,37 +1584,13 @@ iov_pad_validate(const struct _krb5_encryption_type *et,
     return 0;
 }
 
-/**
- * Inline encrypt a kerberos message
- *
- * @param context Kerberos context
- * @param crypto Kerberos crypto context
- * @param usage Key usage for this buffer
- * @param data array of buffers to process
- * @param num_data length of array
- * @param ivec initial cbc/cts vector
- *
- * @return Return an error code or 0.
- * @ingroup krb5_crypto
- *
- * Kerberos encrypted data look like this:
- *
- * 1. KRB5_CRYPTO_TYPE_HEADER
- * 2. array [1,...] KRB5_CRYPTO_TYPE_DATA and array [0,...]
- *    KRB5_CRYPTO_TYPE_SIGN_ONLY in any order, however the receiver
- *    have to aware of the order. KRB5_CRYPTO_TYPE_SIGN_ONLY is
- *    commonly used headers and trailers.
- * 3. KRB5_CRYPTO_TYPE_PADDING, at least on padsize long if padsize > 1
- * 4. KRB5_CRYPTO_TYPE_TRAILER
- */
-
-KRB5_LIB_FUNCTION krb5_error_code KRB5_LIB_CALL
-krb5_encrypt_iov_ivec(krb5_context context,
-		      krb5_crypto crypto,
-		      unsigned usage,
-		      krb5_crypto_iov *data,
-		      int num_data,
-		      void *ivec)
+static krb5_error_code
+encrypt_iov_ivec(krb5_context context,
+		 krb5_crypto crypto,
+		 unsigned usage,
+		 krb5_crypto_iov *data,
+		 int num_data,
+		 void *ivec)
 {
     size_t headersz, trailersz;
     Checksum cksum;
@@ -1781,7 +1757,7 @@ cleanup:
 }
 
 /**
- * Inline decrypt a Kerberos message.
+ * Inline encrypt a kerberos message
  *
  * @param context Kerberos context
  * @param crypto Kerberos crypto context
@@ -1793,21 +1769,41 @@ cleanup:
  * @return Return an error code or 0.
  * @ingroup krb5_crypto
  *
+ * Kerberos encrypted data look like this:
+ *
  * 1. KRB5_CRYPTO_TYPE_HEADER
- * 2. one KRB5_CRYPTO_TYPE_DATA and array [0,...] of KRB5_CRYPTO_TYPE_SIGN_ONLY in
- *  any order, however the receiver have to aware of the
- *  order. KRB5_CRYPTO_TYPE_SIGN_ONLY is commonly used unencrypoted
- *  protocol headers and trailers. The output data will be of same
- *  size as the input data or shorter.
+ * 2. array [1,...] KRB5_CRYPTO_TYPE_DATA and array [0,...]
+ *    KRB5_CRYPTO_TYPE_SIGN_ONLY in any order, however the receiver
+ *    have to aware of the order. KRB5_CRYPTO_TYPE_SIGN_ONLY is
+ *    commonly used headers and trailers.
+ * 3. KRB5_CRYPTO_TYPE_PADDING, at least on padsize long if padsize > 1
+ * 4. KRB5_CRYPTO_TYPE_TRAILER
  */
 
 KRB5_LIB_FUNCTION krb5_error_code KRB5_LIB_CALL
-krb5_decrypt_iov_ivec(krb5_context context,
+krb5_encrypt_iov_ivec(krb5_context context,
 		      krb5_crypto crypto,
 		      unsigned usage,
 		      krb5_crypto_iov *data,
-		      unsigned int num_data,
+		      int num_data,
 		      void *ivec)
+{
+    krb5_error_code ret;
+
+    HEIM_PROBE3(krb5, encrypt__start, CRYPTO_ETYPE(crypto), usage,
+		iov_enc_data_len(data, num_data));
+    ret = encrypt_iov_ivec(context, crypto, usage, data, num_data, ivec);
+    HEIM_PROBE3(krb5, encrypt__done, CRYPTO_ETYPE(crypto), usage, ret);
+    return ret;
+}
+
+static krb5_error_code
+decrypt_iov_ivec(krb5_context context,
+		 krb5_crypto crypto,
+		 unsigned usage,
+		 krb5_crypto_iov *data,
+		 unsigned int num_data,
+		 void *ivec)
 {
     Checksum cksum;
     krb5_data enc_data, sign_data;
@@ -1938,6 +1934,44 @@ cleanup:
     return ret;
 }
 
+/**
+ * Inline decrypt a Kerberos message.
+ *
+ * @param context Kerberos context
+ * @param crypto Kerberos crypto context
+ * @param usage Key usage for this buffer
+ * @param data array of buffers to process
+ * @param num_data length of array
+ * @param ivec initial cbc/cts vector
+ *
+ * @return Return an error code or 0.
+ * @ingroup krb5_crypto
+ *
+ * 1. KRB5_CRYPTO_TYPE_HEADER
+ * 2. one KRB5_CRYPTO_TYPE_DATA and array [0,...] of KRB5_CRYPTO_TYPE_SIGN_ONLY in
+ *  any order, however the receiver have to aware of the
+ *  order. KRB5_CRYPTO_TYPE_SIGN_ONLY is commonly used unencrypoted
+ *  protocol headers and trailers. The output data will be of same
+ *  size as the input data or shorter.
+ */
+
+KRB5_LIB_FUNCTION krb5_error_code KRB5_LIB_CALL
+krb5_decrypt_iov_ivec(krb5_context context,
+		      krb5_crypto crypto,
+		      unsigned usage,
+		      krb5_crypto_iov *data,
+		      unsigned int num_data,
+		      void *ivec)
+{
+    krb5_error_code ret;
+
+    HEIM_PROBE3(krb5, decrypt__start, CRYPTO_ETYPE(crypto), usage,
+		iov_enc_data_len(data, num_data));
+    ret = decrypt_iov_ivec(context, crypto, usage, data, num_data, ivec);
+    HEIM_PROBE3(krb5, decrypt__done, CRYPTO_ETYPE(crypto), usage, ret);
+    return ret;
+}
+
 /**
  * Create a Kerberos message checksum.
  *
@@ -2137,6 +2171,8 @@ krb5_encrypt_ivec(krb5_context context,
 {
     krb5_error_code ret;
 
+    HEIM_PROBE3(krb5, encrypt__start, CRYPTO_ETYPE(crypto), usage, len);
+
     switch (crypto->et->flags & F_CRYPTO_MASK) {
     case F_RFC3961_ENC:
 	ret = encrypt_internal_derived(context, crypto, usage,
@@ -2155,6 +2191,7 @@ krb5_encrypt_ivec(krb5_context context,
 	break;
     }
 
+    HEIM_PROBE3(krb5, encrypt__done, CRYPTO_ETYPE(crypto), usage, ret);
     return ret;
 }
 
@@ -2198,6 +2235,8 @@ krb5_decrypt_ivec(krb5_context context,
 {
     krb5_error_code ret;
 
+    HEIM_PROBE3(krb5, decrypt__start, CRYPTO_ETYPE(crypto), usage, len);
+
     switch (crypto->et->flags & F_CRYPTO_MASK) {
     case F_RFC3961_ENC:
 	ret = decrypt_internal_derived(context, crypto, usage,
@@ -2216,6 +2255,7 @@ krb5_decrypt_ivec(krb5_context context,
 	break;
     }
 
+    HEIM_PROBE3(krb5, decrypt__done, CRYPTO_ETYPE(crypto), usage, ret);
     return ret;
 }
 
@@ -678,6 +678,7 @@ typedef struct krb5_log_facility {
     char *program;
     int len;
     struct facility *val;
+    int max_level;		/* highest level any destination wants */
 } krb5_log_facility;
 
 typedef EncAPRepPart krb5_ap_rep_enc_part;
@@ -152,6 +152,7 @@ struct _krb5_krb_auth_data;
 #include <krb5-private.h>
 
 #include "heim_threads.h"
+#include "heim_probes.h"
 
 #define ALLOC(X, N) (X) = calloc((N), sizeof(*(X)))
 #define ALLOC_SEQ(X, N) do { (X)->len = (N); ALLOC((X)->val, (N)); } while(0)
@@ -44,6 +44,12 @@ struct facility {
     void *data;
 };
 
+/*
+ * Destinations keep state (open files, syslog) that several threads
+ * logging to the same facility must not use at once.
+ */
+static HEIMDAL_MUTEX log_mutex = HEIMDAL_MUTEX_INITIALIZER;
+
 static struct facility*
 log_realloc(krb5_log_facility *f)
 {
@@ -128,6 +134,7 @@ krb5_initlog(krb5_context context,
 	free(f);
 	return krb5_enomem(context);
     }
+    f->max_level = -1;
     *fac = f;
     return 0;
 }
@@ -149,6 +156,10 @@ krb5_addlog_func(krb5_context context,
     fp->log_func = log_func;
     fp->close_func = close_func;
     fp->data = data;
+    if (max < 0)
+	fac->max_level = INT_MAX;
+    else if (max > fac->max_level)
+	fac->max_level = max;
     return 0;
 }
 
@@ -262,6 +273,375 @@ open_file(krb5_context context, krb5_log_facility *fac, int min, int max,
     return krb5_addlog_func(context, fac, min, max, log_file, close_file, fd);
 }
 
+#if defined(ENABLE_PTHREAD_SUPPORT) && !defined(_WIN32)
+
+/*
+ * ASYNC:/file destination.
+ *
+ * Callers format each line into a fixed size ring buffer and return;
+ * a writer thread drains the ring with writev(2), one open/close of
+ * the file per batch so that log rotation keeps working as with
+ * FILE:.  When the ring is full the line is dropped and counted, the
+ * writer reports the number of dropped lines with the next batch.
+ *
+ * Producers only hold the mutex while copying the line into the free
+ * part of the ring; the writer holds it only to pick up and retire
+ * the filled part, never across the write itself.
+ *
+ * The writer thread is started on first use in each process.  Forking
+ * (as the KDC does for its worker processes) leaves the child without
+ * a writer, so an atfork handler resets the ring in the child, which
+ * then starts its own writer on its first message.
+ *
+ * Programs often leave with exit(), or krb5_err(), without closing
+ * their log, so an atexit handler waits for the writers to drain the
+ * rings.  Lines logged after that, by later atexit handlers, are
+ * written directly.
+ */
+
+#define ASYNC_LOG_BUFSIZE	(1024 * 1024)
+
+struct async_data {
+    struct async_data *next;
+    char *filename;
+    HEIMDAL_MUTEX mutex;
+    pthread_cond_t cond;
+    pthread_t thread;
+    int running;		/* writer thread exists in this process */
+    int waiting;		/* writer is sleeping on cond */
+    int stop;
+    int sync;			/* exiting, write lines directly */
+    unsigned long dropped;
+    size_t head;		/* producers append here */
+    size_t tail;		/* writer drains from here */
+    size_t used;
+    char buf[ASYNC_LOG_BUFSIZE];
+};
+
+static HEIMDAL_MUTEX async_list_mutex = HEIMDAL_MUTEX_INITIALIZER;
+static struct async_data *async_list;
+static pthread_once_t async_once = PTHREAD_ONCE_INIT;
+
+static void
+async_prepare(void)
+{
+    struct async_data *a;
+
+    HEIMDAL_MUTEX_lock(&async_list_mutex);
+    for (a = async_list; a; a = a->next)
+	HEIMDAL_MUTEX_lock(&a->mutex);
+}
+
+static void
+async_parent(void)
+{
+    struct async_data *a;
+
+    for (a = async_list; a; a = a->next)
+	HEIMDAL_MUTEX_unlock(&a->mutex);
+    HEIMDAL_MUTEX_unlock(&async_list_mutex);
+}
+
+/*
+ * The locks and condition variables are in an unknown state in the
+ * child, whose only thread is the one that forked: start over with new
+ * ones.
+ */
+static void
+async_child(void)
+{
+    struct async_data *a;
+
+    HEIMDAL_MUTEX_init(&async_list_mutex);
+    /* Pending lines are the parent's to write */
+    for (a = async_list; a; a = a->next) {
+	HEIMDAL_MUTEX_init(&a->mutex);
+	pthread_cond_init(&a->cond, NULL);
+	a->running = a->waiting = 0;
+	a->head = a->tail = a->used = 0;
+	a->dropped = 0;
+    }
+}
+
+static void
+async_exit(void)
+{
+    struct async_data *a;
+    int running;
+
+    HEIMDAL_MUTEX_lock(&async_list_mutex);
+    for (a = async_list; a; a = a->next) {
+	HEIMDAL_MUTEX_lock(&a->mutex);
+	running = a->running;
+	a->stop = 1;
+	a->sync = 1;
+	pthread_cond_signal(&a->cond);
+	HEIMDAL_MUTEX_unlock(&a->mutex);
+	/* The writer drains what is left before it exits */
+	if (running)
+	    pthread_join(a->thread, NULL);
+	HEIMDAL_MUTEX_lock(&a->mutex);
+	a->running = 0;
+	HEIMDAL_MUTEX_unlock(&a->mutex);
+    }
+    HEIMDAL_MUTEX_unlock(&async_list_mutex);
+}
+
+static void
+async_once_init(void)
+{
+    pthread_atfork(async_prepare, async_parent, async_child);
+    atexit(async_exit);
+}
+
+static void
+async_write(struct async_data *a, struct iovec *iov, int iovcnt)
+{
+    ssize_t n;
+    int fd;
+
+    fd = open(a->filename, O_WRONLY | O_CREAT | O_APPEND, 0666);
+    if (fd < 0)
+	return;
+    while (iovcnt > 0) {
+	n = writev(fd, iov, iovcnt);
+	if (n < 0 && errno == EINTR)
+	    continue;
+	if (n <= 0)
+	    break;
+	while (iovcnt > 0 && (size_t)n >= iov->iov_len) {
+	    n -= iov->iov_len;
+	    iov++;
+	    iovcnt--;
+	}
+	if (iovcnt > 0) {
+	    iov->iov_base = (char *)iov->iov_base + n;
+	    iov->iov_len -= n;
+	}
+    }
+    close(fd);
+}
+
+static void *
+async_writer(void *arg)
+{
+    struct async_data *a = arg;
+    struct iovec iov[3];
+    char dropmsg[128];
+    size_t len;
+    int iovcnt;
+
+    HEIMDAL_MUTEX_lock(&a->mutex);
+    for (;;) {
+	while (a->used == 0 && a->dropped == 0 && !a->stop) {
+	    a->waiting = 1;
+	    pthread_cond_wait(&a->cond, &a->mutex);
+	    a->waiting = 0;
+	}
+	if (a->used == 0 && a->dropped == 0)
+	    break;
+
+	iovcnt = 0;
+	len = a->used;
+	if (len > 0) {
+	    size_t first = min(len, sizeof(a->buf) - a->tail);
+
+	    iov[iovcnt].iov_base = a->buf + a->tail;
+	    iov[iovcnt++].iov_len = first;
+	    if (first < len) {
+		iov[iovcnt].iov_base = a->buf;
+		iov[iovcnt++].iov_len = len - first;
+	    }
+	}
+	if (a->dropped) {
+	    char timestr[64];
+	    time_t t = time(NULL);
+	    struct tm *tm = localtime(&t);
+
+	    if (tm == NULL ||
+		strftime(timestr, sizeof(timestr), "%Y-%m-%dT%H:%M:%S", tm) == 0)
+		snprintf(timestr, sizeof(timestr), "%ld", (long)t);
+	    snprintf(dropmsg, sizeof(dropmsg),
+		     "%s %lu log messages dropped, buffer full\n",
+		     timestr, a->dropped);
+	    a->dropped = 0;
+	    iov[iovcnt].iov_base = dropmsg;
+	    iov[iovcnt++].iov_len = strlen(dropmsg);
+	}
+	HEIMDAL_MUTEX_unlock(&a->mutex);
+
+	async_write(a, iov, iovcnt);
+
+	HEIMDAL_MUTEX_lock(&a->mutex);
+	a->tail = (a->tail + len) % sizeof(a->buf);
+	a->used -= len;
+    }
+    HEIMDAL_MUTEX_unlock(&a->mutex);
+    return NULL;
+}
+
+/* Called with a->mutex held */
+static int
+async_start(struct async_data *a)
+{
+    sigset_t all, old;
+    int ret;
+
+    /* Leave asynchronous signals to the application's threads */
+    sigfillset(&all);
+    sigdelset(&all, SIGSEGV);
+    sigdelset(&all, SIGBUS);
+    sigdelset(&all, SIGFPE);
+    sigdelset(&all, SIGILL);
+    pthread_sigmask(SIG_BLOCK, &all, &old);
+    ret = pthread_create(&a->thread, NULL, async_writer, a);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    if (ret == 0)
+	a->running = 1;
+    return ret;
+}
+
+static void
+async_put(struct async_data *a, const char *s, size_t len)
+{
+    size_t first;
+
+    first = min(len, sizeof(a->buf) - a->head);
+    memcpy(a->buf + a->head, s, first);
+    memcpy(a->buf, s + first, len - first);
+    a->head = (a->head + len) % sizeof(a->buf);
+    a->used += len;
+}
+
+static void KRB5_CALLCONV
+log_async(const char *timestr,
+	  const char *msg,
+	  void *data)
+{
+    struct async_data *a = data;
+    char stackbuf[1024 * 4 + 1];
+    char *msgclean = stackbuf;
+    size_t len = strlen(msg);
+    size_t tlen = strlen(timestr);
+    size_t clen;
+
+    /* make sure the log doesn't contain special chars */
+    if (len >= 1024) {
+	msgclean = malloc((len + 1) * 4);
+	if (msgclean == NULL)
+	    return;
+    }
+    clen = strvisx(msgclean, rk_UNCONST(msg), len, VIS_OCTAL);
+
+    HEIMDAL_MUTEX_lock(&a->mutex);
+    if (a->sync) {
+	struct iovec iov[4];
+
+	HEIMDAL_MUTEX_unlock(&a->mutex);
+	iov[0].iov_base = rk_UNCONST(timestr);
+	iov[0].iov_len = tlen;
+	iov[1].iov_base = " ";
+	iov[1].iov_len = 1;
+	iov[2].iov_base = msgclean;
+	iov[2].iov_len = clen;
+	iov[3].iov_base = "\n";
+	iov[3].iov_len = 1;
+	async_write(a, iov, 4);
+	goto out;
+    }
+    if (!a->running && async_start(a) != 0) {
+	HEIMDAL_MUTEX_unlock(&a->mutex);
+	goto out;
+    }
+    if (sizeof(a->buf) - a->used < tlen + 1 + clen + 1) {
+	a->dropped++;
+    } else {
+	async_put(a, timestr, tlen);
+	async_put(a, " ", 1);
+	async_put(a, msgclean, clen);
+	async_put(a, "\n", 1);
+    }
+    if (a->waiting)
+	pthread_cond_signal(&a->cond);
+    HEIMDAL_MUTEX_unlock(&a->mutex);
+ out:
+    if (msgclean != stackbuf)
+	free(msgclean);
+}
+
+static void KRB5_CALLCONV
+close_async(void *data)
+{
+    struct async_data *a = data, **p;
+    int running;
+
+    HEIMDAL_MUTEX_lock(&async_list_mutex);
+    for (p = &async_list; *p; p = &(*p)->next) {
+	if (*p == a) {
+	    *p = a->next;
+	    break;
+	}
+    }
+    HEIMDAL_MUTEX_unlock(&async_list_mutex);
+
+    /* The writer drains what is left before it exits */
+    HEIMDAL_MUTEX_lock(&a->mutex);
+    running = a->running;
+    a->stop = 1;
+    pthread_cond_signal(&a->cond);
+    HEIMDAL_MUTEX_unlock(&a->mutex);
+    if (running)
+	pthread_join(a->thread, NULL);
+
+    pthread_cond_destroy(&a->cond);
+    HEIMDAL_MUTEX_destroy(&a->mutex);
+    free(a->filename);
+    free(a);
+}
+
+static krb5_error_code
+open_async(krb5_context context, krb5_log_facility *fac, int min, int max,
+	   const char *filename)
+{
+    struct async_data *a;
+
+    pthread_once(&async_once, async_once_init);
+
+    a = calloc(1, sizeof(*a));
+    if (a == NULL)
+	return krb5_enomem(context);
+    a->filename = strdup(filename);
+    if (a->filename == NULL) {
+	free(a);
+	return krb5_enomem(context);
+    }
+    HEIMDAL_MUTEX_init(&a->mutex);
+    pthread_cond_init(&a->cond, NULL);
+
+    HEIMDAL_MUTEX_lock(&async_list_mutex);
+    a->next = async_list;
+    async_list = a;
+    HEIMDAL_MUTEX_unlock(&async_list_mutex);
+
+    return krb5_addlog_func(context, fac, min, max, log_async, close_async, a);
+}
+
+#else
+
+/* Without threads ASYNC: is the same as FILE: */
+static krb5_error_code
+open_async(krb5_context context, krb5_log_facility *fac, int min, int max,
+	   const char *filename)
+{
+    char *fn = strdup(filename);
+
+    if (fn == NULL)
+	return krb5_enomem(context);
+    return open_file(context, fac, min, max, fn, "a", NULL, 0, 1);
+}
+
+#endif
+
 
 
 KRB5_LIB_FUNCTION krb5_error_code KRB5_LIB_CALL
@@ -337,6 +717,8 @@ krb5_addlog_dest(krb5_context context, krb5_log_facility *f, const char *orig)
 	    keep_open = 1;
 	}
 	ret = open_file(context, f, min, max, fn, "a", file, keep_open, 1);
+    }else if(strncmp(p, "ASYNC:", 6) == 0){
+	ret = open_async(context, f, min, max, p + 6);
     }else if(strncmp(p, "DEVICE", 6) == 0 && (p[6] == ':' || p[6] == '=')){
 	ret = open_file(context, f, min, max, strdup(p + 7), "w", NULL, 0, 1);
     }else if(strncmp(p, "SYSLOG", 6) == 0 && (p[6] == '\0' || p[6] == ':')){
@@ -401,6 +783,28 @@ krb5_closelog(krb5_context context,
     return 0;
 }
 
+/**
+ * Check if any destination of a log facility wants messages at
+ * `level'.  Lets callers skip building arguments that are only
+ * needed for the log message.
+ *
+ * @param context A Kerberos 5 context
+ * @param fac the log facility, may be NULL
+ * @param level the log level
+ *
+ * @return TRUE if a message at `level' would be logged
+ *
+ * @ingroup krb5_support
+ */
+
+KRB5_LIB_FUNCTION krb5_boolean KRB5_LIB_CALL
+krb5_log_have_level(krb5_context context,
+		    krb5_log_facility *fac,
+		    int level)
+{
+    return fac != NULL && level <= fac->max_level;
+}
+
 #undef __attribute__
 #define __attribute__(X)
 
@@ -420,7 +824,12 @@ krb5_vlog_msg(krb5_context context,
     time_t t = 0;
     int i;
 
-    for(i = 0; fac && i < fac->len; i++)
+    if (reply)
+	*reply = NULL;
+    if (!krb5_log_have_level(context, fac, level))
+	return 0;
+
+    for(i = 0; i < fac->len; i++)
 	if(fac->val[i].min <= level &&
 	   (fac->val[i].max < 0 || fac->val[i].max >= level)) {
 	    if(t == 0) {
@@ -434,7 +843,9 @@ krb5_vlog_msg(krb5_context context,
 		else
 		    actual = msg;
 	    }
+	    HEIMDAL_MUTEX_lock(&log_mutex);
 	    (*fac->val[i].log_func)(buf, actual, fac->val[i].data);
+	    HEIMDAL_MUTEX_unlock(&log_mutex);
 	}
     if(reply == NULL)
 	free(msg);
@@ -37,23 +37,28 @@
 static krb5_error_code
 decrypt_tkt_enc_part (krb5_context context,
 		      krb5_keyblock *key,
+		      krb5_crypto crypto,
 		      EncryptedData *enc_part,
 		      EncTicketPart *decr_part)
 {
     krb5_error_code ret;
     krb5_data plain;
     size_t len;
-    krb5_crypto crypto;
+    krb5_crypto tmp = NULL;
 
-    ret = krb5_crypto_init(context, key, 0, &crypto);
-    if (ret)
-	return ret;
+    if (crypto == NULL) {
+	ret = krb5_crypto_init(context, key, 0, &tmp);
+	if (ret)
+	    return ret;
+	crypto = tmp;
+    }
     ret = krb5_decrypt_EncryptedData (context,
 				      crypto,
 				      KRB5_KU_TICKET,
 				      enc_part,
 				      &plain);
-    krb5_crypto_destroy(context, crypto);
+    if (tmp)
+	krb5_crypto_destroy(context, tmp);
     if (ret)
 	return ret;
 
@@ -187,16 +192,17 @@ find_etypelist(krb5_context context,
     return ret;
 }
 
-KRB5_LIB_FUNCTION krb5_error_code KRB5_LIB_CALL
-krb5_decrypt_ticket(krb5_context context,
-		    Ticket *ticket,
-		    krb5_keyblock *key,
-		    EncTicketPart *out,
-		    krb5_flags flags)
+static krb5_error_code
+decrypt_ticket(krb5_context context,
+	       Ticket *ticket,
+	       krb5_keyblock *key,
+	       krb5_crypto crypto,
+	       EncTicketPart *out,
+	       krb5_flags flags)
 {
     EncTicketPart t;
     krb5_error_code ret;
-    ret = decrypt_tkt_enc_part (context, key, &ticket->enc_part, &t);
+    ret = decrypt_tkt_enc_part (context, key, crypto, &ticket->enc_part, &t);
     if (ret)
 	return ret;
 
@@ -236,6 +242,16 @@ krb5_decrypt_ticket(krb5_context context,
     return 0;
 }
 
+KRB5_LIB_FUNCTION krb5_error_code KRB5_LIB_CALL
+krb5_decrypt_ticket(krb5_context context,
+		    Ticket *ticket,
+		    krb5_keyblock *key,
+		    EncTicketPart *out,
+		    krb5_flags flags)
+{
+    return decrypt_ticket(context, ticket, key, NULL, out, flags);
+}
+
 KRB5_LIB_FUNCTION krb5_error_code KRB5_LIB_CALL
 krb5_verify_authenticator_checksum(krb5_context context,
 				   krb5_auth_context ac,
@@ -292,16 +308,17 @@ krb5_verify_ap_req(krb5_context context,
 				KRB5_KU_AP_REQ_AUTH);
 }
 
-KRB5_LIB_FUNCTION krb5_error_code KRB5_LIB_CALL
-krb5_verify_ap_req2(krb5_context context,
-		    krb5_auth_context *auth_context,
-		    krb5_ap_req *ap_req,
-		    krb5_const_principal server,
-		    krb5_keyblock *keyblock,
-		    krb5_flags flags,
-		    krb5_flags *ap_req_options,
-		    krb5_ticket **ticket,
-		    krb5_key_usage usage)
+static krb5_error_code
+verify_ap_req(krb5_context context,
+	      krb5_auth_context *auth_context,
+	      krb5_ap_req *ap_req,
+	      krb5_const_principal server,
+	      krb5_keyblock *keyblock,
+	      krb5_crypto crypto,
+	      krb5_flags flags,
+	      krb5_flags *ap_req_options,
+	      krb5_ticket **ticket,
+	      krb5_key_usage usage)
 {
     krb5_ticket *t;
     krb5_auth_context ac;
@@ -328,17 +345,19 @@ krb5_verify_ap_req2(krb5_context context,
     }
 
     if (ap_req->ap_options.use_session_key && ac->keyblock){
-	ret = krb5_decrypt_ticket(context, &ap_req->ticket,
-				  ac->keyblock,
-				  &t->ticket,
-				  flags);
+	ret = decrypt_ticket(context, &ap_req->ticket,
+			     ac->keyblock,
+			     NULL,
+			     &t->ticket,
+			     flags);
 	krb5_free_keyblock(context, ac->keyblock);
 	ac->keyblock = NULL;
     }else
-	ret = krb5_decrypt_ticket(context, &ap_req->ticket,
-				  keyblock,
-				  &t->ticket,
-				  flags);
+	ret = decrypt_ticket(context, &ap_req->ticket,
+			     keyblock,
+			     crypto,
+			     &t->ticket,
+			     flags);
 
     if(ret)
 	goto out;
@@ -473,6 +492,44 @@ krb5_verify_ap_req2(krb5_context context,
     return ret;
 }
 
+KRB5_LIB_FUNCTION krb5_error_code KRB5_LIB_CALL
+krb5_verify_ap_req2(krb5_context context,
+		    krb5_auth_context *auth_context,
+		    krb5_ap_req *ap_req,
+		    krb5_const_principal server,
+		    krb5_keyblock *keyblock,
+		    krb5_flags flags,
+		    krb5_flags *ap_req_options,
+		    krb5_ticket **ticket,
+		    krb5_key_usage usage)
+{
+    return verify_ap_req(context, auth_context, ap_req, server,
+			 keyblock, NULL, flags, ap_req_options,
+			 ticket, usage);
+}
+
+/*
+ * Like krb5_verify_ap_req2(), but decrypt the ticket with the already
+ * set up `crypto' for the service key, so that callers verifying many
+ * requests for the same service (such as the KDC) can reuse it.
+ */
+
+KRB5_LIB_FUNCTION krb5_error_code KRB5_LIB_CALL
+_krb5_verify_ap_req_crypto(krb5_context context,
+			   krb5_auth_context *auth_context,
+			   krb5_ap_req *ap_req,
+			   krb5_const_principal server,
+			   krb5_crypto crypto,
+			   krb5_flags flags,
+			   krb5_flags *ap_req_options,
+			   krb5_ticket **ticket,
+			   krb5_key_usage usage)
+{
+    return verify_ap_req(context, auth_context, ap_req, server,
+			 NULL, crypto, flags, ap_req_options,
+			 ticket, usage);
+}
+
 /*
  *
  */
@@ -34,10 +34,31 @@
 #include "krb5_locl.h"
 #include <vis.h>
 
+#if defined(HAVE_MMAP) && !defined(NO_MMAP) && defined(HAVE_FCNTL)
+#define RC_HASH 1
+#endif
+
+enum { RC_TYPE_FILE, RC_TYPE_HASH };
+
 struct krb5_rcache_data {
     char *name;
+    int type;
+    int fd;
+    void *map;
+    size_t maplen;
 };
 
+#ifdef RC_HASH
+static krb5_error_code hash_initialize(krb5_context, krb5_rcache,
+				       krb5_deltat);
+static krb5_error_code hash_store(krb5_context, krb5_rcache,
+				  krb5_donot_replay *);
+static krb5_error_code hash_expunge(krb5_context, krb5_rcache);
+static krb5_error_code hash_get_lifespan(krb5_context, krb5_rcache,
+					 krb5_deltat *);
+static void hash_close(krb5_rcache);
+#endif
+
 KRB5_LIB_FUNCTION krb5_error_code KRB5_LIB_CALL
 krb5_rc_resolve(krb5_context context,
 		krb5_rcache id,
@@ -57,8 +78,16 @@ krb5_rc_resolve_type(krb5_context context,
 		     krb5_rcache *id,
 		     const char *type)
 {
+    int t;
+
     *id = NULL;
-    if(strcmp(type, "FILE")) {
+    if (strcmp(type, "FILE") == 0)
+	t = RC_TYPE_FILE;
+#ifdef RC_HASH
+    else if (strcmp(type, "HASH") == 0)
+	t = RC_TYPE_HASH;
+#endif
+    else {
 	krb5_set_error_message (context, KRB5_RC_TYPE_NOTFOUND,
 				N_("replay cache type %s not supported", ""),
 				type);
@@ -70,6 +99,8 @@ krb5_rc_resolve_type(krb5_context context,
 			       N_("malloc: out of memory", ""));
 	return KRB5_RC_MALLOC;
     }
+    (*id)->type = t;
+    (*id)->fd = -1;
     return 0;
 }
 
@@ -82,13 +113,16 @@ krb5_rc_resolve_full(krb5_context context,
 
     *id = NULL;
 
-    if(strncmp(string_name, "FILE:", 5)) {
+    if (strncmp(string_name, "FILE:", 5) == 0)
+	ret = krb5_rc_resolve_type(context, id, "FILE");
+    else if (strncmp(string_name, "HASH:", 5) == 0)
+	ret = krb5_rc_resolve_type(context, id, "HASH");
+    else {
 	krb5_set_error_message(context, KRB5_RC_TYPE_NOTFOUND,
 			       N_("replay cache type %s not supported", ""),
 			       string_name);
 	return KRB5_RC_TYPE_NOTFOUND;
     }
-    ret = krb5_rc_resolve_type(context, id, "FILE");
     if(ret)
 	return ret;
     ret = krb5_rc_resolve(context, *id, string_name + 5);
@@ -128,10 +162,15 @@ krb5_rc_initialize(krb5_context context,
 		   krb5_rcache id,
 		   krb5_deltat auth_lifespan)
 {
-    FILE *f = fopen(id->name, "w");
+    FILE *f;
     struct rc_entry tmp;
     int ret;
 
+#ifdef RC_HASH
+    if (id->type == RC_TYPE_HASH)
+	return hash_initialize(context, id, auth_lifespan);
+#endif
+    f = fopen(id->name, "w");
     if(f == NULL) {
 	char buf[128];
 	ret = errno;
@@ -173,6 +212,10 @@ KRB5_LIB_FUNCTION krb5_error_code KRB5_LIB_CALL
 krb5_rc_close(krb5_context context,
 	      krb5_rcache id)
 {
+#ifdef RC_HASH
+    if (id->type == RC_TYPE_HASH)
+	hash_close(id);
+#endif
     free(id->name);
     free(id);
     return 0;
@@ -197,6 +240,390 @@ checksum_authenticator(Authenticator *auth, void *data)
     EVP_MD_CTX_destroy(m);
 }
 
+#ifdef RC_HASH
+
+/*
+ * The HASH replay cache keeps the authenticator checksums in a file
+ * that is mapped into memory and used as a set of hash tables:
+ *
+ *   header | table 0 (N slots) | table 1 (2N slots) | table 2 (4N) ...
+ *
+ * Each table is divided into buckets of RC_HASH_BUCKET slots and a
+ * checksum can only live in the bucket its hash selects in each table.
+ * Slots whose time stamp is older than the lifespan are free, so
+ * entries expire without any clean-up pass.  A new table, twice the
+ * size of the last, is appended only when a checksum's bucket is full
+ * of live entries in every table.
+ *
+ * Writers lock the byte ranges of the buckets they look at, always in
+ * table order, and the header when adding a table.  Slots are fixed
+ * size and the time stamp is written after the checksum, so a
+ * process dying half way through an update leaves at worst a slot
+ * that does not match anything.
+ */
+
+#define RC_HASH_MAGIC		0x48524331	/* "HRC1" */
+#define RC_HASH_SLOTS		4096
+#define RC_HASH_BUCKET		16
+#define RC_HASH_MAX_TABLES	12
+
+struct rc_hash_header {
+    uint32_t magic;
+    uint32_t ntables;
+    int64_t lifespan;
+    uint32_t slots;		/* slots in the first table */
+    uint32_t pad[11];
+};
+
+struct rc_hash_slot {
+    int64_t stamp;
+    unsigned char data[16];
+};
+
+/* fcntl locks are per process, this keeps our own threads apart */
+static HEIMDAL_MUTEX rc_hash_mutex = HEIMDAL_MUTEX_INITIALIZER;
+
+#define RC_HDR(id) ((volatile struct rc_hash_header *)(id)->map)
+
+static size_t
+hash_table_offset(uint32_t slots, unsigned table)
+{
+    return sizeof(struct rc_hash_header) +
+	sizeof(struct rc_hash_slot) * (size_t)slots * ((1U << table) - 1);
+}
+
+static struct rc_hash_slot *
+hash_bucket(krb5_rcache id, unsigned table, uint64_t hash)
+{
+    uint32_t slots = RC_HDR(id)->slots;
+    size_t nbuckets = ((size_t)slots << table) / RC_HASH_BUCKET;
+
+    return (struct rc_hash_slot *)((unsigned char *)id->map +
+	hash_table_offset(slots, table)) +
+	(hash % nbuckets) * RC_HASH_BUCKET;
+}
+
+static krb5_error_code
+hash_error(krb5_context context, krb5_rcache id, const char *op, int ret)
+{
+    char buf[128];
+
+    rk_strerror_r(ret, buf, sizeof(buf));
+    krb5_set_error_message(context, KRB5_RC_IO_IO, "%s(%s): %s",
+			   op, id->name, buf);
+    return KRB5_RC_IO_IO;
+}
+
+static int
+hash_lock(krb5_rcache id, off_t start, off_t len)
+{
+    struct flock l;
+
+    l.l_start = start;
+    l.l_len = len;
+    l.l_type = F_WRLCK;
+    l.l_whence = SEEK_SET;
+    while (fcntl(id->fd, F_SETLKW, &l) == -1) {
+	if (errno != EINTR)
+	    return errno;
+    }
+    return 0;
+}
+
+static int
+hash_lock_bucket(krb5_rcache id, struct rc_hash_slot *bucket)
+{
+    return hash_lock(id, (unsigned char *)bucket - (unsigned char *)id->map,
+		     RC_HASH_BUCKET * sizeof(*bucket));
+}
+
+/*
+ * Make sure the mapping covers all tables listed in the header.
+ */
+
+static krb5_error_code
+hash_map(krb5_context context, krb5_rcache id)
+{
+    struct stat sb;
+    void *map;
+
+    if (id->map != NULL &&
+	hash_table_offset(RC_HDR(id)->slots, RC_HDR(id)->ntables) <= id->maplen)
+	return 0;
+
+    if (fstat(id->fd, &sb) == -1)
+	return hash_error(context, id, "fstat", errno);
+    map = mmap(NULL, sb.st_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+	       id->fd, 0);
+    if (map == MAP_FAILED)
+	return hash_error(context, id, "mmap", errno);
+    if (id->map != NULL)
+	munmap(id->map, id->maplen);
+    id->map = map;
+    id->maplen = sb.st_size;
+    return 0;
+}
+
+/*
+ * Open the file, creating it with an empty first table if needed.
+ * Called with rc_hash_mutex held.
+ */
+
+static krb5_error_code
+hash_open(krb5_context context, krb5_rcache id, krb5_deltat lifespan)
+{
+    struct rc_hash_header hdr;
+    struct stat sb;
+    krb5_error_code ret;
+    ssize_t n;
+
+    if (id->fd != -1)
+	return 0;
+
+    id->fd = open(id->name, O_RDWR | O_CREAT | O_BINARY, 0600);
+    if (id->fd == -1)
+	return hash_error(context, id, "open", errno);
+    rk_cloexec(id->fd);
+
+    ret = hash_lock(id, 0, sizeof(hdr));
+    if (ret) {
+	ret = hash_error(context, id, "lock", ret);
+	goto out;
+    }
+    if (fstat(id->fd, &sb) == -1) {
+	ret = hash_error(context, id, "fstat", errno);
+	goto out;
+    }
+    if (sb.st_size == 0) {
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.magic = RC_HASH_MAGIC;
+	hdr.ntables = 1;
+	hdr.lifespan = lifespan;
+	hdr.slots = RC_HASH_SLOTS;
+	if (ftruncate(id->fd, hash_table_offset(hdr.slots, 1)) == -1) {
+	    ret = hash_error(context, id, "ftruncate", errno);
+	    goto out;
+	}
+	n = pwrite(id->fd, &hdr, sizeof(hdr), 0);
+	if (n != sizeof(hdr)) {
+	    ret = hash_error(context, id, "write", n < 0 ? errno : EIO);
+	    goto out;
+	}
+    } else {
+	n = pread(id->fd, &hdr, sizeof(hdr), 0);
+	if (n != sizeof(hdr) || hdr.magic != RC_HASH_MAGIC ||
+	    hdr.slots < RC_HASH_BUCKET || hdr.slots % RC_HASH_BUCKET ||
+	    hdr.ntables == 0 || hdr.ntables > RC_HASH_MAX_TABLES ||
+	    (size_t)sb.st_size < hash_table_offset(hdr.slots, hdr.ntables)) {
+	    ret = KRB5_RC_IO_UNKNOWN;
+	    krb5_set_error_message(context, ret,
+				   N_("%s is not a replay cache", ""),
+				   id->name);
+	    goto out;
+	}
+    }
+    ret = hash_map(context, id);
+
+ out:
+    _krb5_xunlock(context, id->fd);
+    if (ret) {
+	close(id->fd);
+	id->fd = -1;
+    }
+    return ret;
+}
+
+static void
+hash_close(krb5_rcache id)
+{
+    HEIMDAL_MUTEX_lock(&rc_hash_mutex);
+    if (id->map != NULL)
+	munmap(id->map, id->maplen);
+    if (id->fd != -1)
+	close(id->fd);
+    id->map = NULL;
+    id->fd = -1;
+    HEIMDAL_MUTEX_unlock(&rc_hash_mutex);
+}
+
+/*
+ * Mark all slots free and set the lifespan.  The file is never
+ * truncated since other processes may have it mapped.
+ */
+
+static krb5_error_code
+hash_initialize(krb5_context context, krb5_rcache id, krb5_deltat lifespan)
+{
+    krb5_error_code ret;
+    unsigned i;
+
+    HEIMDAL_MUTEX_lock(&rc_hash_mutex);
+    ret = hash_open(context, id, lifespan);
+    if (ret == 0)
+	ret = hash_lock(id, 0, 0);
+    if (ret == 0) {
+	ret = hash_map(context, id);
+	if (ret == 0) {
+	    for (i = 0; i < RC_HDR(id)->ntables; i++)
+		memset((unsigned char *)id->map +
+		       hash_table_offset(RC_HDR(id)->slots, i), 0,
+		       sizeof(struct rc_hash_slot) *
+		       ((size_t)RC_HDR(id)->slots << i));
+	    RC_HDR(id)->lifespan = lifespan;
+	}
+	_krb5_xunlock(context, id->fd);
+    } else if (id->fd != -1)
+	ret = hash_error(context, id, "lock", ret);
+    HEIMDAL_MUTEX_unlock(&rc_hash_mutex);
+    return ret;
+}
+
+static krb5_error_code
+hash_store(krb5_context context, krb5_rcache id, krb5_donot_replay *rep)
+{
+    struct rc_hash_slot *bucket, *slot;
+    size_t free_off = 0;
+    unsigned ntables, i, j;
+    krb5_error_code ret;
+    int64_t now, oldest;
+    unsigned char data[16];
+    uint64_t hash = 0;
+
+    now = time(NULL);
+    checksum_authenticator(rep, data);
+    for (i = 0; i < 8; i++)
+	hash = (hash << 8) | data[i];
+
+    HEIMDAL_MUTEX_lock(&rc_hash_mutex);
+
+    ret = hash_open(context, id, context->max_skew);
+    if (ret)
+	goto out;
+
+    /* the first bucket lock serialises stores of the same checksum */
+    ret = hash_lock_bucket(id, hash_bucket(id, 0, hash));
+    if (ret) {
+	ret = hash_error(context, id, "lock", ret);
+	goto out;
+    }
+
+    i = 0;
+    for (;;) {
+	ret = hash_map(context, id);
+	if (ret)
+	    goto unlock;
+	ntables = RC_HDR(id)->ntables;
+	oldest = now - RC_HDR(id)->lifespan;
+
+	for (; i < ntables; i++) {
+	    bucket = hash_bucket(id, i, hash);
+	    if (i > 0 && (ret = hash_lock_bucket(id, bucket)) != 0) {
+		ret = hash_error(context, id, "lock", ret);
+		goto unlock;
+	    }
+	    for (j = 0; j < RC_HASH_BUCKET; j++) {
+		slot = &bucket[j];
+		if (slot->stamp < oldest) {
+		    if (free_off == 0)
+			free_off = (unsigned char *)slot -
+			    (unsigned char *)id->map;
+		    continue;
+		}
+		if (memcmp(slot->data, data, sizeof(data)) == 0) {
+		    krb5_clear_error_message(context);
+		    ret = KRB5_RC_REPLAY;
+		    goto unlock;
+		}
+	    }
+	}
+	if (free_off != 0)
+	    break;
+
+	/* no room, add a table unless someone else just did */
+	ret = hash_lock(id, 0, sizeof(struct rc_hash_header));
+	if (ret) {
+	    ret = hash_error(context, id, "lock", ret);
+	    goto unlock;
+	}
+	if (RC_HDR(id)->ntables != ntables)
+	    continue;
+	if (ntables >= RC_HASH_MAX_TABLES) {
+	    ret = KRB5_RC_IO_SPACE;
+	    krb5_set_error_message(context, ret,
+				   N_("replay cache %s is full", ""),
+				   id->name);
+	    goto unlock;
+	}
+	if (ftruncate(id->fd,
+		      hash_table_offset(RC_HDR(id)->slots, ntables + 1)) == -1) {
+	    ret = hash_error(context, id, "ftruncate", errno);
+	    goto unlock;
+	}
+	RC_HDR(id)->ntables = ntables + 1;
+    }
+
+    slot = (struct rc_hash_slot *)((unsigned char *)id->map + free_off);
+    memcpy(slot->data, data, sizeof(data));
+    slot->stamp = now;
+
+ unlock:
+    _krb5_xunlock(context, id->fd);
+ out:
+    HEIMDAL_MUTEX_unlock(&rc_hash_mutex);
+    return ret;
+}
+
+/*
+ * Clear the slots of expired entries.  Not needed for correctness,
+ * but keeps old checksums from lingering in the file.
+ */
+
+static krb5_error_code
+hash_expunge(krb5_context context, krb5_rcache id)
+{
+    struct rc_hash_slot *slot, *end;
+    krb5_error_code ret;
+    int64_t oldest;
+
+    HEIMDAL_MUTEX_lock(&rc_hash_mutex);
+    ret = hash_open(context, id, context->max_skew);
+    if (ret == 0 && (ret = hash_lock(id, 0, 0)) != 0)
+	ret = hash_error(context, id, "lock", ret);
+    if (ret == 0) {
+	ret = hash_map(context, id);
+	if (ret == 0) {
+	    oldest = time(NULL) - RC_HDR(id)->lifespan;
+	    slot = (struct rc_hash_slot *)((unsigned char *)id->map +
+					   sizeof(struct rc_hash_header));
+	    end = (struct rc_hash_slot *)((unsigned char *)id->map +
+		hash_table_offset(RC_HDR(id)->slots, RC_HDR(id)->ntables));
+	    for (; slot < end; slot++) {
+		if (slot->stamp != 0 && slot->stamp < oldest)
+		    memset(slot, 0, sizeof(*slot));
+	    }
+	}
+	_krb5_xunlock(context, id->fd);
+    }
+    HEIMDAL_MUTEX_unlock(&rc_hash_mutex);
+    return ret;
+}
+
+static krb5_error_code
+hash_get_lifespan(krb5_context context, krb5_rcache id,
+		  krb5_deltat *auth_lifespan)
+{
+    krb5_error_code ret;
+
+    HEIMDAL_MUTEX_lock(&rc_hash_mutex);
+    ret = hash_open(context, id, context->max_skew);
+    if (ret == 0)
+	*auth_lifespan = RC_HDR(id)->lifespan;
+    HEIMDAL_MUTEX_unlock(&rc_hash_mutex);
+    return ret;
+}
+
+#endif /* RC_HASH */
+
 KRB5_LIB_FUNCTION krb5_error_code KRB5_LIB_CALL
 krb5_rc_store(krb5_context context,
 	      krb5_rcache id,
@@ -208,6 +635,10 @@ krb5_rc_store(krb5_context context,
     int ret;
     size_t count;
 
+#ifdef RC_HASH
+    if (id->type == RC_TYPE_HASH)
+	return hash_store(context, id, rep);
+#endif
     ent.stamp = time(NULL);
     checksum_authenticator(rep, ent.data);
     f = fopen(id->name, "r");
@@ -259,6 +690,10 @@ KRB5_LIB_FUNCTION krb5_error_code KRB5_LIB_CALL
 krb5_rc_expunge(krb5_context context,
 		krb5_rcache id)
 {
+#ifdef RC_HASH
+    if (id->type == RC_TYPE_HASH)
+	return hash_expunge(context, id);
+#endif
     return 0;
 }
 
@@ -267,9 +702,19 @@ krb5_rc_get_lifespan(krb5_context context,
 		     krb5_rcache id,
 		     krb5_deltat *auth_lifespan)
 {
-    FILE *f = fopen(id->name, "r");
+    FILE *f;
     int r;
     struct rc_entry ent;
+
+#ifdef RC_HASH
+    if (id->type == RC_TYPE_HASH)
+	return hash_get_lifespan(context, id, auth_lifespan);
+#endif
+    f = fopen(id->name, "r");
+    if (f == NULL) {
+	krb5_clear_error_message (context);
+	return KRB5_RC_IO_UNKNOWN;
+    }
     r = fread(&ent, sizeof(ent), 1, f);
     fclose(f);
     if(r){
@@ -291,7 +736,7 @@ KRB5_LIB_FUNCTION const char* KRB5_LIB_CALL
 krb5_rc_get_type(krb5_context context,
 		 krb5_rcache id)
 {
-    return "FILE";
+    return id->type == RC_TYPE_HASH ? "HASH" : "FILE";
 }
 
 KRB5_LIB_FUNCTION krb5_error_code KRB5_LIB_CALL
@@ -1089,7 +1089,9 @@ krb5_sendto_context(krb5_context context,
     int numreset = 0;
 
     krb5_data_zero(receive);
-    
+
+    HEIM_PROBE2(krb5, sendto__start, realm, send_data->length);
+
     if (ctx == NULL) {
 	ret = krb5_sendto_ctx_alloc(context, &ctx);
 	if (ret)
@@ -1222,6 +1224,12 @@ krb5_sendto_context(krb5_context context,
 		if (ret)
 		    goto out;
 	    }
+	    /*
+	     * The filter ignored this reply (KDC_ERR_SVC_UNAVAILABLE), drop
+	     * it or wait_response() would hand it back at once.
+	     */
+	    if (action == KRB5_SENDTO_CONTINUE)
+		krb5_data_free(&ctx->response);
 	    break;
 	case KRB5_SENDTO_FAILED:
 	    ret = KRB5_KDC_UNREACH;
@@ -1261,6 +1269,9 @@ out:
 		(long long)ctx->stats.krbhst.tv_sec,
 		(unsigned long)ctx->stats.krbhst.tv_usec, ctx->stid);
 
+    HEIM_PROBE4(krb5, sendto__done, realm, ret, receive->length,
+		ctx->stats.num_hosts);
+
 
     if (freectx)
 	krb5_sendto_ctx_free(context, ctx);
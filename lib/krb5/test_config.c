@@ -237,10 +237,87 @@ check_escaped_strings(void)
     krb5_free_context(context);
 }
 
+/*
+ * A copied context must carry the settings of the configuration and
+ * keep the ignore and extra address lists apart.
+ */
+
+static void
+check_copy_context(void)
+{
+    static const char *fn = "test_config_copy.conf";
+    char *files[2];
+    krb5_context context, copy;
+    krb5_addresses addrs, got;
+    krb5_error_code ret;
+    FILE *f;
+
+    f = fopen(fn, "w");
+    if (f == NULL)
+	err(1, "%s", fn);
+    fprintf(f, "[libdefaults]\n\tclockskew = 123\n\tkdc_timeout = 17\n"
+	    "\tmax_retries = 7\n");
+    fclose(f);
+
+    ret = krb5_init_context(&context);
+    if (ret)
+	errx(1, "krb5_init_context %d", ret);
+    files[0] = rk_UNCONST(fn);
+    files[1] = NULL;
+    ret = krb5_set_config_files(context, files);
+    if (ret)
+	krb5_err(context, 1, ret, "krb5_set_config_files");
+
+    ret = krb5_parse_address(context, "127.0.0.2", &addrs);
+    if (ret)
+	krb5_err(context, 1, ret, "krb5_parse_address");
+    ret = krb5_set_ignore_addresses(context, &addrs);
+    if (ret)
+	krb5_err(context, 1, ret, "krb5_set_ignore_addresses");
+    krb5_free_addresses(context, &addrs);
+
+    ret = krb5_copy_context(context, &copy);
+    if (ret)
+	krb5_err(context, 1, ret, "krb5_copy_context");
+    krb5_free_context(context);
+    unlink(fn);
+
+    if (krb5_get_max_time_skew(copy) != 123)
+	krb5_errx(copy, 1, "copy has clockskew %ld",
+		  (long)krb5_get_max_time_skew(copy));
+    if (copy->kdc_timeout != 17 || copy->max_retries != 7)
+	krb5_errx(copy, 1, "copy has kdc_timeout %ld max_retries %d",
+		  (long)copy->kdc_timeout, copy->max_retries);
+    if (krb5_config_get_int(copy, NULL, "libdefaults", "clockskew",
+			    NULL) != 123)
+	krb5_errx(copy, 1, "copy lost the configuration");
+
+    ret = krb5_get_ignore_addresses(copy, &got);
+    if (ret)
+	krb5_err(copy, 1, ret, "krb5_get_ignore_addresses");
+    if (got.len != 1)
+	krb5_errx(copy, 1, "copy has %u ignore addresses", got.len);
+    krb5_free_addresses(copy, &got);
+    ret = krb5_get_extra_addresses(copy, &got);
+    if (ret)
+	krb5_err(copy, 1, ret, "krb5_get_extra_addresses");
+    if (got.len != 0)
+	krb5_errx(copy, 1, "copy has %u extra addresses", got.len);
+    krb5_free_addresses(copy, &got);
+
+#ifdef PKINIT
+    if (copy->hx509ctx == NULL)
+	krb5_errx(copy, 1, "copy has no hx509 context");
+#endif
+
+    krb5_free_context(copy);
+}
+
 int
 main(int argc, char **argv)
 {
     check_config_files();
     check_escaped_strings();
+    check_copy_context();
     return 0;
 }
@@ -0,0 +1,153 @@
+/*
+ * Copyright (c) 2026 Kungliga Tekniska Högskolan
+ * (Royal Institute of Technology, Stockholm, Sweden).
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the Institute nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE INSTITUTE AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE INSTITUTE OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Check that an ASYNC: log destination is written out when the
+ * program leaves with exit() or krb5_err() without closing the log,
+ * including in a child forked after the writer thread has started.
+ */
+
+#include "krb5_locl.h"
+#include <err.h>
+#ifdef HAVE_SYS_WAIT_H
+#include <sys/wait.h>
+#endif
+
+#define NLINES 1000
+
+static char filename[64];
+
+enum how { DO_EXIT, DO_ERR, DO_FORK };
+
+static void
+child(const char *tag, enum how how)
+{
+    krb5_log_facility *fac;
+    krb5_context context;
+    krb5_error_code ret;
+    char *dest;
+    pid_t pid;
+    int i;
+
+    ret = krb5_init_context(&context);
+    if (ret)
+	errx(1, "krb5_init_context %d", ret);
+    if (asprintf(&dest, "0-/ASYNC:%s", filename) < 0 || dest == NULL)
+	errx(1, "out of memory");
+    ret = krb5_initlog(context, "test_log", &fac);
+    if (ret == 0)
+	ret = krb5_addlog_dest(context, fac, dest);
+    if (ret)
+	krb5_err(context, 1, ret, "krb5_addlog_dest");
+    krb5_set_warn_dest(context, fac);
+
+    for (i = 0; i < NLINES; i++)
+	krb5_log(context, fac, 0, "%s line %d", tag, i);
+
+    switch (how) {
+    case DO_EXIT:
+	break;
+    case DO_ERR:
+	krb5_errx(context, 3, "%s line %d", tag, NLINES);
+	/* NOTREACHED */
+    case DO_FORK:
+	/* The writer is running; the grandchild needs its own */
+	pid = fork();
+	if (pid < 0)
+	    err(1, "fork");
+	for (i = 0; i < NLINES; i++)
+	    krb5_log(context, fac, 0, "%s line %d", tag, i);
+	if (pid == 0)
+	    exit(0);
+	if (waitpid(pid, &i, 0) != pid || !WIFEXITED(i) || WEXITSTATUS(i) != 0)
+	    errx(1, "grandchild failed");
+	break;
+    }
+    exit(0);
+}
+
+static int
+count_lines(const char *tag)
+{
+    char buf[256], *p;
+    size_t tlen = strlen(tag);
+    int n = 0;
+    FILE *f;
+
+    f = fopen(filename, "r");
+    if (f == NULL)
+	return 0;
+    while (fgets(buf, sizeof(buf), f) != NULL) {
+	p = strchr(buf, ' ');
+	if (p != NULL && strncmp(p + 1, tag, tlen) == 0 && p[1 + tlen] == ' ')
+	    n++;
+    }
+    fclose(f);
+    return n;
+}
+
+static void
+check(const char *tag, enum how how, int expected)
+{
+    int status, n;
+    pid_t pid;
+
+    pid = fork();
+    if (pid < 0)
+	err(1, "fork");
+    if (pid == 0)
+	child(tag, how);
+    if (waitpid(pid, &status, 0) != pid)
+	err(1, "waitpid");
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != (how == DO_ERR ? 3 : 0))
+	errx(1, "%s: child exited with status %d", tag, status);
+    n = count_lines(tag);
+    if (n != expected)
+	errx(1, "%s: %d lines in %s, expected %d", tag, n, filename, expected);
+}
+
+int
+main(int argc, char **argv)
+{
+    setprogname(argv[0]);
+
+    snprintf(filename, sizeof(filename), "test_log.%ld.out", (long)getpid());
+    unlink(filename);
+
+    check("exit", DO_EXIT, NLINES);
+    check("err", DO_ERR, NLINES + 1);
+    check("fork", DO_FORK, 3 * NLINES);
+
+    unlink(filename);
+    return 0;
+}
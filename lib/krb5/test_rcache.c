@@ -0,0 +1,142 @@
+/*
+ * Copyright (c) 2026 Kungliga Tekniska Högskolan
+ * (Royal Institute of Technology, Stockholm, Sweden).
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the Institute nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE INSTITUTE AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE INSTITUTE OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include "krb5_locl.h"
+#include <err.h>
+
+static void
+make_authenticator(Authenticator *auth, int n)
+{
+    static char *comp[] = { "host", "test.h5l.se" };
+    static char realm[] = "TEST.H5L.SE";
+
+    memset(auth, 0, sizeof(*auth));
+    auth->authenticator_vno = 5;
+    auth->crealm = realm;
+    auth->cname.name_type = KRB5_NT_SRV_HST;
+    auth->cname.name_string.len = 2;
+    auth->cname.name_string.val = comp;
+    auth->ctime = 1000000000 + n / 1000000;
+    auth->cusec = n % 1000000;
+}
+
+static void
+check_rcache(krb5_context context, const char *name, int count)
+{
+    Authenticator auth;
+    krb5_error_code ret;
+    krb5_deltat lifespan;
+    krb5_rcache id;
+    int i;
+
+    ret = krb5_rc_resolve_full(context, &id, name);
+    if (ret == KRB5_RC_TYPE_NOTFOUND) {
+	printf("%s: replay cache type not supported\n", name);
+	return;
+    }
+    if (ret)
+	krb5_err(context, 1, ret, "krb5_rc_resolve_full: %s", name);
+
+    ret = krb5_rc_initialize(context, id, 300);
+    if (ret)
+	krb5_err(context, 1, ret, "krb5_rc_initialize: %s", name);
+
+    ret = krb5_rc_get_lifespan(context, id, &lifespan);
+    if (ret)
+	krb5_err(context, 1, ret, "krb5_rc_get_lifespan: %s", name);
+    if (lifespan != 300)
+	krb5_errx(context, 1, "%s: lifespan %d, expected 300",
+		  name, (int)lifespan);
+
+    for (i = 0; i < count; i++) {
+	make_authenticator(&auth, i);
+	ret = krb5_rc_store(context, id, &auth);
+	if (ret)
+	    krb5_err(context, 1, ret, "krb5_rc_store %d: %s", i, name);
+    }
+
+    for (i = 0; i < count; i += count / 10 + 1) {
+	make_authenticator(&auth, i);
+	ret = krb5_rc_store(context, id, &auth);
+	if (ret != KRB5_RC_REPLAY)
+	    krb5_errx(context, 1, "%s: replay %d not detected (%d)",
+		      name, i, ret);
+    }
+
+    ret = krb5_rc_expunge(context, id);
+    if (ret)
+	krb5_err(context, 1, ret, "krb5_rc_expunge: %s", name);
+
+    /* expunge must not drop live entries */
+    make_authenticator(&auth, count - 1);
+    ret = krb5_rc_store(context, id, &auth);
+    if (ret != KRB5_RC_REPLAY)
+	krb5_errx(context, 1, "%s: replay after expunge not detected (%d)",
+		  name, ret);
+
+    /* a new handle sees what the old one stored */
+    ret = krb5_rc_close(context, id);
+    if (ret)
+	krb5_err(context, 1, ret, "krb5_rc_close: %s", name);
+    ret = krb5_rc_resolve_full(context, &id, name);
+    if (ret)
+	krb5_err(context, 1, ret, "krb5_rc_resolve_full: %s", name);
+    make_authenticator(&auth, 0);
+    ret = krb5_rc_store(context, id, &auth);
+    if (ret != KRB5_RC_REPLAY)
+	krb5_errx(context, 1, "%s: replay after reopen not detected (%d)",
+		  name, ret);
+
+    ret = krb5_rc_destroy(context, id);
+    if (ret)
+	krb5_err(context, 1, ret, "krb5_rc_destroy: %s", name);
+}
+
+int
+main(int argc, char **argv)
+{
+    krb5_context context;
+    krb5_error_code ret;
+
+    ret = krb5_init_context(&context);
+    if (ret)
+	errx(1, "krb5_init_context %d", ret);
+
+    check_rcache(context, "FILE:test-rcache-file", 100);
+    /* enough entries to need more than one table */
+    check_rcache(context, "HASH:test-rcache-hash", 20000);
+
+    krb5_free_context(context);
+
+    return 0;
+}